@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
@@ -36,10 +38,14 @@
 #include <sys/sem.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <limits.h>
 #include <curses.h>
 
+#include "mpsc_ring.h"
+
 /* ===== Config ===== */
 typedef struct {
     char conf_path[PATH_MAX];
@@ -49,6 +55,18 @@ typedef struct {
     char lock_dir[PATH_MAX];      /* NUEVO: directorio de locks por archivo */
     int  remote_port;              // puerto del servidor remoto
     char remote_allowed[1024];// CSV de IPs permitidas (lado servidor)
+    int  log_mode;                 /* LOG_MODE_BUFFERED | _DURABLE | _ASYNC | _SHARED */
+    int  log_flush_ms;             /* antigüedad máxima de una línea en el buffer */
+    int  log_ring_slots;           /* celdas del anillo en modo async (potencia de 2) */
+    long long log_max_bytes;       /* tamaño que dispara la rotación (0 = sin rotar) */
+    int  log_binary;               /* 1 = también escribir la bitácora binaria */
+    int  admission_wait_sec;       /* con MAX_INSTANCES lleno: segundos en cola (0 = rechazar) */
+    int  ipc_slots;                /* casillas del segmento compartido; sólo cuenta al crearlo */
+    /* identidad del archivo cargado, para detectar cambios (config_reload) */
+    dev_t conf_dev;
+    ino_t conf_ino;
+    off_t conf_size;
+    struct timespec conf_mtime;
 } Config;
 
 #define PROGRAM_NAME     "uamashell"
@@ -56,34 +74,191 @@ typedef struct {
 #define DEFAULT_LOG_DIR  "var/log"
 #define ERROR_LOG_NAME   PROGRAM_NAME "_error.log"
 #define CMD_LOG_NAME     PROGRAM_NAME ".log"
-#define FTOK_PATH        "/tmp/uamashell_ftok"
+#ifndef FTOK_PATH
+#define FTOK_PATH        "/tmp/uamashell_ftok"   /* las pruebas usan otro (ver Makefile) */
+#endif
 #define FTOK_PROJ_ID     'K'
+#define PLAIN_OUT_BUF    65536          /* buffer de stdout y del relevo de salida de comandos */
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+/* ===== Bitácoras ===== */
+#define LOG_MODE_BUFFERED  0      /* rendimiento: se acumula y se vacía por tamaño/tiempo */
+#define LOG_MODE_DURABLE   1      /* write + fdatasync por cada línea */
+#define LOG_MODE_ASYNC     2      /* anillo sin candados + hilo escritor */
+#define LOG_MODE_SHARED    3      /* anillo en memoria compartida + una instancia escribe por todas */
+#define LOG_BUF_SIZE       65536
+#define LOG_LINE_MAX       2048
+#define DEFAULT_LOG_FLUSH_MS 1000
+#define DEFAULT_LOG_RING_SLOTS 1024
+#define LOG_RING_SLOTS_MAX 65536       /* cada celda ocupa ~2 KiB: tope de ~130 MiB */
+#define LOG_SHM_SLOTS      2048   /* celdas del anillo compartido (potencia de 2) */
+#define LOG_SHM_PROJ_ID    'L'    /* ftok del segmento de bitácora compartida */
+#define LOG_ROTATE_GRACE_MS 2000  /* espera antes de comprimir un segmento recién rotado */
+
+/* Bitácora binaria: registros de tamaño fijo + cadenas internadas + índice por tiempo */
+#define BINLOG_NAME        PROGRAM_NAME ".bin"
+#define BINLOG_REC_MAGIC   0x55424c52u    /* "UBLR" */
+#define BINLOG_BUCKET_SEC  60
+
+typedef struct {
+    uint32_t magic;          /* BINLOG_REC_MAGIC */
+    uint8_t  kind;           /* 0 = CMD, 1 = ERR */
+    uint8_t  pad[3];
+    int64_t  ts_us;          /* época en microsegundos */
+    int32_t  pid;
+    uint32_t uid;
+    int32_t  status;         /* código de salida, -1 si no aplica */
+    uint32_t duration_ms;
+    uint64_t user, tty, ip, cmd;   /* id en .str (desplazamiento + 1), 0 = vacío */
+} BinLogRecord;
+
+typedef struct {
+    int64_t  bucket_start;   /* segundos de época, múltiplo de BINLOG_BUCKET_SEC */
+    uint64_t offset;         /* primer registro de esa cubeta escrito por algún proceso */
+} BinLogIndexEntry;
+
+typedef struct {
+    const char *cmd;         /* comando tal cual (se interna en vez del mensaje) */
+    int  status;
+    long duration_ms;
+} LogMeta;
+
+typedef struct {
+    int      mode;
+    uint64_t ring_slots;          /* 0 si no está en modo async */
+    uint64_t pending;             /* registros en el anillo aún sin escribir */
+    uint64_t dropped;             /* registros descartados por anillo lleno */
+    uint64_t unwritten;           /* registros que el escritor no pudo escribir (sin fd o error) */
+    uint64_t overflow;            /* modo shared: registros escritos directo por anillo lleno */
+    pid_t    flusher_pid;         /* modo shared: instancia que escribe a disco */
+} LogStats;
+
 #ifndef NOTIF_MAX
-#define NOTIF_MAX 64
+#define NOTIF_MAX 64               /* avisos broadcast retenidos (anillo compartido) */
 #endif
+#define NOTIF_MAILBOX_SLOTS 16     /* avisos pendientes por instancia; potencia de 2 */
+#define NOTIF_SIGNAL SIGUSR1       /* notif_push despierta así a la instancia destino */
 
 typedef struct {
     pid_t to_pid;         /* 0 = broadcast o PID destino */
     char  text[256];      /* mensaje a mostrar */
 } Notification;
 
+/* Celda de buzón (MpscRing) o del anillo broadcast; seq va primero como pide mpsc_ring.h */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint32_t gen;         /* generación de la casilla destino al encolar (buzones) */
+    Notification n;
+} NotifCell;
+
+/* Buzón de una instancia: muchos productores (cualquier instancia), un consumidor (su dueña) */
+typedef struct {
+    MpscRing  ring;
+    NotifCell cells[NOTIF_MAILBOX_SLOTS];
+} NotifMailbox;
+
+/* Config publicada para todas las instancias. seqlock: seq es impar mientras alguien la copia;
+ * un lector que ve el mismo seq par antes y después de copiar tiene una copia consistente. */
+#define CONFIG_STAT_INTERVAL_MS 1000   /* cada cuánto revisar el .conf editado a mano */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t generation;           /* publicaciones hechas */
+    Config   cfg;
+} SharedConfig;
+
+/* Contadores de una instancia. Sólo los escribe su dueña (atómicos relajados) y cualquiera los
+ * lee sin candado; cada bloque ocupa sus propias líneas de caché para no compartirlas. */
+typedef struct {
+    alignas(64) _Atomic uint64_t cmds;       /* comandos ejecutados (internos + externos) */
+    _Atomic uint64_t builtins;
+    _Atomic uint64_t externals;
+    _Atomic uint64_t lat_total_us;           /* latencia acumulada de los comandos */
+    _Atomic uint64_t lat_max_us;
+    _Atomic uint64_t lock_conflicts;         /* comandos rechazados por lock de archivo */
+    _Atomic uint64_t notif_sent;
+    _Atomic uint64_t notif_recv;
+    _Atomic uint64_t log_bytes;              /* bytes de texto enviados a las bitácoras */
+} InstanceStats;
+
+static inline void stat_add(_Atomic uint64_t *c, uint64_t n){
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+static inline void stat_max(_Atomic uint64_t *c, uint64_t v){
+    if(v > atomic_load_explicit(c, memory_order_relaxed))        /* un solo escritor */
+        atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
 // ---------------- Memoria Compartida ----------------
-#define MAX_PIDS 256
+/*
+ * Segmento POSIX (shm_open + mmap) con un encabezado que lo describe: la parte fija
+ * (SharedState) y, en los desplazamientos que indica hdr, tablas de nslots casillas y el anillo
+ * broadcast. nslots sale de IPC_SLOTS al crearlo. Un binario con otro SHM_LAYOUT_VERSION o con
+ * otros tamaños de estructura se niega a usarlo (ver ipc_init).
+ */
+#define SHM_NAME_FMT "/uamashell.%08x"   /* %x = ftok(FTOK_PATH, FTOK_PROJ_ID) */
+#define SHM_MAGIC 0x4b465348u              /* hdr.magic: el creador terminó de inicializar */
+#define SHM_LAYOUT_VERSION 3               /* subir con cada cambio de formato del segmento */
+#define DEFAULT_IPC_SLOTS 256
+
+/* Casilla de la tabla de instancias. pid y gen se leen sin mutex (notif_push); el resto, con él. */
 typedef struct {
-    int instance_count;
-    pid_t pids[MAX_PIDS];
-    Notification notif[NOTIF_MAX];
-    int notif_count;
+    _Atomic pid_t    pid;        /* 0 = libre */
+    _Atomic uint32_t gen;        /* sube cada vez que se ocupa: distingue al ocupante actual */
+    int32_t  next_free;          /* siguiente casilla libre (-1 = fin); sólo si pid == 0 */
+    int32_t  live_pos;           /* posición en live[]; sólo si pid != 0 */
+    uint64_t start_time;         /* arranque del proceso (/proc/<pid>/stat): detecta PID reutilizado */
+} InstanceSlot;
+
+typedef struct {
+    _Atomic uint32_t magic;      /* SHM_MAGIC; lo último que escribe el creador */
+    uint32_t version;            /* SHM_LAYOUT_VERSION del creador */
+    uint32_t fixed_size;         /* sizeof(SharedState) del creador */
+    uint32_t nslots;             /* casillas de instancia (slots, adm_queue, stats, mbox) */
+    uint32_t nbcast;             /* celdas del anillo broadcast */
+    uint32_t npidx;              /* celdas del índice pid -> casilla (potencia de 2, >= 2*nslots) */
+    pid_t    creator;            /* si muere antes de poner magic, otro rehace el segmento */
+    uint64_t size;               /* bytes del segmento */
+    uint64_t off_slots, off_queue, off_stats, off_mbox, off_bcast;   /* desde el inicio */
+    uint64_t off_pidx, off_live;
+} ShmHeader;
+
+typedef struct {
+    ShmHeader hdr;
+    /* guarda de los campos siguientes y de slots/adm_queue (salvo config, que usa su seqlock):
+     * mutex robusto compartido entre procesos; sin contención no entra al kernel */
+    pthread_mutex_t lock;
+    _Atomic uint32_t lock_reinit;  /* alguien reinicializa el mutex (ENOTRECOVERABLE) */
+    int instance_count;          /* = casillas ocupadas, listadas en live[0..instance_count) */
+    int32_t free_head;           /* lista de casillas libres (-1 = vacía) */
+    /* índice pid -> casilla (hash abierto, sondeo lineal): se escribe con el mutex y se lee sin
+     * él; pidx_seq queda impar mientras un borrado recorre celdas, para que el lector reintente */
+    _Atomic uint32_t pidx_seq;
+    /* cola FIFO de admisión (adm_queue[0] es el siguiente en entrar). adm_futex sube en cada
+     * salida o cambio de la cola; los que esperan duermen en él (futex compartido) */
+    int adm_len;
+    _Atomic uint32_t adm_futex;
+    /* avisos: sin mutex. mbox[i] es el buzón de slots[i]; el broadcast es un anillo que cada
+     * lector recorre con su propio cursor (bcast[pos % nbcast].seq = 2*pos+2 al publicarse) */
+    _Atomic uint64_t bcast_tail;
+    SharedConfig config;
+    /* después, según hdr: InstanceSlot slots[nslots], pid_t adm_queue[nslots],
+     * InstanceStats stats[nslots] (stats[i] es de slots[i]), NotifMailbox mbox[nslots],
+     * NotifCell bcast[nbcast], uint32_t pidx[npidx] (casilla+1, 0 = vacía),
+     * int32_t live[nslots] (casillas ocupadas, compactas) */
 } SharedState;
 
-// IDs globales del IPC (sólo visibles en cada .c)
-extern int g_sem_id;
-extern int g_shm_id;
+/* Contexto de usuario (resuelto una vez por proceso o por sesión remota) */
+typedef struct {
+    char user[64];
+    char tty[64];
+    char ip[64];
+    char prefix[256];     /* "pid=.. user=.. tty=.. ip=.." ya formateado para cada línea */
+} UserContext;
+
+// estado compartido (NULL sin IPC)
 extern SharedState *g_shared;
 extern Config g_cfg;
 
@@ -103,6 +278,8 @@ extern Config g_cfg;
 #ifndef MAX_IP_STR
 #define MAX_IP_STR 64
 #endif
+/* Protocolo 2: la salida de un comando llega en varios "OUT <m>" (1: uno solo) */
+#define REMOTE_PROTO 2
 
 
 
@@ -111,25 +288,113 @@ extern Config g_cfg;
 // config.c
 int load_config(const char *path, Config *out);
 int set_config_key(const char *path, const char *key, const char *value);
+int config_check(const char *key, const char *val);
+int config_changed(const Config *c);
+int config_reload(Config *prev);
+void config_adopt(const Config *next, Config *prev);
+unsigned long config_generation(void);
 void ensure_dirs(const char *path);
 
 // logging.c
 void log_command(const char *fmt, ...);
+void log_exec(const char *cmd, int status, long duration_ms, const char *fmt, ...);
 void log_error(const char *fmt, ...);
 void resolve_paths(char *cmd_log, size_t, char *err_log, size_t);
 void get_user_context(char *user, size_t, char *tty, size_t, char *ip, size_t);
+const UserContext *log_context(void);
+void log_set_context(const UserContext *ctx);
+int  user_context_from_hello(const char *hello, const char *peer_ip, UserContext *out);
+void log_init(void);
+void log_apply_config(const Config *prev);
+void log_flush(void);
+int  log_flush_due_ms(void);
+void log_shutdown(void);
+void log_stats(LogStats *st);
+
+// bitacora.c
+#define LOG_QUERY_MAX_FIELDS 4
+typedef struct {
+    char desde[20];                         /* "AAAA-MM-DD HH:MM:SS" o "" */
+    char hasta[20];
+    char fields[LOG_QUERY_MAX_FIELDS][80];  /* "pid=12 ", "user=ana ", "ip=10.0.0.1 " */
+    int  nfields;
+    char text[256];                         /* subcadena libre */
+    int  binary;                            /* --bin: leer la bitácora binaria */
+    int  follow;                            /* -f: seguir la bitácora en vivo */
+} LogQuery;
+int  log_list_segments(const char *live_path, char ***paths);
+void log_free_segments(char **paths, int n);
+int  log_dump(const char *live_path, FILE *out);
+int  log_query_parse(const char *args, LogQuery *q);
+long log_query(const char *live_path, const LogQuery *q, FILE *out);
+long log_follow(const char *live_path, const LogQuery *q, int stop_fd, FILE *out,
+                const volatile sig_atomic_t *running);
+
+/* Registro de la bitácora binaria con sus cadenas ya resueltas */
+typedef struct {
+    const BinLogRecord *rec;
+    char stamp[20];                         /* "AAAA-MM-DD HH:MM:SS" (hora local) */
+    const char *user, *tty, *ip, *cmd;
+} BinLogEntry;
+typedef void (*BinLogVisitor)(const BinLogEntry *e, void *arg);
+long binlog_scan(const char *log_dir, int kind, const LogQuery *q, BinLogVisitor visit, void *arg);
+long binlog_query(const char *log_dir, int kind, const LogQuery *q, FILE *out);
 
 // instance.c
 int ipc_init(void);
 int instance_try_enter(void);
+int instance_wait_enter(int timeout_sec);
+int  instance_slots(void);
+InstanceStats *instance_stats(void);
+int  instance_stats_snapshot(pid_t *pids, InstanceStats *out, int max);
 void instance_leave(void);
 void ipc_force_cleanup(void);
+void config_publish(const Config *c);
+int  config_snapshot(Config *out, uint64_t *generation);
+int  config_refresh(bool check_file);
 /* notificaciones (definidas en instance.c) */
 int  notif_push(pid_t to_pid, const char *msg);
-void notif_drain_for(pid_t pid);
+void notif_drain_for(pid_t pid, FILE *out);
+int  notif_wakeup_fd(void);
+void notif_wakeup_ack(int fd);
+
+// spawn.c
+#define SPAWN_LINE_MAX 4096        /* línea que se parte en palabras para ejecutarla directo */
+#define SPAWN_ARGS_MAX 256
+bool  spawn_needs_shell(const char *cmd);
+int   spawn_split(const char *cmd, char *buf, size_t bufsz, char **argv, int maxargs);
+int   spawn_argv(pid_t *pid, char *const argv[], const posix_spawn_file_actions_t *fa);
+int   spawn_shell(pid_t *pid, const char *cmd, const posix_spawn_file_actions_t *fa);
+pid_t spawn_command(const char *cmd);
+
+// pipeline.c
+#define PIPE_STAGES_MAX 16
+#define PIPE_REDIRS_MAX 8          /* por etapa */
+#define PIPE_WORDS_MAX  (SPAWN_ARGS_MAX + PIPE_STAGES_MAX)
+typedef enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP } RedirKind;
+typedef struct {
+    RedirKind   kind;
+    int         fd;                /* descriptor del hijo: [n]<, [n]>, [n]>>, [n]>&m */
+    int         dup_from;          /* REDIR_DUP: m */
+    const char *path;              /* archivo (salvo REDIR_DUP) */
+} Redirect;
+typedef struct {
+    char   **argv;                 /* dentro de Pipeline.words, terminado en NULL */
+    int      argc;
+    Redirect redir[PIPE_REDIRS_MAX];
+    int      nredir;
+} PipeStage;
+typedef struct {
+    int       nstages;
+    PipeStage st[PIPE_STAGES_MAX];
+    char     *words[PIPE_WORDS_MAX];
+    char      buf[SPAWN_LINE_MAX]; /* palabras ya sin comillas */
+} Pipeline;
+int pipeline_parse(const char *cmd, Pipeline *pl);
+int pipeline_run(const Pipeline *pl);
 
 // pager.c
-int curses_pager(const char *filepath, const char *title);
+int curses_pager(const char *filepath, const char *title, const volatile sig_atomic_t *running);
 
 // utils
 static inline void trim(char *s)
@@ -145,6 +410,10 @@ static inline void trim(char *s)
 
 /* Servidor */
 int  run_server(void);
+int  remote_allow_check(const char *csv, const char *ip);
+/* comandos internos y externos de una línea (uamashell.c) */
+int  process_one_line(const char *line, FILE *out);
+int  shell_execute_line(const char *line, FILE *out);
 
 /* Cliente */
 int  remote_connect(const char *ip, int port);
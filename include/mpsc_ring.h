@@ -0,0 +1,121 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *  - Enrique Hernández Mauricio – 2223030397
+ *  - Garrido Velázquez Iván – 2203025425
+ *  - Loaeza Sánchez Wendy Maritza – 2193042056
+ *  - Robles Pérez Luis Fernando – 2203031441
+ *
+ * Descripción:
+ *  Anillo acotado sin candados: varios productores, un solo consumidor.
+ *  Cada celda empieza con un número de secuencia atómico (esquema de Vyukov):
+ *    seq == pos        celda libre para la posición pos
+ *    seq == pos + 1    celda publicada, lista para el consumidor
+ *  Las celdas tienen tamaño fijo (stride) y el número de celdas es potencia de 2.
+ *  Sólo usa atómicos libres de candado, así que sirve dentro de un proceso o en memoria compartida.
+ */
+#ifndef UAMASHELL_MPSC_RING_H
+#define UAMASHELL_MPSC_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef struct {
+    _Atomic uint64_t head;     /* próxima posición a consumir (un solo consumidor) */
+    _Atomic uint64_t tail;     /* próxima posición a reservar (varios productores) */
+    uint64_t mask;             /* celdas - 1 */
+    size_t   stride;           /* bytes por celda */
+} MpscRing;
+
+/* Toda celda debe empezar con este campo */
+typedef struct {
+    _Atomic uint64_t seq;
+} MpscCell;
+
+static inline MpscCell *mpsc_cell(const MpscRing *r, void *cells, uint64_t pos){
+    return (MpscCell*)((char*)cells + (size_t)(pos & r->mask) * r->stride);
+}
+
+/* nslots debe ser potencia de 2 */
+static inline void mpsc_ring_init(MpscRing *r, void *cells, uint64_t nslots, size_t stride){
+    r->mask = nslots - 1;
+    r->stride = stride;
+    atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, 0, memory_order_relaxed);
+    for(uint64_t i = 0; i < nslots; i++)
+        atomic_store_explicit(&mpsc_cell(r, cells, i)->seq, i, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/* Reserva una celda; NULL si el anillo está lleno. *pos recibe la posición reservada. */
+static inline MpscCell *mpsc_ring_reserve(MpscRing *r, void *cells, uint64_t *pos){
+    uint64_t p = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for(;;){
+        MpscCell *c = mpsc_cell(r, cells, p);
+        uint64_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - p);
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&r->tail, &p, p + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                *pos = p;
+                return c;
+            }
+        } else if(diff < 0){
+            return NULL;                       /* lleno */
+        } else {
+            p = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/* Publica la celda reservada en pos */
+static inline void mpsc_ring_commit(MpscCell *c, uint64_t pos){
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Publica por CAS: falla (0) si el consumidor abandonó la celda mientras se llenaba.
+ * Necesario cuando los productores son otros procesos que pueden morir a la mitad.
+ */
+static inline int mpsc_ring_commit_cas(MpscCell *c, uint64_t pos){
+    uint64_t expected = pos;
+    return atomic_compare_exchange_strong_explicit(&c->seq, &expected, pos + 1,
+                                                   memory_order_release, memory_order_relaxed);
+}
+
+/* Consumidor: abandona la celda de head reservada y nunca publicada; 1 si la saltó */
+static inline int mpsc_ring_abandon_head(MpscRing *r, void *cells){
+    uint64_t p = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t expected = p;
+    if(!atomic_compare_exchange_strong_explicit(&mpsc_cell(r, cells, p)->seq, &expected, p + r->mask + 1,
+                                                memory_order_acq_rel, memory_order_relaxed))
+        return 0;                              /* se publicó justo a tiempo */
+    atomic_store_explicit(&r->head, p + 1, memory_order_release);
+    return 1;
+}
+
+/* Consumidor: la i-ésima celda publicada a partir de head, o NULL si aún no está lista */
+static inline MpscCell *mpsc_ring_peek(MpscRing *r, void *cells, uint64_t i){
+    uint64_t p = atomic_load_explicit(&r->head, memory_order_relaxed) + i;
+    MpscCell *c = mpsc_cell(r, cells, p);
+    if(atomic_load_explicit(&c->seq, memory_order_acquire) != p + 1) return NULL;
+    return c;
+}
+
+/* Consumidor: libera las n celdas más antiguas ya procesadas */
+static inline void mpsc_ring_release(MpscRing *r, void *cells, uint64_t n){
+    uint64_t p = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for(uint64_t i = 0; i < n; i++, p++)
+        atomic_store_explicit(&mpsc_cell(r, cells, p)->seq, p + r->mask + 1, memory_order_release);
+    atomic_store_explicit(&r->head, p, memory_order_release);
+}
+
+/* Celdas reservadas y aún no liberadas (aproximado si hay productores activos) */
+static inline uint64_t mpsc_ring_pending(MpscRing *r){
+    return atomic_load_explicit(&r->tail, memory_order_relaxed) -
+           atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+#endif /* UAMASHELL_MPSC_RING_H */
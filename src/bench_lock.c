@@ -0,0 +1,126 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *  - Enrique Hernández Mauricio – 2223030397
+ *  - Garrido Velázquez Iván – 2203025425
+ *  - Loaeza Sánchez Wendy Maritza – 2193042056
+ *  - Robles Pérez Luis Fernando – 2203031441
+ *
+ * Descripción:
+ *  Benchmark de la guarda del estado compartido: semáforo SysV (semop con SEM_UNDO, como
+ *  antes) contra el mutex robusto PTHREAD_PROCESS_SHARED que ahora vive en el segmento.
+ *  N procesos toman y sueltan la guarda ITER veces con una sección crítica corta.
+ *
+ * Uso: bin/bench_lock [procesos] [iteraciones por proceso]     (make bench: 4, 16 y 64)
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/wait.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    long counter;
+    long pad[15];          /* algo que tocar dentro de la sección crítica */
+} Shared;
+
+static Shared *g_sh;
+static int g_semid = -1;
+
+static void sem_op(int op){
+    struct sembuf sb = {0, (short)op, SEM_UNDO};
+    while(semop(g_semid, &sb, 1) == -1 && errno == EINTR) ;
+}
+
+static void critical(void){
+    g_sh->counter++;
+    for(int i = 0; i < 15; i++) g_sh->pad[i] += i;
+}
+
+static void worker_sem(long iters){
+    for(long i = 0; i < iters; i++){ sem_op(-1); critical(); sem_op(+1); }
+}
+
+static void worker_mutex(long iters){
+    for(long i = 0; i < iters; i++){
+        if(pthread_mutex_lock(&g_sh->lock) == EOWNERDEAD) pthread_mutex_consistent(&g_sh->lock);
+        critical();
+        pthread_mutex_unlock(&g_sh->lock);
+    }
+}
+
+static double now_s(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/* Lanza nproc hijos con worker y devuelve los segundos transcurridos. Los hijos esperan en
+ * un pipe a que estén todos creados, para que compitan de verdad por la guarda. */
+static double run(const char *name, void (*worker)(long), int nproc, long iters){
+    int gate[2];
+    if(pipe(gate) < 0){ perror("pipe"); exit(1); }
+    g_sh->counter = 0;
+    for(int p = 0; p < nproc; p++){
+        pid_t pid = fork();
+        if(pid == 0){
+            char c;
+            close(gate[1]);
+            while(read(gate[0], &c, 1) < 0 && errno == EINTR) ;   /* EOF = salida */
+            worker(iters);
+            _exit(0);
+        }
+        if(pid < 0){ perror("fork"); exit(1); }
+    }
+    close(gate[0]);
+    double t0 = now_s();
+    close(gate[1]);
+    while(wait(NULL) > 0) ;
+    double dt = now_s() - t0;
+    long total = (long)nproc * iters;
+    printf("%-8s procesos=%-3d ops=%-9ld %8.3f s  %8.1f ns/op  %s\n",
+           name, nproc, total, dt, dt * 1e9 / (double)total,
+           g_sh->counter == total ? "ok" : "CONTADOR INCORRECTO");
+    return dt;
+}
+
+int main(int argc, char **argv){
+    int nproc = argc > 1 ? atoi(argv[1]) : 4;
+    long iters = argc > 2 ? atol(argv[2]) : 20000;
+    if(nproc < 1 || iters < 1){ fprintf(stderr, "uso: %s [procesos] [iteraciones]\n", argv[0]); return 2; }
+
+    g_sh = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(g_sh == MAP_FAILED){ perror("mmap"); return 1; }
+
+    pthread_mutexattr_t at;
+    pthread_mutexattr_init(&at);
+    pthread_mutexattr_setpshared(&at, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&at, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&g_sh->lock, &at);
+    pthread_mutexattr_destroy(&at);
+
+    g_semid = semget(IPC_PRIVATE, 1, IPC_CREAT | 0600);
+    if(g_semid == -1){ perror("semget"); return 1; }
+    union semun { int val; struct semid_ds *buf; unsigned short *array; } arg = { .val = 1 };
+    semctl(g_semid, 0, SETVAL, arg);
+
+    double ts = run("semop", worker_sem, nproc, iters);
+    double tm = run("mutex", worker_mutex, nproc, iters);
+    printf("%-8s procesos=%-3d mutex/semop = %.2fx más rápido\n", "", nproc, ts / tm);
+
+    semctl(g_semid, 0, IPC_RMID);
+    pthread_mutex_destroy(&g_sh->lock);
+    munmap(g_sh, sizeof(Shared));
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *  - Enrique Hernández Mauricio – 2223030397
+ *  - Garrido Velázquez Iván – 2203025425
+ *  - Loaeza Sánchez Wendy Maritza – 2193042056
+ *  - Robles Pérez Luis Fernando – 2203031441
+ *
+ * Descripción:
+ *  Benchmark de la ejecución de comandos externos: fork() + execl("/bin/sh", "-c") como antes,
+ *  contra posix_spawn de /bin/sh -c y contra spawn_command() (posix_spawnp directo, lo que usa
+ *  ahora run_external para una línea sin metacaracteres). Cada variante lanza y espera ITER
+ *  veces el mismo comando; el padre puede tener MB megabytes residentes para ver cuánto pesa
+ *  copiar sus tablas de páginas en fork().
+ *
+ * Uso: bin/bench_spawn [iteraciones] [MB residentes] [comando]     (make bench: 0 y 256 MB)
+ */
+#include "common.h"
+#include <sys/wait.h>
+
+static const char *g_cmd;
+
+static pid_t launch_fork_sh(void){
+    pid_t pid = fork();
+    if(pid == 0){
+        execl("/bin/sh", "sh", "-c", g_cmd, NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_spawn_sh(void){
+    pid_t pid;
+    return spawn_shell(&pid, g_cmd, NULL) == 0 ? pid : -1;
+}
+
+static pid_t launch_spawn_direct(void){
+    return spawn_command(g_cmd);
+}
+
+static double now_s(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/* Lanza y espera iters veces; devuelve microsegundos por comando */
+static double run(const char *name, pid_t (*launch)(void), long iters, int mb){
+    int fails = 0;
+    double t0 = now_s();
+    for(long i = 0; i < iters; i++){
+        pid_t pid = launch();
+        int st;
+        if(pid < 0 || waitpid(pid, &st, 0) < 0 || !WIFEXITED(st) || WEXITSTATUS(st) != 0) fails++;
+    }
+    double us = (now_s() - t0) * 1e6 / (double)iters;
+    printf("%-14s residentes=%-4dMB comandos=%-6ld %9.1f us/comando  %s\n",
+           name, mb, iters, us, fails ? "CON FALLOS" : "ok");
+    return us;
+}
+
+int main(int argc, char **argv){
+    long iters = argc > 1 ? atol(argv[1]) : 2000;
+    int mb = argc > 2 ? atoi(argv[2]) : 0;
+    g_cmd = argc > 3 ? argv[3] : "true";
+    if(iters < 1 || mb < 0){ fprintf(stderr, "uso: %s [iteraciones] [MB] [comando]\n", argv[0]); return 2; }
+    if(spawn_needs_shell(g_cmd)) fprintf(stderr, "aviso: '%s' usa sintaxis de shell; spawn_command irá por /bin/sh\n", g_cmd);
+
+    /* memoria residente del padre, como un shell grande (fork copia sus tablas de páginas) */
+    size_t bytes = (size_t)mb << 20;
+    char *ballast = bytes ? malloc(bytes) : NULL;
+    if(bytes && !ballast){ perror("malloc"); return 1; }
+    if(ballast) memset(ballast, 1, bytes);
+
+    double f = run("fork+sh -c", launch_fork_sh, iters, mb);
+    double s = run("spawn sh -c", launch_spawn_sh, iters, mb);
+    double d = run("spawn directo", launch_spawn_direct, iters, mb);
+    printf("%-14s residentes=%-4dMB spawn sh -c %.2fx, directo %.2fx más rápido que fork+sh -c\n",
+           "", mb, f / s, f / d);
+    free(ballast);
+    return 0;
+}
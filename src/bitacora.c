@@ -0,0 +1,779 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *   - Enrique Hernández Mauricio — 2223030397
+ *   - Garrido Velázquez Iván — 2203025425
+ *   - Loaeza Sánchez Wendy Maritza — 2193042056
+ *   - Robles Pérez Luis Fernando — 2203031441
+ *
+ * Descripción:
+ *   Lectura de bitácoras a través de sus segmentos rotados: "<bitácora>.<AAAAmmdd-HHMMSS>[-NN][.gz]"
+ *   (del más antiguo al más nuevo) seguidos del archivo vivo. Los segmentos .gz se leen con zlib;
+ *   los planos se copian a la salida con sendfile()/splice(), sin pasar por espacio de usuario.
+ *   log_query(): filtros por rango de tiempo (búsqueda binaria sobre el prefijo "[AAAA-MM-DD HH:MM:SS]"
+ *   del archivo mapeado con mmap, ensanchada por LOG_FLUSH_MS porque los buffers de varias instancias
+ *   intercalan registros fuera de orden) y por pid=/user=/ip=/texto (barrido con memchr/memmem).
+ *   log_follow(): modo "tail -f"; inotify avisa de cada escritura y sólo se leen los bytes nuevos.
+ *   binlog_scan(): la misma consulta sobre la bitácora binaria, empezando en el desplazamiento
+ *   que indica el índice por cubetas de tiempo.
+ */
+
+#define _GNU_SOURCE            /* memmem(), splice() */
+#include "common.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
+
+#define DUMP_CHUNK (1 << 20)   /* bloque de descompresión / copia de respaldo */
+
+/* ¿name es un segmento de base? acepta "<base>.<8 dígitos>-<6 dígitos>[-NN][.gz]" */
+static int is_segment_of(const char *name, const char *base){
+    size_t bl = strlen(base);
+    if(strncmp(name, base, bl) != 0 || name[bl] != '.') return 0;
+    const char *p = name + bl + 1;
+    for(int i = 0; i < 15; i++){
+        if(i == 8){ if(p[i] != '-') return 0; }
+        else if(!isdigit((unsigned char)p[i])) return 0;
+    }
+    p += 15;
+    if(p[0] == '-' && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2])) p += 3;
+    return *p == '\0' || strcmp(p, ".gz") == 0;
+}
+
+static size_t stem_len(const char *s){
+    size_t l = strlen(s);
+    return (l > 3 && strcmp(s + l - 3, ".gz") == 0) ? l - 3 : l;
+}
+
+/* Orden cronológico: compara sin ".gz"; a igual nombre, el plano primero */
+static int cmp_segment(const void *a, const void *b){
+    const char *x = *(char * const *)a, *y = *(char * const *)b;
+    size_t lx = stem_len(x), ly = stem_len(y);
+    int c = strncmp(x, y, lx < ly ? lx : ly);
+    if(c) return c;
+    if(lx != ly) return lx < ly ? -1 : 1;
+    return strcmp(x, y);
+}
+
+/**
+ * Lista los segmentos de una bitácora, del más antiguo al más nuevo, terminando en el archivo vivo.
+ * Si un segmento existe en plano y en .gz (compresión en curso) se usa el plano.
+ * @return número de rutas en *paths (liberar con log_free_segments), -1 en error.
+ */
+int log_list_segments(const char *live_path, char ***paths){
+    *paths = NULL;
+    char dcopy[PATH_MAX], bcopy[PATH_MAX];
+    snprintf(dcopy, sizeof(dcopy), "%s", live_path);
+    snprintf(bcopy, sizeof(bcopy), "%s", live_path);
+    const char *dir = dirname(dcopy);
+    const char *base = basename(bcopy);
+
+    DIR *d = opendir(dir);
+    if(!d) return -1;
+    size_t cap = 16, n = 0;
+    char **names = malloc(cap * sizeof(char*));
+    if(!names){ closedir(d); return -1; }
+    struct dirent *de;
+    while((de = readdir(d))){
+        if(!is_segment_of(de->d_name, base)) continue;
+        if(n + 1 >= cap){
+            char **tmp = realloc(names, (cap *= 2) * sizeof(char*));
+            if(!tmp) break;
+            names = tmp;
+        }
+        names[n++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char*), cmp_segment);
+
+    /* descartar "X.gz" cuando "X" todavía existe (queda justo antes en el orden) */
+    size_t k = 0;
+    for(size_t i = 0; i < n; i++){
+        size_t l = stem_len(names[i]);
+        if(k > 0 && l != strlen(names[i]) &&
+           strncmp(names[k-1], names[i], l) == 0 && names[k-1][l] == '\0'){
+            free(names[i]);
+            continue;
+        }
+        names[k++] = names[i];
+    }
+    n = k;
+
+    char **out = malloc((n + 1) * sizeof(char*));
+    if(!out){ for(size_t i = 0; i < n; i++) free(names[i]); free(names); return -1; }
+    for(size_t i = 0; i < n; i++){
+        char full[PATH_MAX * 2];
+        snprintf(full, sizeof(full), "%s/%s", dir, names[i]);
+        out[i] = strdup(full);
+        free(names[i]);
+    }
+    free(names);
+    if(access(live_path, F_OK) == 0) out[n++] = strdup(live_path);
+    *paths = out;
+    return (int)n;
+}
+
+void log_free_segments(char **paths, int n){
+    if(!paths) return;
+    for(int i = 0; i < n; i++) free(paths[i]);
+    free(paths);
+}
+
+static int write_all_to(int fd, const char *p, size_t n){
+    while(n > 0){
+        ssize_t w = write(fd, p, n);
+        if(w < 0){ if(errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+/*
+ * Copia in_fd completo a out_fd sin pasar por espacio de usuario: sendfile() (terminal, archivo o
+ * socket) y, si el destino no lo admite (p. ej. abierto con O_APPEND), splice() cuando es un pipe.
+ * Como último recurso, read/write con un buffer grande.
+ */
+static int copy_fd(int in_fd, int out_fd){
+    struct stat st;
+    if(fstat(in_fd, &st) != 0) return -1;
+    off_t off = 0;
+    while(off < st.st_size){
+        ssize_t w = sendfile(out_fd, in_fd, &off, (size_t)(st.st_size - off));
+        if(w > 0) continue;
+        if(w < 0 && errno == EINTR) continue;
+        if(w == 0) return 0;                         /* se truncó mientras copiábamos */
+        break;
+    }
+    if(off >= st.st_size) return 0;
+    loff_t soff = off;
+    while(soff < st.st_size){
+        ssize_t w = splice(in_fd, &soff, out_fd, NULL, (size_t)(st.st_size - soff), SPLICE_F_MORE);
+        if(w > 0) continue;
+        if(w < 0 && errno == EINTR) continue;
+        if(w == 0) return 0;
+        break;
+    }
+    off = soff;
+    static char buf[DUMP_CHUNK];
+    ssize_t r;
+    while((r = pread(in_fd, buf, sizeof(buf), off)) > 0){
+        if(write_all_to(out_fd, buf, (size_t)r) != 0) return -1;
+        off += r;
+    }
+    return r < 0 ? -1 : 0;
+}
+
+/* Copia un segmento (plano o .gz) a out */
+static int dump_segment(const char *path, FILE *out){
+    size_t l = strlen(path);
+    if(l > 3 && strcmp(path + l - 3, ".gz") == 0){
+        static char buf[DUMP_CHUNK];
+        gzFile gz = gzopen(path, "rb");
+        if(!gz) return -1;
+        gzbuffer(gz, DUMP_CHUNK);
+        int r;
+        while((r = gzread(gz, buf, sizeof(buf))) > 0) fwrite(buf, 1, (size_t)r, out);
+        gzclose(gz);
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+    fflush(out);                                     /* lo ya escrito en out va primero */
+    int rc = copy_fd(fd, fileno(out));
+    close(fd);
+    return rc;
+}
+
+/**
+ * Muestra la bitácora completa (todos sus segmentos en orden) en out.
+ * @return 0 si se leyó al menos un segmento, -1 si no hay nada que mostrar.
+ */
+int log_dump(const char *live_path, FILE *out){
+    char **segs;
+    int n = log_list_segments(live_path, &segs);
+    if(n <= 0){ log_free_segments(segs, 0); return -1; }
+    int ok = 0;
+    for(int i = 0; i < n; i++)
+        if(dump_segment(segs[i], out) == 0) ok = 1;
+    log_free_segments(segs, n);
+    return ok ? 0 : -1;
+}
+
+/* ---------------- consultas (bitacora_* con filtros) ---------------- */
+
+/* Completa una fecha parcial: "2026-10-17" -> "2026-10-17 00:00:00" (o 23:59:59 para --hasta) */
+static void pad_stamp(char out[20], const char *in, int upper){
+    static const char lo[] = "0000-01-01 00:00:00";
+    static const char hi[] = "9999-12-31 23:59:59";
+    size_t l = strlen(in);
+    if(l > 19) l = 19;
+    memcpy(out, in, l);
+    memcpy(out + l, (upper ? hi : lo) + l, 19 - l);
+    out[19] = '\0';
+}
+
+static int looks_like_time(const char *t){
+    return isdigit((unsigned char)t[0]) && isdigit((unsigned char)t[1]) && t[2] == ':';
+}
+
+/* Siguiente palabra de s (respeta comillas dobles); avanza *s */
+static int next_word(const char **s, char *out, size_t n){
+    const char *p = *s;
+    while(*p == ' ' || *p == '\t') p++;
+    if(!*p){ *s = p; return 0; }
+    size_t i = 0;
+    if(*p == '"'){
+        p++;
+        while(*p && *p != '"'){ if(i + 1 < n) out[i++] = *p; p++; }
+        if(*p == '"') p++;
+    } else {
+        while(*p && *p != ' ' && *p != '\t'){ if(i + 1 < n) out[i++] = *p; p++; }
+    }
+    out[i] = '\0';
+    *s = p;
+    return 1;
+}
+
+/**
+ * Interpreta los argumentos de bitacora_*:
+ *   --desde FECHA [HORA]  --hasta FECHA [HORA]  pid=N  user=U  ip=IP  texto...
+ * @return 0 en éxito, -1 si la sintaxis es inválida.
+ */
+int log_query_parse(const char *args, LogQuery *q){
+    memset(q, 0, sizeof(*q));
+    if(!args) return 0;
+    const char *p = args;
+    char w[256];
+    while(next_word(&p, w, sizeof(w))){
+        if(strcmp(w, "--desde") == 0 || strcmp(w, "--hasta") == 0){
+            int upper = (w[2] == 'h');
+            char stamp[32];
+            if(!next_word(&p, stamp, sizeof(stamp)) || !isdigit((unsigned char)stamp[0])) return -1;
+            /* la hora puede venir como palabra aparte: --desde 2026-10-17 22:00 */
+            const char *save = p;
+            char t[16];
+            if(!strchr(stamp, ' ') && next_word(&p, t, sizeof(t)) && looks_like_time(t)){
+                size_t l = strlen(stamp);
+                snprintf(stamp + l, sizeof(stamp) - l, " %.8s", t);
+            } else {
+                p = save;
+            }
+            pad_stamp(upper ? q->hasta : q->desde, stamp, upper);
+        } else if(strcmp(w, "--bin") == 0){
+            q->binary = 1;
+        } else if(strcmp(w, "-f") == 0 || strcmp(w, "--seguir") == 0){
+            q->follow = 1;
+        } else if((strncmp(w, "pid=", 4) == 0 || strncmp(w, "user=", 5) == 0 || strncmp(w, "ip=", 3) == 0)
+                  && q->nfields < LOG_QUERY_MAX_FIELDS){
+            /* los campos del prefijo van seguidos de espacio: "pid=12 " no casa con pid=123 */
+            snprintf(q->fields[q->nfields++], sizeof(q->fields[0]), "%.*s ",
+                     (int)sizeof(q->fields[0]) - 2, w);
+        } else {
+            size_t l = strlen(q->text);
+            snprintf(q->text + l, sizeof(q->text) - l, "%s%s", l ? " " : "", w);
+        }
+    }
+    return 0;
+}
+
+/* ¿Empieza un registro en p? (línea "[AAAA-MM-DD HH:MM:SS] ...") */
+static int is_record_start(const char *p, const char *end){
+    return end - p >= 21 && p[0] == '[' && isdigit((unsigned char)p[1]) &&
+           p[5] == '-' && p[8] == '-' && p[11] == ' ' && p[14] == ':' && p[20] == ']';
+}
+
+/* Primer inicio de registro en una posición >= off (o len) */
+static size_t record_at_or_after(const char *buf, size_t len, size_t off){
+    const char *end = buf + len;
+    const char *p = buf + off;
+    if(off > 0 && buf[off-1] != '\n'){
+        p = memchr(p, '\n', (size_t)(end - p));
+        if(!p) return len;
+        p++;
+    }
+    while(p < end && !is_record_start(p, end)){
+        p = memchr(p, '\n', (size_t)(end - p));
+        if(!p) return len;
+        p++;
+    }
+    return (size_t)(p - buf);
+}
+
+/* Inicio del registro que contiene off (los mensajes pueden ocupar varias líneas) */
+static size_t record_containing(const char *buf, size_t len, size_t off){
+    const char *end = buf + len;
+    for(;;){
+        size_t ls = off;
+        while(ls > 0 && buf[ls-1] != '\n') ls--;
+        if(ls == 0 || is_record_start(buf + ls, end)) return ls;
+        off = ls - 1;
+    }
+}
+
+static int stamp_to_time(const char *stamp, time_t *t){
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if(!strptime(stamp, "%Y-%m-%d %H:%M:%S", &tm)) return -1;
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    return 0;
+}
+
+/* Cada instancia vacía su buffer (buffered, async, shared) cuando se cumple LOG_FLUSH_MS, así
+ * que en el archivo un registro puede quedar detrás de otros hasta ese tiempo más nuevos:
+ * la búsqueda binaria usa el rango ensanchado por este margen y los bordes se filtran uno a uno. */
+static long stamp_slack(void){
+    return g_cfg.log_flush_ms / 1000 + 2;
+}
+
+/* key + secs en el mismo formato; si no se puede interpretar se deja igual */
+static void stamp_shift(const char *key, long secs, char out[20]){
+    time_t t;
+    struct tm tm;
+    memcpy(out, key, 20);
+    if(stamp_to_time(key, &t) != 0) return;
+    t += secs;
+    char tmp[20];
+    if(localtime_r(&t, &tm) && strftime(tmp, sizeof(tmp), "%Y-%m-%d %H:%M:%S", &tm) == 19)
+        memcpy(out, tmp, 20);
+}
+
+static int stamp_in_range(const char *rec, const LogQuery *q){
+    return (!q->desde[0] || memcmp(rec + 1, q->desde, 19) >= 0) &&
+           (!q->hasta[0] || memcmp(rec + 1, q->hasta, 19) <= 0);
+}
+
+/* Primer registro con timestamp >= key (upper=0) o > key (upper=1); búsqueda binaria */
+static size_t bound_by_stamp(const char *buf, size_t len, const char *key, int upper){
+    size_t lo = 0, hi = len;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        size_t r = record_at_or_after(buf, len, mid);
+        int c = (r >= len) ? 1 : memcmp(buf + r + 1, key, 19);
+        if(r >= len || (upper ? c > 0 : c >= 0)) hi = mid;
+        else lo = mid + 1;
+    }
+    return record_at_or_after(buf, len, lo);
+}
+
+static int record_matches(const char *rec, size_t n, const LogQuery *q){
+    /* campos: sólo en el prefijo, hasta " :: " */
+    const char *sep = memmem(rec, n, " :: ", 4);
+    size_t hdr = sep ? (size_t)(sep - rec) + 1 : n;
+    for(int i = 0; i < q->nfields; i++)
+        if(!memmem(rec, hdr, q->fields[i], strlen(q->fields[i]))) return 0;
+    if(q->text[0] && !memmem(rec, n, q->text, strlen(q->text))) return 0;
+    return 1;
+}
+
+/* Aplica la consulta a un bloque de bitácora en memoria; regresa cuántos registros emitió */
+static long query_buffer(const char *buf, size_t len, const LogQuery *q, FILE *out){
+    char lo[20], hi[20];
+    size_t from = 0, to = len;
+    if(q->desde[0]){ stamp_shift(q->desde, -stamp_slack(), lo); from = bound_by_stamp(buf, len, lo, 0); }
+    if(q->hasta[0]){ stamp_shift(q->hasta, stamp_slack(), hi); to = bound_by_stamp(buf, len, hi, 1); }
+    if(from >= to) return 0;
+
+    if(!q->text[0] && q->nfields == 0){
+        /* sólo rango: se copian los tramos contiguos de registros dentro del rango */
+        long emitted = 0;
+        size_t run = to;
+        for(size_t r = from; r < to; ){
+            size_t next = record_at_or_after(buf, to, r + 1);
+            if(stamp_in_range(buf + r, q)){ if(run == to) run = r; }
+            else if(run != to){ fwrite(buf + run, 1, r - run, out); run = to; emitted = 1; }
+            r = next;
+        }
+        if(run != to){ fwrite(buf + run, 1, to - run, out); emitted = 1; }
+        return emitted;
+    }
+
+    /* ancla: el texto libre o el primer campo; memmem salta directo a los candidatos */
+    const char *needle = q->text[0] ? q->text : q->fields[0];
+    size_t nl = strlen(needle);
+    long count = 0;
+    size_t cur = from;
+    while(cur < to){
+        const char *hit = memmem(buf + cur, to - cur, needle, nl);
+        if(!hit) break;
+        size_t rs = record_containing(buf, len, (size_t)(hit - buf));
+        if(rs < cur) rs = cur;
+        size_t re = record_at_or_after(buf, to, (size_t)(hit - buf) + 1);
+        if(stamp_in_range(buf + rs, q) && record_matches(buf + rs, re - rs, q)){
+            fwrite(buf + rs, 1, re - rs, out);
+            count++;
+        }
+        cur = re;
+    }
+    return count;
+}
+
+/* "uamashell.log.20261017-192301[-01][.gz]" -> "2026-10-17 19:23:01" (momento de la rotación) */
+static int segment_stamp(const char *path, char out[20]){
+    const char *dot = strrchr(path, '/');
+    dot = dot ? dot + 1 : path;
+    const char *p = strstr(dot, ".log.");
+    if(!p) return -1;
+    p += 5;
+    if(strlen(p) < 15 || p[8] != '-') return -1;
+    snprintf(out, 20, "%.4s-%.2s-%.2s %.2s:%.2s:%.2s", p, p + 4, p + 6, p + 9, p + 11, p + 13);
+    return 0;
+}
+
+/* Carga un segmento: mmap si es plano, descompresión a memoria si es .gz */
+static char *segment_load(const char *path, size_t *len, int *mapped){
+    size_t l = strlen(path);
+    *len = 0; *mapped = 0;
+    if(l > 3 && strcmp(path + l - 3, ".gz") == 0){
+        gzFile gz = gzopen(path, "rb");
+        if(!gz) return NULL;
+        size_t cap = 1 << 20, n = 0;
+        char *buf = malloc(cap);
+        int r;
+        while(buf && (r = gzread(gz, buf + n, (unsigned)(cap - n))) > 0){
+            n += (size_t)r;
+            if(n == cap){
+                char *tmp = realloc(buf, cap *= 2);
+                if(!tmp){ free(buf); buf = NULL; }
+                else buf = tmp;
+            }
+        }
+        gzclose(gz);
+        *len = n;
+        return buf;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){ close(fd); return NULL; }
+    char *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) return NULL;
+    *len = (size_t)st.st_size;
+    *mapped = 1;
+    return m;
+}
+
+/**
+ * Muestra los registros de la bitácora (todos sus segmentos) que cumplen la consulta.
+ * @return número de registros mostrados (o 1 si fue un rango sin filtros), -1 si no hay bitácora.
+ */
+long log_query(const char *live_path, const LogQuery *q, FILE *out){
+    char **segs;
+    int n = log_list_segments(live_path, &segs);
+    if(n <= 0){ log_free_segments(segs, 0); return -1; }
+    long total = 0;
+    char prev[20] = "", hasta[20] = "";
+    if(q->hasta[0]) stamp_shift(q->hasta, stamp_slack(), hasta);
+    for(int i = 0; i < n; i++){
+        char stamp[20];
+        int has_stamp = segment_stamp(segs[i], stamp) == 0;
+        /* un segmento rotado antes de --desde sólo tiene registros anteriores */
+        if(has_stamp && q->desde[0] && strcmp(stamp, q->desde) < 0){ strcpy(prev, stamp); continue; }
+        /* si el segmento anterior rotó después de --hasta (más el margen), todo lo que sigue es posterior */
+        if(prev[0] && hasta[0] && strcmp(prev, hasta) > 0) break;
+        size_t len; int mapped;
+        char *buf = segment_load(segs[i], &len, &mapped);
+        if(buf){
+            total += query_buffer(buf, len, q, out);
+            if(mapped) munmap(buf, len); else free(buf);
+        }
+        if(has_stamp) strcpy(prev, stamp);
+    }
+    log_free_segments(segs, n);
+    return total;
+}
+
+/* ---------------- seguimiento en vivo (bitacora_* -f) ---------------- */
+
+#define FOLLOW_BACKLOG_LINES 10
+#define FOLLOW_CHUNK         65536
+
+typedef struct {
+    const LogQuery *q;
+    FILE  *out;
+    char   pending[2 * LOG_LINE_MAX];   /* línea aún sin '\n' */
+    size_t plen;
+    int    keep;                        /* el registro en curso pasa el filtro */
+    long   count;
+} Follower;
+
+/* Una línea completa (con su '\n'); las de continuación siguen la suerte de su registro */
+static void follow_line(Follower *f, const char *l, size_t n){
+    const LogQuery *q = f->q;
+    if(is_record_start(l, l + n)){
+        f->keep = (!q->desde[0] || memcmp(l + 1, q->desde, 19) >= 0) &&
+                  (!q->hasta[0] || memcmp(l + 1, q->hasta, 19) <= 0) &&
+                  record_matches(l, n, q);
+        if(f->keep) f->count++;
+    }
+    if(f->keep) fwrite(l, 1, n, f->out);
+}
+
+static void follow_feed(Follower *f, const char *buf, size_t n){
+    const char *end = buf + n;
+    while(buf < end){
+        const char *nl = memchr(buf, '\n', (size_t)(end - buf));
+        size_t seg = nl ? (size_t)(nl - buf) + 1 : (size_t)(end - buf);
+        if(f->plen == 0 && nl){
+            follow_line(f, buf, seg);          /* caso común: sin copiar */
+        } else {
+            if(f->plen + seg > sizeof(f->pending)){
+                follow_line(f, f->pending, f->plen);   /* demasiado larga: se emite cortada */
+                f->plen = 0;
+            }
+            memcpy(f->pending + f->plen, buf, seg);
+            f->plen += seg;
+            if(nl){ follow_line(f, f->pending, f->plen); f->plen = 0; }
+        }
+        buf += seg;
+    }
+}
+
+/* Lee de fd desde *pos hasta el fin actual; sólo los bytes anexados */
+static void follow_drain(Follower *f, int fd, off_t *pos){
+    static char buf[FOLLOW_CHUNK];
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size < *pos){
+        *pos = 0;                              /* truncada: empezar de nuevo */
+        f->plen = 0;
+    }
+    ssize_t r;
+    while((r = pread(fd, buf, sizeof(buf), *pos)) > 0){
+        follow_feed(f, buf, (size_t)r);
+        *pos += r;
+    }
+    fflush(f->out);
+}
+
+/* Desplazamiento donde empiezan las últimas n líneas */
+static off_t follow_backlog(int fd, int n){
+    static char buf[FOLLOW_CHUNK];
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+    off_t end = st.st_size;
+    if(end > (off_t)sizeof(buf)) end = (off_t)sizeof(buf);
+    off_t base = st.st_size - end;
+    ssize_t r = pread(fd, buf, (size_t)end, base);
+    if(r <= 0) return st.st_size;
+    int seen = 0;
+    for(ssize_t i = r - 1; i > 0; i--){
+        if(buf[i-1] == '\n' && ++seen == n) return base + i;
+    }
+    return base;
+}
+
+/**
+ * Sigue la bitácora viva: muestra las últimas líneas y después, en cada aviso de inotify,
+ * sólo lo anexado. Detecta la rotación (aparece otro archivo con ese nombre) y continúa en
+ * el nuevo tras vaciar el viejo. Termina al leer una línea (o EOF) de stop_fd, o cuando una
+ * señal deja *running en 0 (running puede ser NULL). Otras señales (avisos) no lo cortan.
+ * @return registros mostrados, -1 si no se pudo vigilar la bitácora.
+ */
+long log_follow(const char *live_path, const LogQuery *q, int stop_fd, FILE *out,
+                const volatile sig_atomic_t *running){
+    char dcopy[PATH_MAX], bcopy[PATH_MAX];
+    snprintf(dcopy, sizeof(dcopy), "%s", live_path);
+    snprintf(bcopy, sizeof(bcopy), "%s", live_path);
+    const char *dir = dirname(dcopy);
+    const char *base = basename(bcopy);
+
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(ifd < 0) return -1;
+    if(inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO) < 0){ close(ifd); return -1; }
+
+    static Follower f;
+    memset(&f, 0, sizeof(f));
+    f.q = q;
+    f.out = out;
+
+    int fd = open(live_path, O_RDONLY | O_CLOEXEC);
+    int fwd = fd >= 0 ? inotify_add_watch(ifd, live_path, IN_MODIFY) : -1;
+    off_t pos = fd >= 0 ? follow_backlog(fd, FOLLOW_BACKLOG_LINES) : 0;
+    if(fd >= 0) follow_drain(&f, fd, &pos);
+
+    struct pollfd pf[2] = { { ifd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+    for(;;){
+        if(running && !*running) break;        /* SIGINT/SIGTERM */
+        if(poll(pf, 2, -1) < 0) continue;      /* EINTR: sólo se sale si bajó *running */
+        if(pf[1].revents){
+            /* consumir la línea que pidió terminar */
+            char c;
+            while(read(stop_fd, &c, 1) == 1 && c != '\n') ;
+            break;
+        }
+        if(!(pf[0].revents & POLLIN)) continue;
+
+        char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(ifd, ev, sizeof(ev));
+        int modified = 0, replaced = 0;
+        for(char *p = ev; len > 0 && p < ev + len; ){
+            struct inotify_event *e = (struct inotify_event*)p;
+            if(e->wd == fwd && (e->mask & IN_MODIFY)) modified = 1;
+            else if(e->len && strcmp(e->name, base) == 0) replaced = 1;
+            p += sizeof(*e) + e->len;
+        }
+        if(fd >= 0 && (modified || replaced)) follow_drain(&f, fd, &pos);
+        if(replaced){
+            /* rotación: el nombre ya apunta a otro inodo */
+            struct stat a, b;
+            int nfd = open(live_path, O_RDONLY | O_CLOEXEC);
+            if(nfd >= 0 && (fd < 0 || (fstat(fd, &a) == 0 && fstat(nfd, &b) == 0 &&
+                                       (a.st_ino != b.st_ino || a.st_dev != b.st_dev)))){
+                if(fd >= 0){ inotify_rm_watch(ifd, fwd); close(fd); }
+                fd = nfd;
+                fwd = inotify_add_watch(ifd, live_path, IN_MODIFY);
+                pos = 0;
+                f.plen = 0;
+                follow_drain(&f, fd, &pos);
+            } else if(nfd >= 0) {
+                close(nfd);
+            }
+        }
+    }
+    if(fd >= 0) close(fd);
+    close(ifd);
+    return f.count;
+}
+
+/* ---------------- bitácora binaria ---------------- */
+
+typedef struct {
+    char  *data;
+    size_t len;
+} MappedFile;
+
+static int map_file(const char *dir, const char *name, MappedFile *m){
+    char p[PATH_MAX];
+    m->data = NULL; m->len = 0;
+    if(snprintf(p, sizeof(p), "%s/%s", dir, name) >= (int)sizeof(p)) return -1;
+    int fd = open(p, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+    struct stat st;
+    if(fstat(fd, &st) != 0){ close(fd); return -1; }
+    if(st.st_size > 0){
+        void *d = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(d == MAP_FAILED){ close(fd); return -1; }
+        m->data = d;
+        m->len = (size_t)st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+static void unmap_file(MappedFile *m){
+    if(m->data) munmap(m->data, m->len);
+    m->data = NULL;
+}
+
+/* Copia en out la cadena con id dado (desplazamiento + 1 en .str) */
+static const char *str_at(const MappedFile *s, uint64_t id, char *out, size_t n){
+    out[0] = '\0';
+    if(id == 0 || id - 1 + sizeof(uint32_t) > s->len) return out;
+    uint32_t l;
+    memcpy(&l, s->data + id - 1, sizeof(l));
+    size_t from = (size_t)id - 1 + sizeof(l);
+    if(l > s->len - from) return out;
+    if(l >= n) l = (uint32_t)n - 1;
+    memcpy(out, s->data + from, l);
+    out[l] = '\0';
+    return out;
+}
+
+/* Desplazamiento desde el que conviene leer: el menor del índice entre las cubetas >= desde;
+ * SIZE_MAX si ninguna cubeta llega a desde (no hay registros que mostrar) */
+static size_t binlog_start(const MappedFile *idx, const char *desde){
+    time_t from;
+    if(!desde[0] || !idx->data || stamp_to_time(desde, &from) != 0) return 0;
+    int64_t bucket = (int64_t)from / BINLOG_BUCKET_SEC * BINLOG_BUCKET_SEC;
+    const BinLogIndexEntry *e = (const BinLogIndexEntry*)idx->data;
+    size_t n = idx->len / sizeof(*e);
+    uint64_t best = UINT64_MAX;
+    for(size_t i = 0; i < n; i++)
+        if(e[i].bucket_start >= bucket && e[i].offset < best) best = e[i].offset;
+    return best == UINT64_MAX ? SIZE_MAX : (size_t)best;
+}
+
+/**
+ * Recorre la bitácora binaria de log_dir y llama a visit() con cada registro que cumple q
+ * (kind: 0 = comandos, 1 = errores, -1 = ambos).
+ * @return número de registros visitados, -1 si no hay bitácora binaria.
+ */
+long binlog_scan(const char *log_dir, int kind, const LogQuery *q, BinLogVisitor visit, void *arg){
+    MappedFile bin, str, idx;
+    if(map_file(log_dir, BINLOG_NAME, &bin) != 0) return -1;
+    /* .str después de .bin: toda cadena referenciada ya se escribió antes que su registro */
+    map_file(log_dir, BINLOG_NAME ".str", &str);
+    map_file(log_dir, BINLOG_NAME ".idx", &idx);
+
+    /* los procesos vacían su buffer con retraso: el archivo sólo está casi ordenado
+       (el mismo margen que la búsqueda en la bitácora de texto) */
+    int64_t stop_us = INT64_MAX;
+    time_t until;
+    if(q->hasta[0] && stamp_to_time(q->hasta, &until) == 0)
+        stop_us = ((int64_t)until + 1 + stamp_slack()) * 1000000;
+
+    long count = 0;
+    size_t off = binlog_start(&idx, q->desde);
+    if(off > bin.len) off = bin.len;
+    off -= off % sizeof(BinLogRecord);
+    char user[64], tty[64], ip[64], cmd[LOG_LINE_MAX];
+    for(; bin.len >= sizeof(BinLogRecord) && off <= bin.len - sizeof(BinLogRecord);
+          off += sizeof(BinLogRecord)){
+        const BinLogRecord *r = (const BinLogRecord*)(bin.data + off);
+        if(r->magic != BINLOG_REC_MAGIC) continue;
+        if(r->ts_us > stop_us) break;
+        if(kind >= 0 && r->kind != kind) continue;
+
+        BinLogEntry e;
+        e.rec = r;
+        time_t t = (time_t)(r->ts_us / 1000000);
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(e.stamp, sizeof(e.stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        if(q->desde[0] && strcmp(e.stamp, q->desde) < 0) continue;
+        if(q->hasta[0] && strcmp(e.stamp, q->hasta) > 0) continue;
+
+        e.user = str_at(&str, r->user, user, sizeof(user));
+        e.tty  = str_at(&str, r->tty, tty, sizeof(tty));
+        e.ip   = str_at(&str, r->ip, ip, sizeof(ip));
+        e.cmd  = str_at(&str, r->cmd, cmd, sizeof(cmd));
+        if(q->nfields){
+            char hdr[256];
+            int hn = snprintf(hdr, sizeof(hdr), "pid=%d user=%s tty=%s ip=%s ", r->pid, e.user, e.tty, e.ip);
+            if(hn < 0) continue;
+            if(hn >= (int)sizeof(hdr)) hn = (int)sizeof(hdr) - 1;
+            int ok = 1;
+            for(int i = 0; i < q->nfields && ok; i++)
+                ok = memmem(hdr, (size_t)hn, q->fields[i], strlen(q->fields[i])) != NULL;
+            if(!ok) continue;
+        }
+        if(q->text[0] && !strstr(e.cmd, q->text)) continue;
+
+        visit(&e, arg);
+        count++;
+    }
+    unmap_file(&idx);
+    unmap_file(&str);
+    unmap_file(&bin);
+    return count;
+}
+
+static void print_entry(const BinLogEntry *e, void *arg){
+    const BinLogRecord *r = e->rec;
+    fprintf((FILE*)arg, "[%s] %s pid=%d user=%s tty=%s ip=%s :: %s",
+            e->stamp, r->kind ? "ERR" : "CMD", r->pid, e->user, e->tty, e->ip, e->cmd);
+    if(r->status >= 0) fprintf((FILE*)arg, " (código %d, %u ms)", r->status, r->duration_ms);
+    fputc('\n', (FILE*)arg);
+}
+
+/* bitacora_* --bin: muestra los registros de la bitácora binaria con el formato del texto */
+long binlog_query(const char *log_dir, int kind, const LogQuery *q, FILE *out){
+    return binlog_scan(log_dir, kind, q, print_entry, out);
+}
@@ -8,20 +8,32 @@
  *   - Robles Pérez Luis Fernando — 2203031441
  *
  * Descripción:
- *   – Implementa load_config() (parsing de clave=valor) y set_config_key() (reescritura del .conf).
+ *   – Implementa load_config() (parsing de clave=valor guiado por una tabla de esquema) y
+ *     set_config_key() (reescritura atómica del .conf: temporal + rename bajo lock fcntl).
+ *   – config_reload(): recarga en caliente sólo si el archivo cambió (stat de inodo/tamaño/mtime).
  */
 
 #include "common.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <strings.h>
 
 Config g_cfg;
-// ** Auxiliar ** parsear entero de cadena o devolver valor por defecto
-static int parse_int(const char *s, int defv) {
+// ** Auxiliar ** tamaño en bytes con sufijo opcional K/M/G ("64M")
+static long long parse_size(const char *s, long long defv) {
     if (!s) return defv;
     char *end=NULL;
-    long v = strtol(s, &end, 10);
-    if (end==s || *end!='\0') return defv;
+    long long v = strtoll(s, &end, 10);
+    if (end==s) return defv;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': v <<= 10; end++; break;
+        case 'M': v <<= 20; end++; break;
+        case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end!='\0') return defv;
     if (v<0) v=0;
-    return (int)v;
+    return v;
 }
 /*
 void trim(char *s){
@@ -45,28 +57,142 @@ void ensure_dirs(const char *path){
 }
 
 
+/* ---------------- esquema de claves ----------------
+ * Cada clave conocida tiene un campo de Config, una función de parseo, límites y un valor por
+ * defecto en texto (que pasa por el mismo parser). Un valor inválido o fuera de rango se ignora
+ * con un aviso y queda el anterior. */
+
+typedef struct ConfigKey ConfigKey;
+typedef int (*ConfigParseFn)(const ConfigKey *k, const char *val, void *field);
+
+struct ConfigKey {
+    const char   *name;
+    ConfigParseFn parse;
+    size_t        offset;       /* offsetof(Config, campo) */
+    size_t        size;         /* sizeof del campo (cadenas) */
+    long long     min, max;     /* límites de los numéricos */
+    const char   *defv;
+};
+
+static int cfg_int(const ConfigKey *k, const char *val, void *field){
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(val, &end, 10);
+    if (end == val || *end != '\0' || errno || v < k->min || v > k->max) return -1;
+    *(int*)field = (int)v;
+    return 0;
+}
+
+static int cfg_size(const ConfigKey *k, const char *val, void *field){
+    long long v = parse_size(val, -1);
+    if (v < 0 || v < k->min || v > k->max) return -1;
+    *(long long*)field = v;
+    return 0;
+}
+
+static int cfg_bool(const ConfigKey *k, const char *val, void *field){
+    (void)k;
+    if (!strcmp(val, "1") || !strcasecmp(val, "si") || !strcasecmp(val, "true"))  *(int*)field = 1;
+    else if (!strcmp(val, "0") || !strcasecmp(val, "no") || !strcasecmp(val, "false")) *(int*)field = 0;
+    else return -1;
+    return 0;
+}
+
+static int cfg_str(const ConfigKey *k, const char *val, void *field){
+    if (strlen(val) >= k->size) return -1;
+    memcpy(field, val, strlen(val) + 1);
+    return 0;
+}
+
+/*
+ * Directorio: uno relativo se ancla al directorio donde arrancó el proceso, para que un "cd"
+ * (local o de una sesión remota) no cambie dónde quedan bitácoras y lockfiles.
+ */
+static int cfg_dir(const ConfigKey *k, const char *val, void *field){
+    static char base[PATH_MAX];
+    if (val[0] == '/' || (!base[0] && !getcwd(base, sizeof base))) return cfg_str(k, val, field);
+    int n = snprintf(field, k->size, "%s/%s", base, val);
+    return (n < 0 || (size_t)n >= k->size) ? -1 : 0;
+}
+
+static int cfg_log_mode(const ConfigKey *k, const char *val, void *field){
+    static const char *names[] = { "buffered", "durable", "async", "shared" };
+    (void)k;
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if (strcmp(val, names[i]) == 0) { *(int*)field = i; return 0; }
+    return -1;
+}
+
+#define STR_(x) #x
+#define STR(x)  STR_(x)
+#define CFG_FIELD(f) offsetof(Config, f), sizeof(((Config*)0)->f)
+
+static const ConfigKey g_schema[] = {
+    { "PROGRAM_NAME",   cfg_str,      CFG_FIELD(program_name),   0, 0,          PROGRAM_NAME },
+    { "MAX_INSTANCES",  cfg_int,      CFG_FIELD(max_instances),  1, 65536,      "3" },
+    { "LOG_DIR",        cfg_dir,      CFG_FIELD(log_dir),        0, 0,          DEFAULT_LOG_DIR },
+    { "LOCK_DIR",       cfg_dir,      CFG_FIELD(lock_dir),       0, 0,          "var/lock" },
+    { "REMOTE_PORT",    cfg_int,      CFG_FIELD(remote_port),    1, 65535,      STR(DEFAULT_REMOTE_PORT) },
+    { "REMOTE_ALLOWED", cfg_str,      CFG_FIELD(remote_allowed), 0, 0,          "" },   /* vacío = nadie */
+    { "LOG_MODE",       cfg_log_mode, CFG_FIELD(log_mode),       0, 0,          "buffered" },
+    { "LOG_FLUSH_MS",   cfg_int,      CFG_FIELD(log_flush_ms),   0, 3600000,    STR(DEFAULT_LOG_FLUSH_MS) },
+    { "LOG_RING_SLOTS", cfg_int,      CFG_FIELD(log_ring_slots), 2, LOG_RING_SLOTS_MAX, STR(DEFAULT_LOG_RING_SLOTS) },
+    { "LOG_MAX_BYTES",  cfg_size,     CFG_FIELD(log_max_bytes),  0, 1LL << 40,  "0" },  /* 0 = sin rotar */
+    { "LOG_BINARY",     cfg_bool,     CFG_FIELD(log_binary),     0, 1,          "0" },
+    { "ADMISSION_WAIT_SEC", cfg_int,  CFG_FIELD(admission_wait_sec), 0, 86400,  "0" },  /* 0 = rechazar */
+    { "IPC_SLOTS",      cfg_int,      CFG_FIELD(ipc_slots),      16, 65536,     STR(DEFAULT_IPC_SLOTS) },
+};
+#define SCHEMA_LEN ((int)(sizeof(g_schema) / sizeof(g_schema[0])))
+
+static const ConfigKey *schema_find(const char *key){
+    for (int i = 0; i < SCHEMA_LEN; i++)
+        if (strcmp(g_schema[i].name, key) == 0) return &g_schema[i];
+    return NULL;
+}
+
+/**
+ * Valida un valor para una clave antes de escribirlo (setconf).
+ * @return 0 si es válido o la clave no es del esquema, -1 si el valor no sirve.
+ */
+int config_check(const char *key, const char *val){
+    const ConfigKey *k = schema_find(key);
+    if (!k) return 0;
+    Config tmp;
+    return k->parse(k, val, (char*)&tmp + k->offset);
+}
+
+static unsigned long g_cfg_generation = 1;
+
 /**
  * Carga archivo de configuración de formato clave=valor.
- * Rellena `out` con valores por defecto + overrides del archivo.
+ * Rellena `out` con valores por defecto + overrides del archivo, y guarda la identidad del
+ * archivo (dispositivo, inodo, tamaño, mtime) para que config_reload() sepa si cambió.
  * @return 0 en éxito (incluso si no existía el archivo), -1 si `out` es NULL.
  */
 int load_config(const char *path, Config *out) {
     if (!out) return -1;
 
     /* valores por defecto */
+    memset(out, 0, sizeof(*out));
+    /* ruta absoluta: un "cd" posterior no debe cambiar qué archivo se vigila */
+    char abs[PATH_MAX];
+    if (realpath(path, abs)) path = abs;
     snprintf(out->conf_path,   sizeof(out->conf_path),   "%s", path);
-    snprintf(out->program_name,sizeof(out->program_name),"%s", PROGRAM_NAME);
-    out->max_instances = 3;
-    snprintf(out->log_dir,     sizeof(out->log_dir),     "%s", DEFAULT_LOG_DIR);
-    snprintf(out->lock_dir, sizeof(out->lock_dir), "%s", "var/lock");
-    out->remote_port = DEFAULT_REMOTE_PORT;
-    out->remote_allowed[0] = '\0';   /* vacío = nadie autorizado */
+    for (int i = 0; i < SCHEMA_LEN; i++)
+        g_schema[i].parse(&g_schema[i], g_schema[i].defv, (char*)out + g_schema[i].offset);
 
     FILE *f = fopen(path, "r");
     if (!f) {
         /* si no existe, quedamos con defaults */
         return 0;
     }
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0) {
+        out->conf_dev = st.st_dev;
+        out->conf_ino = st.st_ino;
+        out->conf_size = st.st_size;
+        out->conf_mtime = st.st_mtim;
+    }
 
     char line[1024];
     while (fgets(line, sizeof(line), f)) {
@@ -84,63 +210,132 @@ int load_config(const char *path, Config *out) {
         trim(key);
         trim(val);
 
-        /* claves conocidas */
-        if (strcmp(key, "MAX_INSTANCES") == 0) {
-            out->max_instances = parse_int(val, out->max_instances);
-        } else if (strcmp(key, "LOG_DIR") == 0) {
-            snprintf(out->log_dir, sizeof(out->log_dir), "%s", val);
-        } else if (strcmp(key, "PROGRAM_NAME") == 0) {
-            snprintf(out->program_name, sizeof(out->program_name), "%s", val);
-        } else if (strcmp(key, "LOCK_DIR") == 0) {
-            snprintf(out->lock_dir, sizeof(out->lock_dir), "%s", val);
-        } else if (strcmp(key, "REMOTE_PORT") == 0) {
-            out->remote_port = parse_int(val, out->remote_port);
-	} else if (strcmp(key, "REMOTE_ALLOWED") == 0) {
-   	    strncpy(out->remote_allowed, val, sizeof(out->remote_allowed)-1);
-	    out->remote_allowed[sizeof(out->remote_allowed)-1] = '\0';
-	}
+        /* claves conocidas; las demás se ignoran */
+        const ConfigKey *k = schema_find(key);
+        if (k && k->parse(k, val, (char*)out + k->offset) != 0)
+            fprintf(stderr, "config: valor inválido %s=%s (se conserva el anterior)\n", key, val);
     }
 
     fclose(f);
     return 0;
 }
 
+/* ¿El archivo de c cambió (otro inodo, tamaño o mtime) desde que se cargó? */
+int config_changed(const Config *c){
+    struct stat st;
+    if (stat(c->conf_path, &st) != 0) return c->conf_ino != 0;
+    return st.st_ino != c->conf_ino || st.st_dev != c->conf_dev || st.st_size != c->conf_size ||
+           st.st_mtim.tv_sec != c->conf_mtime.tv_sec || st.st_mtim.tv_nsec != c->conf_mtime.tv_nsec;
+}
+
+/**
+ * Vuelve a leer g_cfg sólo si su archivo cambió (un stat() en el caso común).
+ * @param prev si no es NULL recibe la configuración anterior.
+ * @return 1 si se recargó, 0 si no hubo cambios, -1 en error.
+ */
+int config_reload(Config *prev){
+    if (!config_changed(&g_cfg)) return 0;
+    Config next;
+    if (load_config(g_cfg.conf_path, &next) != 0) return -1;
+    config_adopt(&next, prev);
+    return 1;
+}
+
+/* Sustituye g_cfg por next (p. ej. la copia publicada por otra instancia) */
+void config_adopt(const Config *next, Config *prev){
+    if (prev) *prev = g_cfg;
+    g_cfg = *next;
+    g_cfg_generation++;
+}
+
+/* Cambia cada vez que g_cfg se recarga; sirve para invalidar datos derivados de la config */
+unsigned long config_generation(void){
+    return g_cfg_generation;
+}
+
+/* ¿line es "key=..." (con espacios opcionales alrededor de la clave)? */
+static bool line_has_key(const char *line, const char *key){
+    while (*line == ' ' || *line == '\t') line++;
+    size_t kl = strlen(key);
+    if (strncmp(line, key, kl) != 0) return false;
+    line += kl;
+    while (*line == ' ' || *line == '\t') line++;
+    return *line == '=';
+}
+
 /**
  * Modifica o añade una clave=valor en el archivo de configuración.
+ * El archivo nuevo se escribe completo en un temporal del mismo directorio y se instala con
+ * rename(), así que un load_config() concurrente ve el archivo viejo o el nuevo, nunca uno a
+ * medias. Un lock fcntl sobre "<conf>.lock" serializa los setconf de varias instancias; ese
+ * archivo se queda (vacío) después, porque borrarlo dejaría a quien espera con otro inodo.
  * @return 0 en éxito, -1 en error de escritura/lectura.
  */
 
 int set_config_key(const char *path, const char *key, const char *value){
     if(!path) path = DEFAULT_CONF;
-    // cargar todo y reescribir
+    char dir[PATH_MAX], lockp[PATH_MAX], tmpp[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) { *slash = '\0'; if (!dir[0]) strcpy(dir, "/"); }
+    else strcpy(dir, ".");
+    if (snprintf(lockp, sizeof(lockp), "%s.lock", path) >= (int)sizeof(lockp) ||
+        snprintf(tmpp, sizeof(tmpp), "%s.XXXXXX", path) >= (int)sizeof(tmpp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    ensure_dirs(dir);
+
+    int lfd = open(lockp, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+    if (lfd < 0) return -1;
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    while (fcntl(lfd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) { close(lfd); return -1; }
+    }
+
+    int rc = -1;
+    int tfd = mkstemp(tmpp);
+    FILE *w = tfd >= 0 ? fdopen(tfd, "w") : NULL;
+    if (!w) { if (tfd >= 0) { close(tfd); unlink(tmpp); } goto out; }
+
+    /* mkstemp crea con 0600: el archivo nuevo conserva modo y dueño del anterior
+       (o 0664, como el resto de los archivos del shell, si no existía) */
+    bool found = false;
     FILE *f = fopen(path, "r");
-    bool found=false;
-    char buf[8192] = {0};
-    if(f){
-        char line[1024];
-        while(fgets(line, sizeof(line), f)){
-            char work[1024]; snprintf(work, sizeof(work), "%s", line);
-            char *eq = strchr(work,'=');
-            if(eq){
-                *eq='\0';
-                trim(work);
-                if(strcmp(work, key)==0){
-                    found=true;
-                    snprintf(line, sizeof(line), "%s=%s\n", key, value);
-                }
+    struct stat st;
+    if (f && fstat(fileno(f), &st) == 0) {
+        if (fchown(tfd, st.st_uid, st.st_gid) != 0 && errno != EPERM) { fclose(f); fclose(w); unlink(tmpp); goto out; }
+        if (fchmod(tfd, st.st_mode & 07777) != 0) { fclose(f); fclose(w); unlink(tmpp); goto out; }
+    } else if (fchmod(tfd, 0664) != 0) {
+        if (f) fclose(f);
+        fclose(w); unlink(tmpp); goto out;
+    }
+
+    /* copia línea a línea (de cualquier largo) sustituyendo la clave: tiempo lineal */
+    if (f) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t n;
+        while ((n = getline(&line, &cap, f)) > 0) {
+            if (line[0] != '#' && line_has_key(line, key)) {
+                found = true;
+                fprintf(w, "%s=%s\n", key, value);
+            } else {
+                fwrite(line, 1, (size_t)n, w);
             }
-            strncat(buf, line, sizeof(buf)-strlen(buf)-1);
         }
+        free(line);
         fclose(f);
     }
-    if(!found){
-        char nl[256]; snprintf(nl, sizeof(nl), "%s=%s\n", key, value);
-        strncat(buf, nl, sizeof(buf)-strlen(buf)-1);
-    }
-    ensure_dirs("etc");
-    FILE *w = fopen(path, "w");
-    if(!w) return -1;
-    fwrite(buf, 1, strlen(buf), w);
-    fclose(w);
-    return 0;
+    if (!found) fprintf(w, "%s=%s\n", key, value);
+
+    if (fflush(w) != 0 || fsync(tfd) != 0) { fclose(w); unlink(tmpp); goto out; }
+    if (fclose(w) != 0 || rename(tmpp, path) != 0) { unlink(tmpp); goto out; }
+    /* que el rename sobreviva a una caída */
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+    rc = 0;
+out:
+    close(lfd);          /* libera el lock */
+    return rc;
 }
@@ -8,181 +8,865 @@
  *   - Robles Pérez Luis Fernando — 2203031441
  *
  * Descripción:
- *   Controla el semáforo + shared memory para limitar a MAX_INSTANCES instancias simultáneas..
+ *   Controla la shared memory para limitar a MAX_INSTANCES instancias simultáneas..
+ *   El estado compartido es un segmento POSIX (shm_open + mmap) descrito por un encabezado con
+ *   versión de formato y tamaños; sus tablas se dimensionan con IPC_SLOTS al crearlo. Se protege
+ *   con un mutex robusto (PTHREAD_PROCESS_SHARED) dentro del propio segmento.
+ *   También publica la Config ya interpretada en la memoria compartida (seqlock + generación):
+ *   cada instancia compara un contador antes de cada comando y sólo copia si cambió.
  */
 
 
 #include "common.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-int g_sem_id = -1; //id del semaforo
-int g_shm_id = -1; //id de la memoria compartida
 SharedState *g_shared = NULL; // puntero al estado compartido
 
-static int sem_lock(int semid){
-    struct sembuf sb = {0, -1, SEM_UNDO};
-    return semop(semid, &sb, 1);
+static char g_shm_name[64];          /* nombre POSIX del segmento (SHM_NAME_FMT) */
+static size_t g_shm_size;            /* bytes mapeados */
+/* tablas del segmento, en los desplazamientos de su encabezado */
+static uint32_t g_nslots, g_nbcast;
+static InstanceSlot *g_slots;
+static pid_t *g_adm_queue;
+static InstanceStats *g_stats;
+static NotifMailbox *g_mbox;
+static NotifCell *g_bcast;
+static _Atomic uint32_t *g_pidx;
+static uint32_t g_npidx;
+static int32_t *g_live;
+
+static int g_my_slot = -1;            /* casilla de esta instancia en slots[] y mbox[] */
+static uint32_t g_my_gen;            /* generación de esa casilla mientras la ocupamos */
+static uint64_t g_bcast_cursor;      /* siguiente aviso broadcast por leer */
+static InstanceStats g_local_stats;  /* sin casilla (sin IPC, --server): se cuenta aquí */
+
+#define SHM_INIT_WAIT_MS 2000        /* cuánto esperar a que el creador del segmento termine */
+
+static void sleep_ms(long ms){
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+/* Celda inicial de pid en pidx[] (hash multiplicativo) */
+static uint32_t pidx_home(pid_t pid){
+    return ((uint32_t)pid * 2654435761u) & (g_npidx - 1);
+}
+
+/* Alta en el índice; con el mutex tomado y slots[slot].pid ya puesto. Sin movimientos: no
+ * hace falta pidx_seq (un lector a la mitad, a lo más, no la ve todavía). */
+static void pidx_insert(int slot){
+    uint32_t i = pidx_home(g_slots[slot].pid);
+    while(atomic_load_explicit(&g_pidx[i], memory_order_relaxed)) i = (i + 1) & (g_npidx - 1);
+    atomic_store_explicit(&g_pidx[i], (uint32_t)slot + 1, memory_order_release);
+}
+
+/* Baja del índice con corrimiento hacia atrás (sin lápidas); con el mutex tomado y
+ * slots[slot].pid todavía puesto */
+static void pidx_remove(int slot){
+    uint32_t mask = g_npidx - 1, i = pidx_home(g_slots[slot].pid), n = 0;
+    while(atomic_load_explicit(&g_pidx[i], memory_order_relaxed) != (uint32_t)slot + 1){
+        if(++n > mask) return;                         /* no estaba (reparación) */
+        i = (i + 1) & mask;
+    }
+    atomic_fetch_add_explicit(&g_shared->pidx_seq, 1, memory_order_acq_rel);      /* impar */
+    for(uint32_t j = i;;){
+        j = (j + 1) & mask;
+        uint32_t v = atomic_load_explicit(&g_pidx[j], memory_order_relaxed);
+        if(!v) break;
+        /* la entrada de j puede ocupar el hueco i si i está entre su celda inicial y j */
+        uint32_t home = pidx_home(g_slots[v - 1].pid);
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            atomic_store_explicit(&g_pidx[i], v, memory_order_relaxed);
+            i = j;
+        }
+    }
+    atomic_store_explicit(&g_pidx[i], 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_shared->pidx_seq, 1, memory_order_release);      /* par */
+}
+
+/* Lista compacta de casillas ocupadas (broadcast en O(instancias)); con el mutex tomado */
+static void live_add(int slot){
+    g_slots[slot].live_pos = g_shared->instance_count;
+    g_live[g_shared->instance_count++] = slot;
+}
+
+static void live_remove(int slot){
+    int pos = g_slots[slot].live_pos, last = g_live[--g_shared->instance_count];
+    g_live[pos] = last;
+    g_slots[last].live_pos = pos;
+}
+
+/*
+ * Rehace la lista de libres, live[], el índice de pids y el contador a partir de slots[].pid:
+ * segmento nuevo, o dueño del mutex muerto a la mitad de un alta/baja. Es lo único O(nslots)
+ * fuera de reap_dead().
+ */
+static void shared_repair(void){
+    /* impar durante la reconstrucción (ya lo está si alguien murió a la mitad de un borrado) */
+    uint32_t seq = atomic_load_explicit(&g_shared->pidx_seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&g_shared->pidx_seq, seq, memory_order_release);
+    for(uint32_t i=0;i<g_npidx;i++) atomic_store_explicit(&g_pidx[i], 0, memory_order_relaxed);
+    g_shared->free_head = -1;
+    g_shared->instance_count = 0;
+    for(int i=(int)g_nslots-1;i>=0;i--){
+        InstanceSlot *s = &g_slots[i];
+        if(s->pid){ live_add(i); pidx_insert(i); continue; }
+        s->next_free = g_shared->free_head;
+        g_shared->free_head = i;
+    }
+    atomic_store_explicit(&g_shared->pidx_seq, seq + 1, memory_order_release);
+    if(g_shared->adm_len < 0 || g_shared->adm_len > (int)g_nslots) g_shared->adm_len = 0;
+}
+
+/* Inicializa el mutex del segmento; al crearlo o con lock_reinit tomado */
+static int shm_mutex_init(void){
+    pthread_mutexattr_t at;
+    if(pthread_mutexattr_init(&at) != 0) return -1;
+    pthread_mutexattr_setpshared(&at, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&at, PTHREAD_MUTEX_ROBUST);
+    int r = pthread_mutex_init(&g_shared->lock, &at);
+    pthread_mutexattr_destroy(&at);
+    if(r != 0){ errno = r; perror("pthread_mutex_init"); return -1; }
+    return 0;
+}
+
+/**
+ * Toma el mutex del estado compartido. Si su dueño murió con él tomado (EOWNERDEAD),
+ * repara el estado y lo marca consistente; si ya es irrecuperable lo reinicializa.
+ * @return 0 con el mutex tomado, -1 si no se pudo.
+ */
+static int shm_lock(void){
+    int r = pthread_mutex_lock(&g_shared->lock);
+    if(r == EOWNERDEAD){
+        shared_repair();
+        pthread_mutex_consistent(&g_shared->lock);
+        log_error("IPC: una instancia murió con el estado compartido bloqueado; se recuperó");
+        return 0;
+    }
+    if(r == ENOTRECOVERABLE){
+        /* sólo uno lo reinicializa (quien toma lock_reinit): los demás lo esperan hasta 1 s
+         * por si ese murió a la mitad, y luego ya lo encuentran sano */
+        uint32_t idle = 0;
+        if(atomic_compare_exchange_strong(&g_shared->lock_reinit, &idle, 1)){
+            int t = pthread_mutex_trylock(&g_shared->lock);
+            if(t == 0) pthread_mutex_unlock(&g_shared->lock);
+            else if(t == ENOTRECOVERABLE) shm_mutex_init();
+            atomic_store(&g_shared->lock_reinit, 0);
+        } else {
+            for(int i = 0; i < 100 && atomic_load(&g_shared->lock_reinit); i++) sleep_ms(10);
+        }
+        r = pthread_mutex_lock(&g_shared->lock);
+        if(r == EOWNERDEAD){ pthread_mutex_consistent(&g_shared->lock); r = 0; }
+        if(r == 0) shared_repair();
+    }
+    return r == 0 ? 0 : -1;
+}
+static void shm_unlock(void){
+    pthread_mutex_unlock(&g_shared->lock);
+}
+
+/* ---------------- segmento ---------------- */
+
+#define SHM_ALIGN(x) (((x) + 63) & ~(uint64_t)63)
+
+/* Calcula en h los desplazamientos y el tamaño de un segmento con esas tablas */
+static void shm_layout(ShmHeader *h, uint32_t nslots, uint32_t nbcast){
+    uint64_t off = SHM_ALIGN(sizeof(SharedState));
+    h->nslots = nslots;
+    h->nbcast = nbcast;
+    h->off_slots = off; off = SHM_ALIGN(off + (uint64_t)nslots * sizeof(InstanceSlot));
+    h->off_queue = off; off = SHM_ALIGN(off + (uint64_t)nslots * sizeof(pid_t));
+    h->off_stats = off; off = SHM_ALIGN(off + (uint64_t)nslots * sizeof(InstanceStats));
+    h->off_mbox  = off; off = SHM_ALIGN(off + (uint64_t)nslots * sizeof(NotifMailbox));
+    h->off_bcast = off; off = SHM_ALIGN(off + (uint64_t)nbcast * sizeof(NotifCell));
+    h->npidx = 1;
+    while(h->npidx < 2 * nslots) h->npidx <<= 1;
+    h->off_pidx  = off; off = SHM_ALIGN(off + (uint64_t)h->npidx * sizeof(uint32_t));
+    h->off_live  = off; off = SHM_ALIGN(off + (uint64_t)nslots * sizeof(int32_t));
+    h->size = off;
+}
+
+/* NULL si este binario entiende el segmento descrito por h; si no, el motivo */
+static const char *shm_incompatible(const ShmHeader *h, off_t file_size){
+    if(h->version != SHM_LAYOUT_VERSION) return "otra versión de formato";
+    if(h->fixed_size != sizeof(SharedState)) return "otro tamaño de la parte fija";
+    if(h->nslots == 0 || h->nbcast == 0) return "tablas vacías";
+    ShmHeader want;
+    shm_layout(&want, h->nslots, h->nbcast);
+    if(want.off_slots != h->off_slots || want.off_queue != h->off_queue ||
+       want.off_stats != h->off_stats || want.off_mbox != h->off_mbox ||
+       want.off_bcast != h->off_bcast || want.npidx != h->npidx ||
+       want.off_pidx != h->off_pidx || want.off_live != h->off_live || want.size != h->size)
+        return "otros tamaños de casilla o de buzón";
+    if((uint64_t)file_size < h->size) return "más corto que lo que declara";
+    return NULL;
+}
+
+/* Deja g_shared y las tablas apuntando al segmento mapeado en p */
+static void shm_map(void *p, size_t size){
+    g_shared = p;
+    g_shm_size = size;
+    const ShmHeader *h = &g_shared->hdr;
+    g_nslots = h->nslots;
+    g_nbcast = h->nbcast;
+    g_slots     = (InstanceSlot*)((char*)p + h->off_slots);
+    g_adm_queue = (pid_t*)((char*)p + h->off_queue);
+    g_stats     = (InstanceStats*)((char*)p + h->off_stats);
+    g_mbox      = (NotifMailbox*)((char*)p + h->off_mbox);
+    g_bcast     = (NotifCell*)((char*)p + h->off_bcast);
+    g_npidx     = h->npidx;
+    g_pidx      = (_Atomic uint32_t*)((char*)p + h->off_pidx);
+    g_live      = (int32_t*)((char*)p + h->off_live);
+}
+
+static void shm_unmap(void){
+    if(!g_shared) return;
+    munmap(g_shared, g_shm_size);
+    g_shared = NULL;
+    g_slots = NULL; g_adm_queue = NULL; g_stats = NULL; g_mbox = NULL; g_bcast = NULL;
+    g_pidx = NULL; g_live = NULL;
+    g_nslots = g_nbcast = g_npidx = 0;
 }
-static int sem_unlock(int semid){
-    struct sembuf sb = {0, +1, SEM_UNDO};
-    return semop(semid, &sb, 1);
+
+/* Somos los creadores (O_EXCL): dimensionar con IPC_SLOTS, inicializar y publicar magic */
+static int shm_create(int fd){
+    ShmHeader h;
+    memset(&h, 0, sizeof(h));
+    shm_layout(&h, (uint32_t)g_cfg.ipc_slots, NOTIF_MAX);
+    fchmod(fd, 0666);                    /* como el shmget de antes: sin importar umask */
+    if(ftruncate(fd, (off_t)h.size) != 0){ perror("ftruncate"); shm_unlink(g_shm_name); return -1; }
+    void *p = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED){ perror("mmap"); shm_unlink(g_shm_name); return -1; }
+
+    SharedState *sh = p;                 /* el archivo nuevo ya viene en ceros */
+    sh->hdr.creator = getpid();
+    sh->hdr.version = SHM_LAYOUT_VERSION;
+    sh->hdr.fixed_size = sizeof(SharedState);
+    sh->hdr.nslots = h.nslots;
+    sh->hdr.nbcast = h.nbcast;
+    sh->hdr.size = h.size;
+    sh->hdr.off_slots = h.off_slots; sh->hdr.off_queue = h.off_queue;
+    sh->hdr.off_stats = h.off_stats; sh->hdr.off_mbox = h.off_mbox; sh->hdr.off_bcast = h.off_bcast;
+    sh->hdr.npidx = h.npidx; sh->hdr.off_pidx = h.off_pidx; sh->hdr.off_live = h.off_live;
+    shm_map(p, h.size);
+    if(shm_mutex_init() != 0){ shm_unmap(); shm_unlink(g_shm_name); return -1; }
+    shared_repair();
+    atomic_store_explicit(&sh->hdr.magic, SHM_MAGIC, memory_order_release);
+    return 0;
 }
 
+/*
+ * Segmento ya existente: esperar a que su creador termine, validar el formato y mapearlo.
+ * @return 0 mapeado; 1 si el creador murió sin terminarlo; -1 error o binario incompatible.
+ */
+static int shm_attach(int fd){
+    struct stat st;
+    ShmHeader *hp = MAP_FAILED;
+    for(long waited = 0; ; waited += 10){
+        if(fstat(fd, &st) != 0){ perror("fstat"); return -1; }
+        if(hp == MAP_FAILED && st.st_size >= (off_t)sizeof(ShmHeader)){
+            hp = mmap(NULL, sizeof(ShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+            if(hp == MAP_FAILED){ perror("mmap"); return -1; }
+        }
+        if(hp != MAP_FAILED && atomic_load_explicit(&hp->magic, memory_order_acquire) == SHM_MAGIC)
+            break;
+        if(waited >= SHM_INIT_WAIT_MS){
+            pid_t creator = hp != MAP_FAILED ? hp->creator : 0;
+            if(hp != MAP_FAILED) munmap(hp, sizeof(ShmHeader));
+            if(creator > 0 && kill(creator, 0) == 0){
+                fprintf(stderr, "IPC: el segmento %s sigue sin inicializar (lo crea el pid %d)\n",
+                        g_shm_name, (int)creator);
+                return -1;
+            }
+            return 1;
+        }
+        sleep_ms(10);
+    }
+    ShmHeader h;
+    memcpy(&h, hp, sizeof(h));
+    munmap(hp, sizeof(ShmHeader));
+
+    const char *why = shm_incompatible(&h, st.st_size);
+    if(why){
+        fprintf(stderr, "IPC: el segmento %s no es compatible con este binario (%s; formato v%u, "
+                "este binario usa v%u). Cierra las instancias que lo usan o borra /dev/shm%s.\n",
+                g_shm_name, why, h.version, SHM_LAYOUT_VERSION, g_shm_name);
+        log_error("IPC: segmento %s incompatible (%s, formato v%u)", g_shm_name, why, h.version);
+        return -1;
+    }
+    void *p = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED){ perror("mmap"); return -1; }
+    shm_map(p, h.size);
+    return 0;
+}
 
+/* Borra el nombre si todavía es el del segmento abierto en fd (otro pudo rehacerlo ya) */
+static void shm_unlink_if_same(int fd){
+    char path[96];
+    struct stat a, b;
+    snprintf(path, sizeof(path), "/dev/shm%s", g_shm_name);
+    if(fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev)
+        shm_unlink(g_shm_name);
+}
 
 /**
- * Inicializa semáforo y shared memory.
+ * Crea o abre el segmento compartido y lo mapea completo. Quien lo crea (O_EXCL) lo dimensiona
+ * con IPC_SLOTS y pone hdr.magic al final; los demás esperan ese magic y rechazan un segmento
+ * con otro formato. IPC_SLOTS sólo cuenta al crearlo: mientras exista se usa su tamaño.
  * @return 0 en éxito, -1 en error.
  */
 
 int ipc_init(void){
+    if(g_shared) return 0;
     // ftok path ensure
     FILE *f = fopen(FTOK_PATH, "a"); if(f) fclose(f);
     key_t key = ftok(FTOK_PATH, FTOK_PROJ_ID);
     if(key == (key_t)-1){ perror("ftok"); return -1; }
+    snprintf(g_shm_name, sizeof(g_shm_name), SHM_NAME_FMT, (unsigned)key);
 
-    g_sem_id = semget(key, 1, IPC_CREAT | 0666);
-    if(g_sem_id==-1){ perror("semget"); return -1; }
-    // inicializar semáforo si aún no
-    unsigned short arr[1];
-    union semun { int val; struct semid_ds *buf; unsigned short *array; } arg;
-    if(semctl(g_sem_id, 0, GETALL, arr)==-1){
-        // try to init
-        arg.val = 1;
-        if(semctl(g_sem_id, 0, SETVAL, arg)==-1){
-            perror("semctl SETVAL"); return -1;
+    for(int attempt = 0; attempt < 3 && !g_shared; attempt++){
+        int rc, fd = shm_open(g_shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if(fd >= 0){
+            rc = shm_create(fd);
+        } else if(errno == EEXIST){
+            fd = shm_open(g_shm_name, O_RDWR | O_CLOEXEC, 0);
+            if(fd < 0 && errno == ENOENT) continue;        /* lo borraron entre ambos shm_open */
+            if(fd < 0){ perror("shm_open"); return -1; }
+            rc = shm_attach(fd);
+            if(rc == 1){
+                log_error("IPC: el creador del segmento %s murió antes de inicializarlo; se rehace",
+                          g_shm_name);
+                shm_unlink_if_same(fd);
+            }
+        } else {
+            perror("shm_open");
+            return -1;
         }
+        close(fd);
+        if(rc < 0) return -1;
     }
+    if(!g_shared) return -1;
+
+    /*
+     * g_cfg se acaba de leer del archivo. Se publica si no hay config publicada o si la
+     * publicada es de otra versión del mismo .conf (p. ej. quedó de una ejecución anterior).
+     */
+    Config pub;
+    int r = config_snapshot(&pub, NULL);
+    if(r < 0 || (r > 0 && strcmp(pub.conf_path, g_cfg.conf_path) == 0 &&
+                 (pub.conf_ino != g_cfg.conf_ino || pub.conf_dev != g_cfg.conf_dev ||
+                  pub.conf_size != g_cfg.conf_size ||
+                  pub.conf_mtime.tv_sec != g_cfg.conf_mtime.tv_sec ||
+                  pub.conf_mtime.tv_nsec != g_cfg.conf_mtime.tv_nsec)))
+        config_publish(&g_cfg);
+    return 0;
+}
 
-    g_shm_id = shmget(key, sizeof(SharedState), IPC_CREAT | 0666);
-    if(g_shm_id==-1){ perror("shmget"); return -1; }
-    g_shared = (SharedState*)shmat(g_shm_id, NULL, 0);
-    if(g_shared==(void*)-1){ perror("shmat"); g_shared=NULL; return -1; }
+/* ---------------- config publicada ---------------- */
 
-    // primera vez: asegurar consistencia
-    sem_lock(g_sem_id);
-    if(g_shared->instance_count < 0 || g_shared->instance_count > MAX_PIDS){
-        g_shared->instance_count = 0;
-        memset(g_shared->pids, 0, sizeof(g_shared->pids));
+static uint64_t g_cfg_seen;          /* seq de la última config publicada que adoptamos */
+static struct timespec g_cfg_stat_at;
+
+/**
+ * Publica c para las demás instancias. Los escritores se excluyen con CAS sobre seq;
+ * si seq sigue impar demasiado tiempo se asume que ese escritor murió a la mitad.
+ */
+void config_publish(const Config *c){
+    if(!g_shared) return;
+    SharedConfig *sc = &g_shared->config;
+    uint64_t s = atomic_load_explicit(&sc->seq, memory_order_relaxed), mine;
+    for(int spins = 0; ; spins++){
+        mine = (s & 1) ? s + 2 : s + 1;         /* impar: copia en curso */
+        if(((s & 1) == 0 || spins > 100000) &&
+           atomic_compare_exchange_weak_explicit(&sc->seq, &s, mine,
+                                                 memory_order_acquire, memory_order_relaxed))
+            break;
+        if(s & 1){ sched_yield(); s = atomic_load_explicit(&sc->seq, memory_order_relaxed); }
     }
-    if (g_shared->notif_count < 0 || g_shared->notif_count > NOTIF_MAX) {
-    	g_shared->notif_count = 0;
+    atomic_thread_fence(memory_order_release);
+    memcpy(&sc->cfg, c, sizeof(*c));
+    sc->generation++;
+    atomic_store_explicit(&sc->seq, mine + 1, memory_order_release);
+    g_cfg_seen = mine + 1;
+}
+
+/**
+ * Copia la config publicada si cambió desde la última adoptada.
+ * @return 1 si copió en out, 0 si no hay nada nuevo (un load atómico), -1 si no hay publicada.
+ */
+int config_snapshot(Config *out, uint64_t *generation){
+    if(!g_shared) return -1;
+    SharedConfig *sc = &g_shared->config;
+    for(int tries = 0; tries < 1000; tries++){
+        uint64_t s1 = atomic_load_explicit(&sc->seq, memory_order_acquire);
+        if(s1 == 0) return -1;
+        if(s1 == g_cfg_seen) return 0;
+        if(s1 & 1){ sched_yield(); continue; }
+        memcpy(out, &sc->cfg, sizeof(*out));
+        if(generation) *generation = sc->generation;
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&sc->seq, memory_order_relaxed) == s1){
+            g_cfg_seen = s1;
+            return 1;
+        }
     }
-    sem_unlock(g_sem_id);
-    return 0;
+    return -1;
+}
+
+static long ms_since(const struct timespec *t){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (now.tv_sec - t->tv_sec) * 1000L + (now.tv_nsec - t->tv_nsec) / 1000000L;
 }
 
 /**
- * Intentar añadir la instancia actual.
- * @return 0 si hay espacio, 1 si excede el máximo, -1 en error.
+ * Pone al día g_cfg antes de un comando: primero la config publicada (sin E/S); además, como
+ * mucho cada CONFIG_STAT_INTERVAL_MS (o siempre con check_file), un stat() del .conf por si se
+ * editó a mano, en cuyo caso se vuelve a leer y se publica.
+ * @return 1 si g_cfg cambió, 0 si no.
  */
+int config_refresh(bool check_file){
+    Config prev, next;
+    /* sólo configs del mismo archivo: instancias en otros directorios leen otro .conf */
+    if(config_snapshot(&next, NULL) > 0 && strcmp(next.conf_path, g_cfg.conf_path) == 0){
+        config_adopt(&next, &prev);
+    } else {
+        if(!check_file && g_cfg_stat_at.tv_sec && ms_since(&g_cfg_stat_at) < CONFIG_STAT_INTERVAL_MS)
+            return 0;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &g_cfg_stat_at);
+        if(config_reload(&prev) <= 0) return 0;
+        config_publish(&g_cfg);
+    }
+    ensure_dirs(g_cfg.lock_dir);
+    log_apply_config(&prev);
+    return 1;
+}
+
+/* Momento de arranque de pid (campo 22 de /proc/<pid>/stat, en ticks); 0 si no se pudo leer */
+static uint64_t proc_start_time(pid_t pid){
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if(n <= 0) return 0;
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');               /* el nombre del comando puede traer espacios */
+    if(!p || p[1] != ' ' || p[2] == 'Z') return 0;   /* zombi: ya no cuenta */
+    for(int field = 2; field < 22 && p; field++) p = strchr(p + 1, ' ');
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+/* ¿Sigue vivo el ocupante de s? PID existente, no zombi y con el mismo arranque (no reutilizado) */
+static bool slot_alive(const InstanceSlot *s){
+    pid_t p = s->pid;
+    if(kill(p, 0) == -1 && errno == ESRCH) return false;
+    if(!s->start_time) return true;            /* sin /proc al entrar: sólo kill() */
+    return proc_start_time(p) == s->start_time;
+}
+
+/* Devuelve la casilla a la lista de libres; con el mutex tomado */
+static void slot_free(int i){
+    InstanceSlot *s = &g_slots[i];
+    pidx_remove(i);
+    live_remove(i);
+    atomic_store(&s->pid, 0);
+    s->next_free = g_shared->free_head;
+    g_shared->free_head = i;
+}
+
+/* Libera las casillas de instancias que murieron sin instance_leave(); con el mutex tomado */
+static void reap_dead(void){
+    for(int k=g_shared->instance_count-1;k>=0;k--){     /* de atrás: slot_free mueve el último */
+        int i = g_live[k];
+        if(!slot_alive(&g_slots[i])) slot_free(i);
+    }
+}
+
+/* ---------------- cola de admisión ---------------- */
+
+static long futex_wait(_Atomic uint32_t *word, uint32_t val, long ms){
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    return syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+/* Avisa a los que esperan que algo cambió (salida de una instancia o movimiento de la cola) */
+static void adm_wake(void){
+    atomic_fetch_add(&g_shared->adm_futex, 1);
+    syscall(SYS_futex, (uint32_t*)&g_shared->adm_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Posición (1 = siguiente) de pid en la cola tras quitar a los que murieron esperando; 0 si no está */
+static int adm_position(pid_t pid){
+    int j = 0, pos = 0;
+    for(int i=0;i<g_shared->adm_len;i++){
+        pid_t p = g_adm_queue[i];
+        if(p != pid && kill(p, 0) == -1 && errno == ESRCH) continue;
+        g_adm_queue[j++] = p;
+        if(p == pid) pos = j;
+    }
+    g_shared->adm_len = j;
+    return pos;
+}
+
+static void adm_remove(pid_t pid){
+    int j = 0;
+    for(int i=0;i<g_shared->adm_len;i++)
+        if(g_adm_queue[i] != pid) g_adm_queue[j++] = g_adm_queue[i];
+    g_shared->adm_len = j;
+}
+
+/* Ocupa una casilla si hay lugar; con el mutex tomado. @return la casilla o -1 si está lleno. */
+static int enter_locked(uint64_t start){
+    // lleno en apariencia: antes de rechazar, liberar las casillas de instancias caídas
+    if(g_shared->instance_count >= g_cfg.max_instances || g_shared->free_head < 0)
+        reap_dead();
+    if(g_shared->instance_count >= g_cfg.max_instances || g_shared->free_head < 0)
+        return -1;
 
+    int slot = g_shared->free_head;
+    InstanceSlot *s = &g_slots[slot];
+    g_shared->free_head = s->next_free;
+    NotifMailbox *mb = &g_mbox[slot];
+    mpsc_ring_init(&mb->ring, mb->cells, NOTIF_MAILBOX_SLOTS, sizeof(NotifCell));
+    s->start_time = start;
+    memset(&g_stats[slot], 0, sizeof(InstanceStats));
+    g_my_gen = atomic_fetch_add(&s->gen, 1) + 1;
+    atomic_store(&s->pid, getpid());
+    live_add(slot);
+    pidx_insert(slot);
+    g_my_slot = slot;
+    g_bcast_cursor = atomic_load(&g_shared->bcast_tail);   /* sólo broadcasts nuevos */
+    return slot;
+}
 
+/**
+ * Intentar añadir la instancia actual. O(1) salvo cuando la tabla parece llena: entonces
+ * reap_dead() recorre las casillas y libera las de instancias caídas.
+ * @return 0 si hay espacio, 1 si excede el máximo, -1 en error.
+ */
 int instance_try_enter(void){
     if(ipc_init()!=0) return -1;
-    int ok = 0;
-    sem_lock(g_sem_id);
-    // retirar pids zombies
-    for(int i=0;i<g_shared->instance_count && i<MAX_PIDS;i++){
-        if(g_shared->pids[i]!=0 && kill(g_shared->pids[i], 0)==-1 && errno==ESRCH){
-            // limpiar
-            g_shared->pids[i] = 0;
+    config_refresh(false);          /* MAX_INSTANCES vigente, aunque otro shell lo acabe de cambiar */
+    uint64_t start = proc_start_time(getpid());     /* fuera del mutex: lee /proc */
+    if(shm_lock() != 0) return -1;
+    /* si hay cola (de procesos vivos), el lugar que se libere es del primero en ella */
+    if(g_shared->adm_len > 0) adm_position(0);
+    int slot = g_shared->adm_len > 0 ? -1 : enter_locked(start);
+    shm_unlock();
+    return slot >= 0 ? 0 : 1; // 0 ok, 1 excedido
+}
+
+/**
+ * Espera en la cola FIFO de admisión hasta que haya lugar o pasen timeout_sec segundos.
+ * Duerme en un futex que instance_leave() despierta; además revisa cada segundo, porque una
+ * instancia caída no llama a instance_leave() y su casilla sólo se recupera con reap_dead().
+ * @return 0 si entró, 1 si se agotó el tiempo, la cola estaba llena o se interrumpió; -1 sin IPC.
+ */
+int instance_wait_enter(int timeout_sec){
+    if(ipc_init()!=0) return -1;
+    uint64_t start = proc_start_time(getpid());
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t0);
+
+    if(shm_lock() != 0) return -1;
+    bool queued = g_shared->adm_len < (int)g_nslots;
+    if(queued) g_adm_queue[g_shared->adm_len++] = getpid();
+    shm_unlock();
+    if(!queued) return 1;
+
+    int rc = 1, last_pos = 0;
+    for(;;){
+        uint32_t seen = atomic_load(&g_shared->adm_futex);
+        config_refresh(false);                    /* MAX_INSTANCES pudo subir */
+        if(shm_lock() != 0){ rc = -1; break; }
+        int pos = adm_position(getpid());
+        if(pos == 0 && g_shared->adm_len < (int)g_nslots){    /* nos sacaron (reparación): volver */
+            g_adm_queue[g_shared->adm_len++] = getpid();
+            pos = g_shared->adm_len;
         }
-    }
-    // compactar
-    int j=0;
-    for(int i=0;i<MAX_PIDS;i++){
-        if(g_shared->pids[i]) g_shared->pids[j++] = g_shared->pids[i];
-    }
-    g_shared->instance_count = j;
+        if(pos == 1 && enter_locked(start) >= 0){
+            adm_remove(getpid());
+            shm_unlock();
+            adm_wake();                           /* el siguiente pasa a ser el primero */
+            rc = 0;
+            break;
+        }
+        shm_unlock();
 
-    if(g_shared->instance_count < g_cfg.max_instances){
-        // entrar
-        if(g_shared->instance_count < MAX_PIDS){
-            g_shared->pids[g_shared->instance_count++] = getpid();
-            ok = 1;
-        } else {
-            ok = 0;
+        if(pos != last_pos){
+            fprintf(stderr, "MAX_INSTANCES alcanzado: posición %d en cola\n", pos);
+            last_pos = pos;
         }
-    } else {
-        ok = 0;
+        long left = (long)timeout_sec * 1000L - ms_since(&t0);
+        if(left <= 0) break;
+        if(futex_wait(&g_shared->adm_futex, seen, left < 1000 ? left : 1000) == -1 && errno == EINTR)
+            break;                                /* Ctrl-C u otra señal: dejar de esperar */
+    }
+
+    if(rc != 0 && shm_lock() == 0){
+        adm_remove(getpid());
+        shm_unlock();
+        adm_wake();
     }
-    sem_unlock(g_sem_id);
-    return ok ? 0 : 1; // 0 ok, 1 excedido
+    return rc;
 }
 
 void instance_leave(void){
-    if(g_shared==NULL || g_sem_id==-1) return;
-    sem_lock(g_sem_id);
-    // eliminar PID
-    int j=0;
-    for(int i=0;i<g_shared->instance_count;i++){
-        if(g_shared->pids[i]!=getpid())
-            g_shared->pids[j++]=g_shared->pids[i];
-    }
-    g_shared->instance_count = j;
-    sem_unlock(g_sem_id);
+    if(g_shared==NULL) return;
+    if(shm_lock() != 0){ shm_unmap(); return; }
+    // liberar la casilla (si no nos la quitó reap_dead por error)
+    if(g_my_slot >= 0 && g_slots[g_my_slot].pid == getpid() &&
+       g_slots[g_my_slot].gen == g_my_gen)
+        slot_free(g_my_slot);
+    g_my_slot = -1;
+    bool waiters = g_shared->adm_len > 0;
+    shm_unlock();
+    if(waiters) adm_wake();
     // detach
-    shmdt(g_shared);
-    g_shared=NULL;
+    shm_unmap();
+}
+
+/* Casillas del segmento (tamaño de la tabla de instancias), 0 sin IPC */
+int instance_slots(void){
+    return g_shared ? (int)g_nslots : 0;
+}
+
+/* Contadores de esta instancia (los de su casilla, o unos locales si no tiene) */
+InstanceStats *instance_stats(void){
+    if(g_shared && g_my_slot >= 0) return &g_stats[g_my_slot];
+    return &g_local_stats;
+}
+
+/**
+ * Copia los contadores de las instancias vivas sin tomar el mutex: cada valor es una carga
+ * atómica, así que no se detiene a nadie (la foto puede mezclar instantes distintos).
+ * @return cuántas copió en pids/out (a lo más max), -1 sin IPC.
+ */
+int instance_stats_snapshot(pid_t *pids, InstanceStats *out, int max){
+    if(!g_shared) return -1;
+    int n = 0;
+    for(int i=0;i<(int)g_nslots && n<max;i++){
+        pid_t p = atomic_load_explicit(&g_slots[i].pid, memory_order_acquire);
+        if(!p) continue;
+        const InstanceStats *s = &g_stats[i];
+        InstanceStats *d = &out[n];
+#define STAT_COPY(f) atomic_store_explicit(&d->f, atomic_load_explicit(&s->f, memory_order_relaxed), \
+                                           memory_order_relaxed)
+        STAT_COPY(cmds); STAT_COPY(builtins); STAT_COPY(externals);
+        STAT_COPY(lat_total_us); STAT_COPY(lat_max_us); STAT_COPY(lock_conflicts);
+        STAT_COPY(notif_sent); STAT_COPY(notif_recv); STAT_COPY(log_bytes);
+#undef STAT_COPY
+        pids[n++] = p;
+    }
+    return n;
 }
-/** Forzar limpieza de semáforo y shared memory (rmid) */
+
+/** Forzar limpieza de la shared memory (desmapear y shm_unlink) */
 void ipc_force_cleanup(void){
-    if(g_shared){
-        shmdt(g_shared);
-        g_shared=NULL;
+    shm_unmap();
+    if(g_shm_name[0]){
+        shm_unlink(g_shm_name);
+        g_shm_name[0] = '\0';
     }
-    if(g_shm_id!=-1){
-        shmctl(g_shm_id, IPC_RMID, NULL);
-        g_shm_id=-1;
+}
+
+
+/* ---------------- notificaciones ---------------- */
+
+/*
+ * Despertador: notif_push manda NOTIF_SIGNAL a la instancia destino y su manejador escribe un
+ * byte en un pipe (self-pipe). El bucle principal hace poll() sobre stdin y ese pipe, así que
+ * la cola compartida sólo se revisa cuando de verdad llegó algo.
+ */
+static int g_wake_pipe[2] = { -1, -1 };
+
+static void on_notif_signal(int sig){
+    (void)sig;
+    int e = errno;
+    ssize_t w = write(g_wake_pipe[1], "!", 1);   /* pipe lleno = ya hay un aviso pendiente */
+    (void)w;
+    errno = e;
+}
+
+/**
+ * Prepara el despertador; llamar antes de instance_try_enter (desde ahí ya pueden llegar avisos).
+ * @return fd para poll() (POLLIN = hay notificaciones), -1 en error.
+ */
+int notif_wakeup_fd(void){
+    if (g_wake_pipe[0] >= 0) return g_wake_pipe[0];
+    if (pipe(g_wake_pipe) != 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(g_wake_pipe[i], F_SETFL, fcntl(g_wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(g_wake_pipe[i], F_SETFD, FD_CLOEXEC);
     }
-    if(g_sem_id!=-1){
-        semctl(g_sem_id, 0, IPC_RMID);
-        g_sem_id=-1;
+    struct sigaction sa = {0};
+    sa.sa_handler = on_notif_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(NOTIF_SIGNAL, &sa, NULL);
+    return g_wake_pipe[0];
+}
+
+/* Vacía el pipe del despertador (antes de drenar la cola) */
+void notif_wakeup_ack(int fd){
+    char b[64];
+    while (read(fd, b, sizeof b) > 0) ;
+}
+
+/*
+ * Casilla de pid, o -1 si no es una instancia registrada. Sin mutex: sondeo en pidx[] y, si no
+ * aparece, se confirma que ningún borrado movió celdas mientras tanto (pidx_seq igual y par).
+ */
+static int slot_of(pid_t pid){
+    for(int tries = 0; tries < 100; tries++){
+        uint32_t s1 = atomic_load_explicit(&g_shared->pidx_seq, memory_order_acquire);
+        if(s1 & 1){ sched_yield(); continue; }
+        uint32_t i = pidx_home(pid);
+        for(uint32_t n = 0; n < g_npidx; n++, i = (i + 1) & (g_npidx - 1)){
+            uint32_t v = atomic_load_explicit(&g_pidx[i], memory_order_acquire);
+            if(!v) break;
+            if(v <= g_nslots && atomic_load_explicit(&g_slots[v - 1].pid, memory_order_acquire) == pid)
+                return (int)v - 1;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&g_shared->pidx_seq, memory_order_relaxed) == s1) return -1;
     }
+    return -1;
+}
+
+/*
+ * Despierta al ocupante de la casilla slot si sigue siendo pid y está vivo (mismo arranque). Una
+ * instancia caída cuyo PID ya tiene otro proceso no debe recibir NOTIF_SIGNAL: su acción por
+ * defecto lo terminaría.
+ */
+static void notif_wake(int slot, pid_t pid){
+    const InstanceSlot *s = &g_slots[slot];
+    if(atomic_load_explicit(&s->pid, memory_order_acquire) == pid && slot_alive(s))
+        kill(pid, NOTIF_SIGNAL);
 }
 
+#define NOTIF_STUCK_MS 1000          /* celda reservada y nunca publicada (productor muerto) */
 
+static bool stuck_for(struct timespec *since){
+    if(since->tv_sec == 0){ clock_gettime(CLOCK_MONOTONIC_COARSE, since); return false; }
+    if(ms_since(since) < NOTIF_STUCK_MS) return false;
+    since->tv_sec = 0;
+    return true;
+}
+
+/**
+ * Deja msg en el buzón de to_pid (o en el anillo broadcast si to_pid==0) y lo despierta.
+ * El directo no toma el mutex (la casilla sale de pidx[] en O(1)): un buzón lleno sólo pierde
+ * avisos de su propia instancia. El broadcast lo toma un momento para copiar live[].
+ * @return 0 si quedó encolado, -1 si no (no es instancia, buzón lleno, sin IPC).
+ */
 int notif_push(pid_t to_pid, const char *msg) {
     if (!g_shared) return -1;
     if (!msg) return -1;
 
-    struct sembuf sb = {0, -1, SEM_UNDO};
-    semop(g_sem_id, &sb, 1);
-
-    if (g_shared->notif_count >= NOTIF_MAX) {
-        memmove(&g_shared->notif[0], &g_shared->notif[1],
-                (NOTIF_MAX - 1) * sizeof(Notification));
-        g_shared->notif_count = NOTIF_MAX - 1;
+    if (to_pid > 0) {
+        int slot = slot_of(to_pid);
+        if (slot < 0) return -1;                      /* nadie lo leería */
+        uint32_t gen = atomic_load_explicit(&g_slots[slot].gen, memory_order_acquire);
+        NotifMailbox *mb = &g_mbox[slot];
+        uint64_t pos;
+        NotifCell *c = (NotifCell*)mpsc_ring_reserve(&mb->ring, mb->cells, &pos);
+        if (!c) return -1;
+        c->gen = gen;
+        c->n.to_pid = to_pid;
+        snprintf(c->n.text, sizeof(c->n.text), "%s", msg);
+        /* por CAS: si el dueño nos dio por muertos y abandonó la celda, no publicar */
+        if (!mpsc_ring_commit_cas((MpscCell*)c, pos)) return -1;
+        notif_wake(slot, to_pid);
+        stat_add(&instance_stats()->notif_sent, 1);
+        return 0;
     }
 
-    Notification *n = &g_shared->notif[g_shared->notif_count++];
-    n->to_pid = to_pid;
-    snprintf(n->text, sizeof(n->text), "%s", msg);
-
-    sb.sem_op = +1;
-    semop(g_sem_id, &sb, 1);
+    /* broadcast: se sobrescribe lo más viejo; cada lector lleva su cursor */
+    uint64_t pos = atomic_fetch_add(&g_shared->bcast_tail, 1);
+    NotifCell *c = &g_bcast[pos % g_nbcast];
+    atomic_store_explicit(&c->seq, 2*pos + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    c->n.to_pid = 0;
+    snprintf(c->n.text, sizeof(c->n.text), "%s", msg);
+    atomic_store_explicit(&c->seq, 2*pos + 2, memory_order_release);
+    /* despertar sólo a las instancias vivas: se copia live[] con el mutex y se avisa fuera */
+    int n = 0, *slots = NULL;
+    pid_t *pids = NULL;
+    if (shm_lock() == 0) {
+        int cnt = g_shared->instance_count;
+        slots = malloc((size_t)(cnt ? cnt : 1) * sizeof(*slots));
+        pids = malloc((size_t)(cnt ? cnt : 1) * sizeof(*pids));
+        for (int k = 0; slots && pids && k < cnt; k++) {
+            slots[n] = g_live[k];
+            pids[n] = g_slots[g_live[k]].pid;
+            if (pids[n] != getpid()) n++;
+        }
+        shm_unlock();
+    }
+    for (int k = 0; k < n; k++) notif_wake(slots[k], pids[k]);
+    free(slots);
+    free(pids);
+    stat_add(&instance_stats()->notif_sent, 1);
     return 0;
 }
 
-void notif_drain_for(pid_t pid) {
+/* Avisos broadcast aún no vistos por esta instancia; un lector rezagado pierde los más viejos */
+static void bcast_drain(FILE *out) {
+    static struct timespec stuck;
+    uint64_t tail = atomic_load_explicit(&g_shared->bcast_tail, memory_order_acquire);
+    if (tail - g_bcast_cursor > g_nbcast) g_bcast_cursor = tail - g_nbcast;
+    while (g_bcast_cursor < tail) {
+        NotifCell *c = &g_bcast[g_bcast_cursor % g_nbcast];
+        uint64_t want = 2*g_bcast_cursor + 2;
+        uint64_t s1 = atomic_load_explicit(&c->seq, memory_order_acquire);
+        if (s1 < want) {                              /* escribiéndose todavía */
+            if (!stuck_for(&stuck)) break;
+            g_bcast_cursor++;                         /* su escritor murió: saltarla */
+            continue;
+        }
+        stuck.tv_sec = 0;
+        Notification n = c->n;
+        atomic_thread_fence(memory_order_acquire);
+        if (s1 == want && atomic_load_explicit(&c->seq, memory_order_relaxed) == s1) {
+            fprintf(out, "🔔 Notificación: %s\n", n.text);
+            stat_add(&instance_stats()->notif_recv, 1);
+        }
+        g_bcast_cursor++;                             /* s1 > want: ya la sobrescribieron */
+    }
+}
+
+/* Escribe en out los avisos pendientes de esta instancia: su buzón y luego los broadcast */
+void notif_drain_for(pid_t pid, FILE *out) {
     if (!g_shared) return;
 
-    struct sembuf sb = {0, -1, SEM_UNDO};
-    semop(g_sem_id, &sb, 1);
-
-    int i = 0;
-    while (i < g_shared->notif_count) {
-        Notification *n = &g_shared->notif[i];
-        if (n->to_pid == 0 || n->to_pid == pid) {
-            fprintf(stderr, "🔔 Notificación: %s\n", n->text);
-            memmove(n, n + 1, (g_shared->notif_count - i - 1) * sizeof(Notification));
-            g_shared->notif_count--;
-            continue; /* no incrementes i: ahora hay un nuevo elemento en i */
+    if (g_my_slot >= 0) {
+        static struct timespec stuck;
+        NotifMailbox *mb = &g_mbox[g_my_slot];
+        for (;;) {
+            NotifCell *c = (NotifCell*)mpsc_ring_peek(&mb->ring, mb->cells, 0);
+            if (!c) {
+                /* reservada y sin publicar: productor lento o muerto a la mitad */
+                if (mpsc_ring_pending(&mb->ring) && stuck_for(&stuck) &&
+                    mpsc_ring_abandon_head(&mb->ring, mb->cells)) continue;
+                if (!mpsc_ring_pending(&mb->ring)) stuck.tv_sec = 0;
+                break;
+            }
+            stuck.tv_sec = 0;
+            /* una casilla reutilizada puede traer avisos para su ocupante anterior */
+            if (c->gen == g_my_gen && c->n.to_pid == pid) {
+                fprintf(out, "🔔 Notificación: %s\n", c->n.text);
+                stat_add(&instance_stats()->notif_recv, 1);
+            }
+            mpsc_ring_release(&mb->ring, mb->cells, 1);
         }
-        i++;
     }
-
-    sb.sem_op = +1;
-    semop(g_sem_id, &sb, 1);
+    bcast_drain(out);
 }
-
@@ -0,0 +1,125 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *   - Enrique Hernández Mauricio — 2223030397
+ *   - Garrido Velázquez Iván — 2203025425
+ *   - Loaeza Sánchez Wendy Maritza — 2193042056
+ *   - Robles Pérez Luis Fernando — 2203031441
+ *
+ * Descripción:
+ *   uamalog_export: vuelca la bitácora binaria (LOG_BINARY=1) en CSV, TSV o JSON (un objeto por línea).
+ *   Acepta los mismos filtros que bitacora_comandos: --desde/--hasta, pid=, user=, ip= y texto.
+ *
+ *   uso: uamalog_export [-c conf] [--formato csv|tsv|json] [--errores|--todos] [filtros...]
+ */
+
+#include "common.h"
+
+typedef enum { FMT_CSV, FMT_TSV, FMT_JSON } ExportFormat;
+
+/* CSV: entre comillas y con las comillas duplicadas */
+static void put_csv(FILE *out, const char *s){
+    fputc('"', out);
+    for(; *s; s++){
+        if(*s == '"') fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/* TSV: tabuladores y saltos de línea no pueden ir en el campo */
+static void put_tsv(FILE *out, const char *s){
+    for(; *s; s++) fputc((*s == '\t' || *s == '\n' || *s == '\r') ? ' ' : *s, out);
+}
+
+static void put_json(FILE *out, const char *s){
+    fputc('"', out);
+    for(; *s; s++){
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if(c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void emit(const BinLogEntry *e, void *arg){
+    ExportFormat fmt = *(ExportFormat*)arg;
+    const BinLogRecord *r = e->rec;
+    const char *kind = r->kind ? "ERR" : "CMD";
+    long long ts_ms = (long long)(r->ts_us / 1000);
+    if(fmt == FMT_JSON){
+        printf("{\"ts\":\"%s\",\"ts_ms\":%lld,\"tipo\":\"%s\",\"pid\":%d,\"uid\":%u,\"estado\":%d,\"duracion_ms\":%u,\"user\":",
+               e->stamp, ts_ms, kind, r->pid, r->uid, r->status, r->duration_ms);
+        put_json(stdout, e->user);
+        fputs(",\"tty\":", stdout);  put_json(stdout, e->tty);
+        fputs(",\"ip\":", stdout);   put_json(stdout, e->ip);
+        fputs(",\"cmd\":", stdout);  put_json(stdout, e->cmd);
+        fputs("}\n", stdout);
+        return;
+    }
+    char sep = fmt == FMT_CSV ? ',' : '\t';
+    void (*put)(FILE*, const char*) = fmt == FMT_CSV ? put_csv : put_tsv;
+    printf("%s%c%lld%c%s%c%d%c%u%c%d%c%u%c", e->stamp, sep, ts_ms, sep, kind, sep,
+           r->pid, sep, r->uid, sep, r->status, sep, r->duration_ms, sep);
+    put(stdout, e->user); putchar(sep);
+    put(stdout, e->tty);  putchar(sep);
+    put(stdout, e->ip);   putchar(sep);
+    put(stdout, e->cmd);  putchar('\n');
+}
+
+static void usage(void){
+    fprintf(stderr, "uso: uamalog_export [-c conf] [--formato csv|tsv|json] [--errores|--todos] "
+                    "[--desde FECHA [HORA]] [--hasta FECHA [HORA]] [pid=N] [user=U] [ip=IP] [texto]\n");
+}
+
+int main(int argc, char **argv){
+    const char *conf = DEFAULT_CONF;
+    ExportFormat fmt = FMT_CSV;
+    int kind = 0;
+    char args[1024] = "";
+    size_t al = 0;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+            conf = argv[++i];
+        } else if(strcmp(argv[i], "--formato") == 0 && i + 1 < argc){
+            const char *f = argv[++i];
+            if(strcmp(f, "csv") == 0) fmt = FMT_CSV;
+            else if(strcmp(f, "tsv") == 0) fmt = FMT_TSV;
+            else if(strcmp(f, "json") == 0) fmt = FMT_JSON;
+            else { usage(); return 2; }
+        } else if(strcmp(argv[i], "--errores") == 0){
+            kind = 1;
+        } else if(strcmp(argv[i], "--todos") == 0){
+            kind = -1;
+        } else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0){
+            usage();
+            return 0;
+        } else {
+            /* el resto se entrega tal cual al intérprete de filtros de bitacora_* */
+            int n = snprintf(args + al, sizeof(args) - al, "%s\"%s\"", al ? " " : "", argv[i]);
+            if(n < 0 || (size_t)n >= sizeof(args) - al){ fprintf(stderr, "filtros demasiado largos\n"); return 2; }
+            al += (size_t)n;
+        }
+    }
+
+    if(load_config(conf, &g_cfg) != 0){
+        fprintf(stderr, "No se pudo leer %s\n", conf);
+        return 1;
+    }
+    LogQuery q;
+    if(log_query_parse(args, &q) != 0){ usage(); return 2; }
+
+    if(fmt == FMT_CSV || fmt == FMT_TSV){
+        char sep = fmt == FMT_CSV ? ',' : '\t';
+        printf("ts%cts_ms%ctipo%cpid%cuid%cestado%cduracion_ms%cuser%ctty%cip%ccmd\n",
+               sep, sep, sep, sep, sep, sep, sep, sep, sep, sep);
+    }
+    if(binlog_scan(g_cfg.log_dir, kind, &q, emit, &fmt) < 0){
+        fprintf(stderr, "No hay bitácora binaria en %s (activa LOG_BINARY=1)\n", g_cfg.log_dir);
+        return 1;
+    }
+    return 0;
+}
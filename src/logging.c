@@ -9,22 +9,56 @@
  *
  * Descripción:
  *   log_command() y log_error(): envían registros a uamashell.log y a uamashell_error.log con timestamp, PID, usuario, etc.
+ *   Cada bitácora se mantiene abierta durante toda la vida del proceso (O_APPEND) y las líneas se
+ *   acumulan en memoria; se vacían por tamaño, por tiempo (LOG_FLUSH_MS) o al terminar.
+ *   Con LOG_MODE=durable cada línea se escribe y se sincroniza (fdatasync) de inmediato.
+ *   Con LOG_MODE=async las líneas van a un anillo sin candados que vacía un hilo escritor.
+ *   Con LOG_MODE=shared el anillo está en memoria compartida y una sola instancia escribe por todas.
+ *   Con LOG_MAX_BYTES > 0 las bitácoras rotan por tamaño y los segmentos cerrados se comprimen.
+ *   Con LOG_BINARY=1 cada registro también se guarda en formato binario con índice por tiempo.
  */
 
 
 #include "common.h"
-// Abrir (o crear) archivo de log en modo append
+#include "mpsc_ring.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+/* Bitácora abierta + buffer de líneas pendientes */
+typedef struct {
+    int    fd;
+    ino_t  ino;              /* inodo abierto: si el del path cambia, otra instancia rotó */
+    char   path[PATH_MAX];
+    char   buf[LOG_BUF_SIZE];
+    size_t len;
+    struct timespec first;   /* momento en que se encoló la línea pendiente más antigua */
+} LogSink;
+
+enum { SINK_CMD = 0, SINK_ERR = 1 };
+
+static LogSink g_sinks[2] = { { .fd = -1 }, { .fd = -1 } };
+static volatile sig_atomic_t g_log_busy = 0;   /* evita reentrar al buffer desde un manejador de señal */
+static int g_log_atexit = 0;
+
+static size_t format_line(char *line, size_t size, const char *kind, const char *fmt, va_list ap);
+
+static UserContext g_proc_ctx;                 /* contexto del proceso, resuelto una sola vez */
+static int g_proc_ctx_ready = 0;
+static const UserContext *g_ctx = NULL;        /* contexto activo (proceso o sesión remota) */
 
-static FILE* open_log(const char *path){
-    ensure_dirs(g_cfg.log_dir);
-    FILE *f = fopen(path, "a");
-    return f;
-}
 // Construir rutas completas para logs de comandos y errores
 
 void resolve_paths(char *cmd_log, size_t cmd_sz, char *err_log, size_t err_sz){
-    snprintf(cmd_log, cmd_sz, "%s/%s", g_cfg.log_dir, CMD_LOG_NAME);
-    snprintf(err_log, err_sz, "%s/%s", g_cfg.log_dir, ERROR_LOG_NAME);
+    int n = snprintf(cmd_log, cmd_sz, "%s/%s", g_cfg.log_dir, CMD_LOG_NAME);
+    if(n < 0 || (size_t)n >= cmd_sz) cmd_log[cmd_sz-1] = '\0';
+    n = snprintf(err_log, err_sz, "%s/%s", g_cfg.log_dir, ERROR_LOG_NAME);
+    if(n < 0 || (size_t)n >= err_sz) err_log[err_sz-1] = '\0';
 }
 // Formatear timestamp actual "YYYY-MM-DD HH:MM:SS"
 static void timestamp(char *buf, size_t n){
@@ -32,53 +66,842 @@ static void timestamp(char *buf, size_t n){
     strftime(buf, n, "%Y-%m-%d %H:%M:%S", &tm);
 }
 
-// Obtener contexto de usuario: nombre, tty e IP (si SSH)
-void get_user_context(char *user, size_t u, char *tty, size_t t, char *ip, size_t i){
+static void context_prefix(UserContext *c){
+    snprintf(c->prefix, sizeof(c->prefix), "pid=%d user=%.63s tty=%.63s ip=%.63s",
+             getpid(), c->user, c->tty, c->ip);
+}
+
+// Resolver contexto de usuario del proceso: nombre, tty e IP (si SSH). Sólo la primera vez.
+static void resolve_process_context(void){
+    UserContext *c = &g_proc_ctx;
     const char *uenv = getenv("LOGNAME"); if(!uenv) uenv = getenv("USER");
     if(!uenv){ struct passwd *pw = getpwuid(getuid()); if(pw) uenv = pw->pw_name; }
-    snprintf(user, u, "%s", uenv ? uenv : "unknown");
+    snprintf(c->user, sizeof(c->user), "%s", uenv ? uenv : "unknown");
     // Dispositivo de entrada (tty)
 
     char *ttyname_ptr = ttyname(STDIN_FILENO);
-    snprintf(tty, t, "%s", ttyname_ptr ? ttyname_ptr : "n/a");
+    snprintf(c->tty, sizeof(c->tty), "%s", ttyname_ptr ? ttyname_ptr : "n/a");
     //ip
     const char *ssh = getenv("SSH_CLIENT");
     if(ssh){
         // formato: "IP_CLIENTE PUERTO_CLIENTE PUERTO_SERVIDOR"
         char ipbuf[64]={0};
         sscanf(ssh, "%63s", ipbuf);
-        snprintf(ip, i, "%s", ipbuf);
+        snprintf(c->ip, sizeof(c->ip), "%s", ipbuf);
     } else {
-        snprintf(ip, i, "n/a");
+        snprintf(c->ip, sizeof(c->ip), "n/a");
+    }
+    context_prefix(c);
+    g_proc_ctx_ready = 1;
+}
+
+/** Contexto activo: el de la sesión remota en curso o, si no hay, el del proceso. */
+const UserContext *log_context(void){
+    if(g_ctx) return g_ctx;
+    if(!g_proc_ctx_ready) resolve_process_context();
+    return &g_proc_ctx;
+}
+
+/** Fija el contexto de las siguientes líneas/locks; NULL vuelve al del proceso. */
+void log_set_context(const UserContext *ctx){
+    g_ctx = ctx;
+}
+
+/**
+ * Construye el contexto de una sesión remota a partir de la línea
+ * "HELLO user=<u> pid=<p> tty=<t> ip=<i>"; la IP es la del socket, no la declarada.
+ * @return 0 en éxito, -1 si la línea no tiene el formato esperado.
+ */
+int user_context_from_hello(const char *hello, const char *peer_ip, UserContext *out){
+    if(!hello || !out) return -1;
+    char user[64] = "unknown", tty[64] = "n/a";
+    int rpid = 0;
+    if(sscanf(hello, "HELLO user=%63s pid=%d tty=%63s", user, &rpid, tty) < 1) return -1;
+    snprintf(out->user, sizeof(out->user), "%s", user);
+    snprintf(out->tty,  sizeof(out->tty),  "%s", tty);
+    snprintf(out->ip,   sizeof(out->ip),   "%s", peer_ip ? peer_ip : "n/a");
+    context_prefix(out);
+    return 0;
+}
+
+// Copia del contexto activo (compatibilidad con los llamadores existentes)
+void get_user_context(char *user, size_t u, char *tty, size_t t, char *ip, size_t i){
+    const UserContext *c = log_context();
+    snprintf(user, u, "%s", c->user);
+    snprintf(tty, t, "%s", c->tty);
+    snprintf(ip, i, "%s", c->ip);
+}
+
+/* ---------------- bitácoras persistentes ---------------- */
+
+static long elapsed_ms(const struct timespec *since){
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000L + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+static int write_all_fd(int fd, const char *p, size_t n){
+    while(n){
+        ssize_t w = write(fd, p, n);
+        if(w < 0){ if(errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Abrir (o reabrir si cambió LOG_DIR) el archivo de la bitácora en modo append
+static int sink_open(LogSink *s, const char *path){
+    if(s->fd >= 0 && strcmp(s->path, path) == 0) return 0;
+    if(s->fd >= 0){ close(s->fd); s->fd = -1; }
+    ensure_dirs(g_cfg.log_dir);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+    if(fd < 0) return -1;
+    struct stat st;
+    s->ino = (fstat(fd, &st) == 0) ? st.st_ino : 0;
+    s->fd = fd;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    return 0;
+}
+
+/* ---------------- rotación por tamaño (LOG_MAX_BYTES) ----------------
+ * El archivo vivo se renombra a "<bitácora>.<AAAAmmdd-HHMMSS>" bajo un lock fcntl en LOG_DIR,
+ * de modo que sólo una instancia rota. Las demás notan el cambio de inodo antes de su
+ * siguiente escritura y reabren. El segmento cerrado se comprime (.gz) en un proceso hijo
+ * con prioridad baja, tras una espera para que las escrituras en vuelo terminen. */
+
+/* Cambia el fd del sink por el archivo vivo actual sin que el número de fd deje de ser válido */
+static void sink_reopen_same_path(LogSink *s){
+    int fd = open(s->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+    if(fd < 0) return;
+    struct stat st;
+    if(fstat(fd, &st) == 0) s->ino = st.st_ino;
+    if(s->fd >= 0){ dup2(fd, s->fd); fcntl(s->fd, F_SETFD, FD_CLOEXEC); close(fd); }
+    else s->fd = fd;
+}
+
+static void compress_segment_child(const char *seg){
+    char dst[PATH_MAX + 8], tmp[PATH_MAX + 16];
+    snprintf(dst, sizeof(dst), "%s.gz", seg);
+    snprintf(tmp, sizeof(tmp), "%s.gz.tmp", seg);
+
+    setpriority(PRIO_PROCESS, 0, 19);
+    int grace = g_cfg.log_flush_ms * 2 > LOG_ROTATE_GRACE_MS ? g_cfg.log_flush_ms * 2 : LOG_ROTATE_GRACE_MS;
+    struct timespec ts = { grace / 1000, (long)(grace % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+
+    int in = open(seg, O_RDONLY | O_CLOEXEC);
+    if(in < 0) _exit(1);
+    gzFile gz = gzopen(tmp, "wb6");
+    if(!gz) _exit(1);
+    char buf[65536]; ssize_t r;
+    while((r = read(in, buf, sizeof(buf))) > 0){
+        if(gzwrite(gz, buf, (unsigned)r) != (int)r){ gzclose(gz); unlink(tmp); _exit(1); }
+    }
+    close(in);
+    if(gzclose(gz) != Z_OK || r < 0){ unlink(tmp); _exit(1); }
+    /* primero aparece el .gz completo y después desaparece el segmento plano */
+    if(rename(tmp, dst) == 0) unlink(seg);
+    _exit(0);
+}
+
+/* Doble fork: el nieto comprime y nadie tiene que esperarlo */
+static void spawn_compressor(const char *seg){
+    pid_t pid = fork();
+    if(pid < 0) return;
+    if(pid == 0){
+        if(fork() == 0) compress_segment_child(seg);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void sink_rotate(LogSink *s){
+    char lockp[PATH_MAX + 16];
+    snprintf(lockp, sizeof(lockp), "%s.rotlock", s->path);
+    int lfd = open(lockp, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+    if(lfd < 0) return;
+    struct flock fl; memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK; fl.l_whence = SEEK_SET;
+    while(fcntl(lfd, F_SETLKW, &fl) == -1 && errno == EINTR) ;
+
+    struct stat st;
+    char seg[PATH_MAX + 32];
+    seg[0] = '\0';
+    if(stat(s->path, &st) == 0 && st.st_ino == s->ino && st.st_size >= g_cfg.log_max_bytes){
+        char stamp[32]; time_t t = time(NULL); struct tm tm; localtime_r(&t, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        int w = snprintf(seg, sizeof(seg), "%s.%s", s->path, stamp);
+        /* dos rotaciones en el mismo segundo: sufijo -N */
+        for(int n = 1; w > 0 && access(seg, F_OK) == 0 && n < 100; n++)
+            w = snprintf(seg, sizeof(seg), "%s.%s-%02d", s->path, stamp, n);
+        if(w < 0 || (size_t)w >= sizeof(seg) || rename(s->path, seg) != 0) seg[0] = '\0';
+    }
+    /* rotamos nosotros u otra instancia se adelantó: en ambos casos, reabrir */
+    sink_reopen_same_path(s);
+
+    fl.l_type = F_UNLCK;
+    fcntl(lfd, F_SETLK, &fl);
+    close(lfd);
+    if(seg[0]) spawn_compressor(seg);
+}
+
+/* Antes de escribir: si otra instancia rotó el archivo, reabrir el nuevo */
+static void sink_prepare(LogSink *s){
+    if(g_cfg.log_max_bytes <= 0 || s->fd < 0) return;
+    struct stat st;
+    if(stat(s->path, &st) != 0 || st.st_ino != s->ino) sink_reopen_same_path(s);
+}
+
+/* Después de escribir: rotar si el archivo vivo alcanzó LOG_MAX_BYTES */
+static void sink_after_write(LogSink *s){
+    if(g_cfg.log_max_bytes <= 0 || s->fd < 0) return;
+    struct stat st;
+    if(fstat(s->fd, &st) == 0 && st.st_size >= g_cfg.log_max_bytes) sink_rotate(s);
+}
+
+static void sink_flush(LogSink *s){
+    if(s->fd < 0 || s->len == 0) return;
+    sink_prepare(s);
+    /* O_APPEND: cada write() llega completo al final aunque otras instancias escriban */
+    write_all_fd(s->fd, s->buf, s->len);
+    s->len = 0;
+    sink_after_write(s);
+}
+
+static void sink_append(LogSink *s, const char *line, size_t n){
+    if(g_cfg.log_mode == LOG_MODE_DURABLE){
+        sink_prepare(s);
+        write_all_fd(s->fd, line, n);
+        fdatasync(s->fd);
+        sink_after_write(s);
+        return;
+    }
+    if(n > sizeof(s->buf) - s->len) sink_flush(s);
+    if(n > sizeof(s->buf)){
+        sink_prepare(s);
+        write_all_fd(s->fd, line, n);   /* línea más grande que el buffer */
+        sink_after_write(s);
+        return;
+    }
+    if(s->len == 0) clock_gettime(CLOCK_MONOTONIC, &s->first);
+    memcpy(s->buf + s->len, line, n);
+    s->len += n;
+    if(elapsed_ms(&s->first) >= g_cfg.log_flush_ms) sink_flush(s);
+}
+
+/* ---------------- anillo + hilo escritor ----------------
+ * LOG_MODE=async: log_command()/log_error() sólo dan formato dentro de una celda de un
+ *   anillo sin candados del propio proceso y regresan; un hilo escritor lo vacía con writev().
+ * LOG_MODE=shared: el anillo vive en un segmento SysV compartido por todas las instancias;
+ *   todas publican en él y sólo la instancia elegida como "flusher" corre el hilo escritor,
+ *   que agrupa los registros de todos (group commit) en orden global. */
+
+typedef struct {
+    MpscCell cell;               /* secuencia del anillo (debe ir primero) */
+    uint16_t which;              /* SINK_CMD | SINK_ERR */
+    uint16_t len;
+    char     data[LOG_LINE_MAX];
+} LogCell;
+
+/* Segmento compartido del modo shared */
+#define SHM_LOG_MAGIC   0x554c4f47u   /* "ULOG" */
+#define SHM_LOG_VERSION 2             /* subir al cambiar ShmLog o LogCell */
+#define SHM_INIT_WAIT_MS 1000         /* espera máxima a que otro inicialice el segmento */
+typedef struct {
+    uint32_t         magic;
+    uint32_t         version;
+    uint64_t         size;           /* sizeof(ShmLog) de quien lo inicializó */
+    _Atomic uint64_t init;           /* (pid << 2) | estado: 0 sin inicializar, 1 inicializando, 2 listo */
+    char             log_dir[PATH_MAX];  /* LOG_DIR al que escribe el flusher */
+    _Atomic pid_t    flusher_pid;    /* instancia que escribe a disco (0 = nadie) */
+    _Atomic uint64_t overflow;       /* registros escritos directo por anillo lleno */
+    MpscRing         ring;
+    LogCell          cells[LOG_SHM_SLOTS];
+} ShmLog;
+
+#define ASYNC_BATCH 64
+#define SHM_STUCK_MS 1000           /* celda reservada y nunca publicada (productor muerto) */
+
+static MpscRing  g_ring;                         /* anillo propio (modo async) */
+static MpscRing *g_ringp = NULL;                 /* anillo que vacía el escritor */
+static void     *g_cellsp = NULL;
+static int       g_ring_shared = 0;              /* el escritor vacía el anillo compartido */
+static pthread_t g_writer;
+static int       g_async_on = 0;
+static int       g_wake_fd = -1;                 /* eventfd para despertar al escritor */
+static atomic_int        g_writer_idle = 0;      /* el escritor está (o va a estar) dormido */
+static atomic_int        g_async_stop = 0;
+static _Atomic uint64_t  g_dropped = 0;          /* registros perdidos por anillo lleno */
+static uint64_t          g_dropped_reported = 0;
+static _Atomic uint64_t  g_unwritten = 0;        /* registros sin fd o con error de escritura */
+static uint64_t          g_unwritten_reported = 0;
+
+static ShmLog   *g_shm_log = NULL;               /* segmento adjunto (modo shared) */
+static int       g_shm_log_id = -1;
+
+static void async_wake(void){
+    if(g_wake_fd >= 0 && atomic_exchange(&g_writer_idle, 0)){
+        uint64_t one = 1;
+        ssize_t r = write(g_wake_fd, &one, sizeof(one));
+        (void)r;
+    }
+}
+
+/* Escribe un lote de celdas consecutivas agrupando las que van al mismo archivo */
+static void async_write_batch(LogCell **batch, int n){
+    struct iovec iov[ASYNC_BATCH];
+    int i = 0;
+    while(i < n){
+        int which = batch[i]->which, k = 0;
+        while(i < n && batch[i]->which == which){
+            iov[k].iov_base = batch[i]->data;
+            iov[k].iov_len  = batch[i]->len;
+            k++; i++;
+        }
+        LogSink *s = &g_sinks[which];
+        if(s->fd < 0){ atomic_fetch_add(&g_unwritten, (uint64_t)k); continue; }
+        sink_prepare(s);
+        int fd = s->fd;
+        int first = 0;
+        while(first < k){
+            ssize_t w = writev(fd, iov + first, k - first);
+            if(w < 0){
+                if(errno == EINTR) continue;
+                atomic_fetch_add(&g_unwritten, (uint64_t)(k - first));
+                break;
+            }
+            /* escritura parcial: avanzar sobre los iovec ya escritos */
+            while(first < k && (size_t)w >= iov[first].iov_len){ w -= (ssize_t)iov[first].iov_len; first++; }
+            if(first < k){ iov[first].iov_base = (char*)iov[first].iov_base + w; iov[first].iov_len -= (size_t)w; }
+        }
+        sink_after_write(s);
+    }
+}
+
+static void async_report_drops(void){
+    uint64_t d = atomic_load(&g_dropped);
+    if(d != g_dropped_reported && g_sinks[SINK_ERR].fd >= 0){
+        char ts[32]; timestamp(ts, sizeof(ts));
+        dprintf(g_sinks[SINK_ERR].fd, "[%s] ERR %s :: bitácora asíncrona: %llu registros descartados (anillo lleno)\n",
+                ts, g_proc_ctx.prefix, (unsigned long long)(d - g_dropped_reported));
+        g_dropped_reported = d;
+    }
+    /* sin bitácora de errores donde avisar, el aviso va a stderr */
+    uint64_t u = atomic_load(&g_unwritten);
+    if(u != g_unwritten_reported){
+        char ts[32]; timestamp(ts, sizeof(ts));
+        dprintf(g_sinks[SINK_ERR].fd >= 0 ? g_sinks[SINK_ERR].fd : STDERR_FILENO,
+                "[%s] ERR %s :: bitácora asíncrona: %llu registros sin escribir (bitácora cerrada o error de escritura)\n",
+                ts, g_proc_ctx.prefix, (unsigned long long)(u - g_unwritten_reported));
+        g_unwritten_reported = u;
+    }
+}
+
+/*
+ * Anillo compartido: si la celda de head lleva demasiado tiempo reservada sin publicarse,
+ * su productor murió a la mitad; se abandona (CAS) para no detener a todas las instancias.
+ * Si el productor sólo iba lento, su commit por CAS fallará y escribirá directo al archivo.
+ */
+static int shm_skip_stuck(struct timespec *stuck_since){
+    if(mpsc_ring_pending(g_ringp) == 0){ stuck_since->tv_sec = 0; return 0; }
+    if(stuck_since->tv_sec == 0){ clock_gettime(CLOCK_MONOTONIC, stuck_since); return 0; }
+    if(elapsed_ms(stuck_since) < SHM_STUCK_MS) return 0;
+    stuck_since->tv_sec = 0;
+    return mpsc_ring_abandon_head(g_ringp, g_cellsp);
+}
+
+static void *async_writer(void *arg){
+    (void)arg;
+    LogCell *batch[ASYNC_BATCH];
+    struct timespec stuck_since = {0, 0};
+    for(;;){
+        int n = 0;
+        while(n < ASYNC_BATCH){
+            LogCell *c = (LogCell*)mpsc_ring_peek(g_ringp, g_cellsp, (uint64_t)n);
+            if(!c) break;
+            batch[n++] = c;
+        }
+        if(n > 0){
+            stuck_since.tv_sec = 0;
+            async_write_batch(batch, n);
+            mpsc_ring_release(g_ringp, g_cellsp, (uint64_t)n);
+            if(n < ASYNC_BATCH) async_report_drops();
+            continue;
+        }
+        if(g_ring_shared && shm_skip_stuck(&stuck_since)) continue;
+        if(atomic_load(&g_async_stop)) break;
+
+        /* nada pendiente: anunciarse dormido y volver a comprobar antes de bloquear.
+           En modo shared las otras instancias no pueden despertarnos: el timeout
+           LOG_FLUSH_MS es la ventana del group commit. */
+        atomic_store(&g_writer_idle, 1);
+        if(mpsc_ring_peek(g_ringp, g_cellsp, 0) || atomic_load(&g_async_stop)){
+            atomic_store(&g_writer_idle, 0);
+            continue;
+        }
+        struct pollfd pfd = { .fd = g_wake_fd, .events = POLLIN };
+        if(poll(&pfd, 1, g_cfg.log_flush_ms > 0 ? g_cfg.log_flush_ms : DEFAULT_LOG_FLUSH_MS) > 0){
+            uint64_t v; ssize_t r = read(g_wake_fd, &v, sizeof(v)); (void)r;
+        }
+        atomic_store(&g_writer_idle, 0);
+    }
+    async_report_drops();
+    return NULL;
+}
+
+static uint64_t ring_slots_pow2(int want){
+    uint64_t n = 16;
+    while(n < (uint64_t)want && n < LOG_RING_SLOTS_MAX) n <<= 1;
+    return n;
+}
+
+/* Arranca el hilo escritor sobre el anillo propio (cells==NULL) o sobre el compartido */
+static int async_start(MpscRing *shared_ring, void *shared_cells){
+    if(g_async_on) return 0;
+    if(shared_ring){
+        g_ringp = shared_ring; g_cellsp = shared_cells; g_ring_shared = 1;
+    } else {
+        uint64_t slots = ring_slots_pow2(g_cfg.log_ring_slots);
+        g_cellsp = calloc((size_t)slots, sizeof(LogCell));
+        if(!g_cellsp) return -1;
+        mpsc_ring_init(&g_ring, g_cellsp, slots, sizeof(LogCell));
+        g_ringp = &g_ring; g_ring_shared = 0;
+    }
+    g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(g_wake_fd < 0) goto fail;
+    atomic_store(&g_async_stop, 0);
+    if(pthread_create(&g_writer, NULL, async_writer, NULL) != 0){
+        close(g_wake_fd); g_wake_fd = -1;
+        goto fail;
+    }
+    g_async_on = 1;
+    return 0;
+fail:
+    if(!g_ring_shared) free(g_cellsp);
+    g_cellsp = NULL; g_ringp = NULL;
+    return -1;
+}
+
+/* Detiene el escritor después de vaciar todo lo ya publicado */
+static void async_stop(void){
+    if(!g_async_on) return;
+    g_async_on = 0;                       /* nuevas líneas ya no entran al anillo propio */
+    atomic_store(&g_async_stop, 1);
+    atomic_store(&g_writer_idle, 1);
+    async_wake();
+    pthread_join(g_writer, NULL);
+    close(g_wake_fd); g_wake_fd = -1;
+    if(!g_ring_shared) free(g_cellsp);
+    g_cellsp = NULL; g_ringp = NULL; g_ring_shared = 0;
+}
+
+static void async_enqueue(int which, const char *kind, const char *fmt, va_list ap){
+    uint64_t pos;
+    LogCell *c = (LogCell*)mpsc_ring_reserve(g_ringp, g_cellsp, &pos);
+    if(!c){ atomic_fetch_add(&g_dropped, 1); return; }
+    c->which = (uint16_t)which;
+    c->len = (uint16_t)format_line(c->data, sizeof(c->data), kind, fmt, ap);
+    mpsc_ring_commit(&c->cell, pos);
+    async_wake();
+}
+
+/* ---------------- anillo compartido entre instancias (LOG_MODE=shared) ---------------- */
+
+static uint64_t fnv1a(const char *s);
+
+/* Inicializa el segmento si nadie lo ha hecho, o lo retoma si quien empezó murió a
+ * medias (o no termina en SHM_INIT_WAIT_MS); regresa cuando el segmento está listo. */
+static void shm_log_init(ShmLog *h){
+    uint64_t mine = ((uint64_t)getpid() << 2) | 1;
+    uint64_t cur = atomic_load(&h->init);
+    for(int waited = 0; (cur & 3) != 2; ){
+        pid_t owner = (pid_t)(cur >> 2);
+        int stale = (cur & 3) == 1 &&
+                    ((kill(owner, 0) == -1 && errno == ESRCH) || waited >= SHM_INIT_WAIT_MS);
+        if((cur & 3) == 0 || stale){
+            if(!atomic_compare_exchange_strong(&h->init, &cur, mine)) continue;
+            h->magic = SHM_LOG_MAGIC;
+            h->version = SHM_LOG_VERSION;
+            h->size = sizeof(ShmLog);
+            snprintf(h->log_dir, sizeof(h->log_dir), "%s", g_cfg.log_dir);
+            atomic_store(&h->flusher_pid, 0);
+            atomic_store(&h->overflow, 0);
+            mpsc_ring_init(&h->ring, h->cells, LOG_SHM_SLOTS, sizeof(LogCell));
+            atomic_store(&h->init, ((uint64_t)getpid() << 2) | 2);
+            return;
+        }
+        struct timespec ts = {0, 1000000}; nanosleep(&ts, NULL);
+        waited++;
+        cur = atomic_load(&h->init);
+    }
+}
+
+/* El segmento se elige por FTOK_PATH y por LOG_DIR: instancias con otra bitácora usan
+ * otro anillo. El encabezado guarda versión y LOG_DIR para descartar colisiones. */
+static int shm_log_attach(void){
+    if(g_shm_log) return 0;
+    FILE *f = fopen(FTOK_PATH, "a"); if(f) fclose(f);
+    key_t key = ftok(FTOK_PATH, LOG_SHM_PROJ_ID);
+    if(key == (key_t)-1) return -1;
+    uint64_t dh = fnv1a(g_cfg.log_dir);
+    key = (key_t)(((uint32_t)key & 0xff000000u) | ((uint32_t)(dh ^ (dh >> 32)) & 0x00ffffffu));
+    g_shm_log_id = shmget(key, sizeof(ShmLog), IPC_CREAT | 0666);
+    if(g_shm_log_id == -1){
+        if(errno == EINVAL)
+            fprintf(stderr, "bitácora: el anillo compartido existente es de otra versión\n");
+        return -1;
+    }
+    ShmLog *h = (ShmLog*)shmat(g_shm_log_id, NULL, 0);
+    if(h == (void*)-1) return -1;
+
+    /* la primera instancia inicializa; las demás esperan a que quede listo */
+    shm_log_init(h);
+    if(h->magic != SHM_LOG_MAGIC || h->version != SHM_LOG_VERSION || h->size != sizeof(ShmLog)){
+        fprintf(stderr, "bitácora: el anillo compartido existente es de otra versión\n");
+        shmdt(h); return -1;
+    }
+    if(strcmp(h->log_dir, g_cfg.log_dir) != 0){
+        fprintf(stderr, "bitácora: el anillo compartido escribe a %s, no a %s\n", h->log_dir, g_cfg.log_dir);
+        shmdt(h); return -1;
+    }
+    g_shm_log = h;
+    return 0;
+}
+
+/* Si no hay flusher vivo, esta instancia toma el papel y arranca el escritor */
+static void shm_log_elect(void){
+    if(!g_shm_log || g_async_on) return;
+    pid_t me = getpid();
+    pid_t cur = atomic_load(&g_shm_log->flusher_pid);
+    if(cur != 0 && cur != me && !(kill(cur, 0) == -1 && errno == ESRCH)) return;
+    if(cur != me && !atomic_compare_exchange_strong(&g_shm_log->flusher_pid, &cur, me)) return;
+    if(async_start(&g_shm_log->ring, g_shm_log->cells) != 0){
+        pid_t mine = me;
+        atomic_compare_exchange_strong(&g_shm_log->flusher_pid, &mine, 0);
+    }
+}
+
+/* Suelta el papel de flusher (tras vaciar) y se desprende del segmento */
+static void shm_log_detach(void){
+    if(!g_shm_log) return;
+    shm_log_elect();          /* sin flusher vivo: vaciar nosotros lo que quede antes de salir */
+    if(g_ring_shared){
+        async_stop();
+        pid_t me = getpid();
+        atomic_compare_exchange_strong(&g_shm_log->flusher_pid, &me, 0);
+    }
+    shmdt(g_shm_log);
+    g_shm_log = NULL;
+}
+
+/* Escritura directa cuando el anillo no sirve: cuenta en overflow lo escrito y, como el
+   escritor asíncrono, en g_unwritten lo que no se pudo escribir */
+static void shm_write_direct(int which, const char *p, size_t n){
+    int fd = g_sinks[which].fd;
+    if(fd < 0 || write_all_fd(fd, p, n) != 0) atomic_fetch_add(&g_unwritten, 1);
+    else atomic_fetch_add(&g_shm_log->overflow, 1);
+}
+
+static void shm_enqueue(int which, const char *kind, const char *fmt, va_list ap){
+    uint64_t pos;
+    LogCell *c = (LogCell*)mpsc_ring_reserve(&g_shm_log->ring, g_shm_log->cells, &pos);
+    if(c){
+        c->which = (uint16_t)which;
+        c->len = (uint16_t)format_line(c->data, sizeof(c->data), kind, fmt, ap);
+        if(mpsc_ring_commit_cas(&c->cell, pos)){
+            async_wake();                      /* sólo tiene efecto si somos el flusher */
+            return;
+        }
+        /* el flusher abandonó la celda por lenta: escribir directo */
+        shm_write_direct(which, c->data, c->len);
+        return;
     }
+    /* anillo lleno (flusher caído o saturado): escribir directo para no perder el registro */
+    char line[LOG_LINE_MAX];
+    size_t n = format_line(line, sizeof(line), kind, fmt, ap);
+    shm_write_direct(which, line, n);
+    shm_log_elect();
 }
-// Función común que escribe la línea de log y cierra el archivo
 
-static void vlog_common(FILE *f, const char *kind, const char *fmt, va_list ap){
-    if(!f) return;
+/** Estado de la bitácora (modo, tamaño del anillo, pendientes, descartados y flusher). */
+void log_stats(LogStats *st){
+    if(!st) return;
+    memset(st, 0, sizeof(*st));
+    st->mode = g_cfg.log_mode;
+    if(g_shm_log){
+        st->ring_slots = LOG_SHM_SLOTS;
+        st->pending = mpsc_ring_pending(&g_shm_log->ring);
+        st->overflow = atomic_load(&g_shm_log->overflow);
+        st->flusher_pid = atomic_load(&g_shm_log->flusher_pid);
+    } else if(g_async_on){
+        st->ring_slots = g_ringp->mask + 1;
+        st->pending = mpsc_ring_pending(g_ringp);
+    }
+    st->dropped = atomic_load(&g_dropped);
+    st->unwritten = atomic_load(&g_unwritten);
+}
+
+/* ---------------- bitácora binaria (LOG_BINARY=1) ----------------
+ * Junto al texto, cada registro se guarda en <LOG_DIR>/uamashell.bin como un BinLogRecord de
+ * tamaño fijo. Las cadenas (usuario, tty, ip, comando) se internan en uamashell.bin.str y el
+ * registro guarda su id (desplazamiento + 1). uamashell.bin.idx tiene, por cubeta de
+ * BINLOG_BUCKET_SEC segundos, el desplazamiento del primer registro que cada proceso escribió
+ * en ella. Los tres archivos son O_APPEND: la posición que tocó a cada write() se obtiene con
+ * lseek(SEEK_CUR) justo después, sin candados entre instancias. */
+
+#define BINLOG_INTERN_SLOTS 256
+
+static LogSink g_bin = { .fd = -1 };
+static int     g_str_fd = -1;
+static int     g_idx_fd = -1;
+static int64_t g_last_bucket = -1;
+static struct { uint64_t hash; uint64_t id; char *s; } g_intern[BINLOG_INTERN_SLOTS];
+
+static uint64_t fnv1a(const char *s){
+    uint64_t h = 1469598103934665603ULL;
+    for(; *s; s++){ h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
+
+static int open_append(const char *dir, const char *name){
+    char p[PATH_MAX];
+    if(snprintf(p, sizeof(p), "%s/%s", dir, name) >= (int)sizeof(p)) return -1;
+    return open(p, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+}
+
+static void binlog_close(void){
+    if(g_bin.fd >= 0){ close(g_bin.fd); g_bin.fd = -1; }
+    if(g_str_fd >= 0){ close(g_str_fd); g_str_fd = -1; }
+    if(g_idx_fd >= 0){ close(g_idx_fd); g_idx_fd = -1; }
+    for(int i = 0; i < BINLOG_INTERN_SLOTS; i++){ free(g_intern[i].s); g_intern[i].s = NULL; }
+    g_bin.len = 0;
+    g_last_bucket = -1;
+}
+
+static void binlog_open(void){
+    ensure_dirs(g_cfg.log_dir);
+    g_bin.fd = open_append(g_cfg.log_dir, BINLOG_NAME);
+    g_str_fd = open_append(g_cfg.log_dir, BINLOG_NAME ".str");
+    g_idx_fd = open_append(g_cfg.log_dir, BINLOG_NAME ".idx");
+    if(g_bin.fd < 0 || g_str_fd < 0 || g_idx_fd < 0) binlog_close();
+}
+
+/* id de la cadena en .str (0 = vacía); las repetidas salen de la caché del proceso */
+static uint64_t binlog_intern(const char *s){
+    if(!s || !*s || g_str_fd < 0) return 0;
+    uint64_t h = fnv1a(s);
+    unsigned slot = (unsigned)(h % BINLOG_INTERN_SLOTS);
+    if(g_intern[slot].s && g_intern[slot].hash == h && strcmp(g_intern[slot].s, s) == 0)
+        return g_intern[slot].id;
+
+    uint32_t len = (uint32_t)strlen(s);
+    struct iovec iov[2] = { { &len, sizeof(len) }, { (void*)s, len } };
+    ssize_t w = writev(g_str_fd, iov, 2);
+    if(w != (ssize_t)(sizeof(len) + len)) return 0;
+    off_t end = lseek(g_str_fd, 0, SEEK_CUR);
+    uint64_t id = (uint64_t)(end - w) + 1;
+
+    free(g_intern[slot].s);
+    g_intern[slot].s = strdup(s);
+    g_intern[slot].hash = h;
+    g_intern[slot].id = id;
+    return id;
+}
+
+/* Escribe los registros acumulados y anota en .idx las cubetas nuevas */
+static void binlog_flush(void){
+    if(g_bin.fd < 0 || g_bin.len == 0) return;
+    size_t len = g_bin.len;
+    g_bin.len = 0;
+    if(write_all_fd(g_bin.fd, g_bin.buf, len) != 0) return;
+    off_t start = lseek(g_bin.fd, 0, SEEK_CUR) - (off_t)len;
+
+    BinLogIndexEntry idx[LOG_BUF_SIZE / sizeof(BinLogRecord)];
+    size_t ni = 0;
+    for(size_t off = 0; off + sizeof(BinLogRecord) <= len; off += sizeof(BinLogRecord)){
+        const BinLogRecord *r = (const BinLogRecord*)(g_bin.buf + off);
+        int64_t bucket = r->ts_us / 1000000 / BINLOG_BUCKET_SEC;
+        if(bucket == g_last_bucket) continue;
+        g_last_bucket = bucket;
+        idx[ni].bucket_start = bucket * BINLOG_BUCKET_SEC;
+        idx[ni].offset = (uint64_t)start + off;
+        ni++;
+    }
+    if(ni) write_all_fd(g_idx_fd, (const char*)idx, ni * sizeof(idx[0]));
+    if(g_cfg.log_mode == LOG_MODE_DURABLE) fdatasync(g_bin.fd);
+}
+
+static void binlog_append(int which, const LogMeta *meta, const char *msg){
+    if(g_bin.fd < 0) return;
+    const UserContext *c = log_context();
+    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
+    BinLogRecord r;
+    memset(&r, 0, sizeof(r));
+    r.magic = BINLOG_REC_MAGIC;
+    r.kind = (uint8_t)which;
+    r.ts_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    r.pid = getpid();
+    r.uid = getuid();
+    r.status = meta ? meta->status : -1;
+    r.duration_ms = meta && meta->duration_ms > 0 ? (uint32_t)meta->duration_ms : 0;
+    r.user = binlog_intern(c->user);
+    r.tty = binlog_intern(c->tty);
+    r.ip = binlog_intern(c->ip);
+    r.cmd = binlog_intern(meta && meta->cmd ? meta->cmd : msg);
+
+    if(sizeof(g_bin.buf) - g_bin.len < sizeof(r)) binlog_flush();
+    if(g_bin.len == 0) clock_gettime(CLOCK_MONOTONIC, &g_bin.first);
+    memcpy(g_bin.buf + g_bin.len, &r, sizeof(r));
+    g_bin.len += sizeof(r);
+    if(g_cfg.log_mode == LOG_MODE_DURABLE || elapsed_ms(&g_bin.first) >= g_cfg.log_flush_ms)
+        binlog_flush();
+}
+
+/* ---------------- API ---------------- */
+
+/**
+ * Tras cambiar g_cfg: reabre las bitácoras sólo si cambió algo que las afecta respecto a prev
+ * (LOG_FLUSH_MS y LOG_MAX_BYTES se leen de g_cfg en cada uso).
+ */
+void log_apply_config(const Config *prev){
+    if(strcmp(prev->log_dir, g_cfg.log_dir) != 0 || prev->log_mode != g_cfg.log_mode ||
+       prev->log_ring_slots != g_cfg.log_ring_slots || prev->log_binary != g_cfg.log_binary)
+        log_init();
+}
+
+/** Vacía las líneas pendientes de ambas bitácoras (con hilo escritor sólo lo despierta). */
+void log_flush(void){
+    if(g_shm_log) shm_log_elect();        /* retomar el papel si el flusher murió */
+    if(g_log_busy) return;
+    g_log_busy = 1;
+    binlog_flush();
+    if(!g_async_on){
+        sink_flush(&g_sinks[SINK_CMD]);
+        sink_flush(&g_sinks[SINK_ERR]);
+    }
+    g_log_busy = 0;
+    if(g_async_on){ atomic_store(&g_writer_idle, 1); async_wake(); }
+}
+
+/**
+ * Milisegundos que faltan para que venza LOG_FLUSH_MS de la línea más vieja en los buffers
+ * propios; -1 si no hay nada pendiente. Los bucles que esperan entrada lo usan como timeout
+ * de poll() y llaman log_flush() al vencer, para no depender de la siguiente línea.
+ */
+int log_flush_due_ms(void){
+    const LogSink *s[3] = { &g_sinks[SINK_CMD], &g_sinks[SINK_ERR], &g_bin };
+    long due = -1;
+    for(int k = 0; k < 3; k++){
+        if(s[k]->len == 0) continue;
+        long left = g_cfg.log_flush_ms - elapsed_ms(&s[k]->first);
+        if(left < 0) left = 0;
+        if(due < 0 || left < due) due = left;
+    }
+    return (int)due;
+}
+
+/** Vacía y cierra las bitácoras (terminar, salida por señal o atexit). */
+void log_shutdown(void){
+    shm_log_detach();
+    async_stop();
+    log_flush();
+    binlog_close();
+    for(int k = 0; k < 2; k++){
+        if(g_sinks[k].fd >= 0){ close(g_sinks[k].fd); g_sinks[k].fd = -1; }
+    }
+}
+
+/** Abre ambas bitácoras; se llama tras cargar la configuración (y de nuevo si cambia LOG_DIR o LOG_MODE). */
+void log_init(void){
+    char cmd_path[PATH_MAX], err_path[PATH_MAX];
+    resolve_paths(cmd_path, sizeof(cmd_path), err_path, sizeof(err_path));
+    if(!g_proc_ctx_ready) resolve_process_context();
+    shm_log_detach();                      /* el escritor no debe ver los fd mientras se reabren */
+    async_stop();
+    log_flush();
+    sink_open(&g_sinks[SINK_CMD], cmd_path);
+    sink_open(&g_sinks[SINK_ERR], err_path);
+    binlog_close();
+    if(g_cfg.log_binary) binlog_open();
+    if(g_cfg.log_mode == LOG_MODE_ASYNC && async_start(NULL, NULL) != 0)
+        fprintf(stderr, "bitácora: no se pudo iniciar el modo async, se usa buffered\n");
+    if(g_cfg.log_mode == LOG_MODE_SHARED){
+        if(shm_log_attach() == 0) shm_log_elect();
+        else fprintf(stderr, "bitácora: no se pudo adjuntar el anillo compartido, se usa buffered\n");
+    }
+    if(!g_log_atexit){ atexit(log_shutdown); g_log_atexit = 1; }
+}
+
+// Da formato a "[ts] KIND pid=.. user=.. tty=.. ip=.. :: mensaje\n"; regresa la longitud
+
+static size_t format_line(char *line, size_t size, const char *kind, const char *fmt, va_list ap){
     char ts[32]; timestamp(ts, sizeof(ts));
-    char user[64], tty[64], ip[64];
-    get_user_context(user, sizeof(user), tty, sizeof(tty), ip, sizeof(ip));
-    fprintf(f, "[%s] %s pid=%d user=%s tty=%s ip=%s :: ", ts, kind, getpid(), user, tty, ip);
-    vfprintf(f, fmt, ap);
-    fputc('\n', f);
-    fclose(f);
+    const UserContext *c = log_context();
+    size_t cap = size - 1;                   /* deja lugar para el '\n' final */
+    int off = snprintf(line, cap, "[%s] %s %s :: ", ts, kind, c->prefix);
+    if(off < 0) off = 0;
+    if((size_t)off >= cap) off = (int)cap - 1;
+    int m = vsnprintf(line + off, cap - (size_t)off, fmt, ap);
+    if(m > 0) off += ((size_t)m < cap - (size_t)off) ? m : (int)(cap - (size_t)off - 1);
+    line[off++] = '\n';
+    stat_add(&instance_stats()->log_bytes, (uint64_t)off);   /* una vez por registro, en todo modo */
+    return (size_t)off;
 }
-// Registrar comando exitoso
-void log_command(const char *fmt, ...){
+
+// Función común: en modo async va al anillo; si no, al buffer de la bitácora
+
+static void vlog_common(int which, const char *kind, const LogMeta *meta, const char *fmt, va_list ap){
+    if(g_bin.fd >= 0 && !g_log_busy){
+        char msg[LOG_LINE_MAX];
+        va_list ap2; va_copy(ap2, ap);
+        vsnprintf(msg, sizeof(msg), fmt, ap2);
+        va_end(ap2);
+        g_log_busy = 1;
+        binlog_append(which, meta, msg);
+        g_log_busy = 0;
+    }
+    if(g_shm_log){
+        shm_enqueue(which, kind, fmt, ap);
+        return;
+    }
+    if(g_async_on){
+        async_enqueue(which, kind, fmt, ap);
+        return;
+    }
+
+    char line[LOG_LINE_MAX];
+    size_t n = format_line(line, sizeof(line), kind, fmt, ap);
+
     char cmd_path[PATH_MAX], err_path[PATH_MAX];
     resolve_paths(cmd_path, sizeof(cmd_path), err_path, sizeof(err_path));
-    FILE *f = open_log(cmd_path);
+    LogSink *s = &g_sinks[which];
+
+    if(g_log_busy){
+        /* llamado desde un manejador de señal a mitad de otra escritura: directo al archivo */
+        if(s->fd >= 0) write_all_fd(s->fd, line, n);
+        return;
+    }
+    g_log_busy = 1;
+    if(sink_open(s, which == SINK_CMD ? cmd_path : err_path) == 0)
+        sink_append(s, line, n);
+    g_log_busy = 0;
+}
+// Registrar comando exitoso
+void log_command(const char *fmt, ...){
     va_list ap; va_start(ap, fmt);
-    vlog_common(f, "CMD", fmt, ap);
+    vlog_common(SINK_CMD, "CMD", NULL, fmt, ap);
+    va_end(ap);
+}
+
+/* Como log_command() pero con comando, código de salida y duración (columnas de la bitácora binaria) */
+void log_exec(const char *cmd, int status, long duration_ms, const char *fmt, ...){
+    LogMeta meta = { cmd, status, duration_ms };
+    va_list ap; va_start(ap, fmt);
+    vlog_common(SINK_CMD, "CMD", &meta, fmt, ap);
     va_end(ap);
 }
 
 void log_error(const char *fmt, ...){
-    char cmd_path[PATH_MAX], err_path[PATH_MAX];
-    resolve_paths(cmd_path, sizeof(cmd_path), err_path, sizeof(err_path));
-    FILE *f = open_log(err_path);
     va_list ap; va_start(ap, fmt);
-    vlog_common(f, "ERR", fmt, ap);
+    vlog_common(SINK_ERR, "ERR", NULL, fmt, ap);
     va_end(ap);
 }
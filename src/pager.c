@@ -10,73 +10,467 @@
  *
  * Descripción:
  *   Encapsula la llamada a /usr/bin/less (o $PAGER) para mostrar páginas de logs con paginación.
+ *   El archivo se mapea con mmap y el paginador guarda el desplazamiento de cada línea conforme
+ *   avanza, así que ir hacia atrás, al final o a cualquier página no vuelve a leer nada. El índice
+ *   se conserva entre llamadas mientras el archivo no cambie. Si una bitácora (archivo de LOG_DIR,
+ *   que sólo se anexa) creció y sus últimos bytes recorridos siguen iguales, se extiende desde
+ *   donde se quedó; cualquier otro cambio lo rehace. La búsqueda (/, n, N) usa memmem() de glibc sobre el mapeo.
+ *   Con F el paginador sigue el archivo: inotify avisa de cada escritura, el mapeo crece con
+ *   mremap() y sólo se indexan y pintan las líneas nuevas (el resto de la pantalla se desplaza).
  */
 
+#define _GNU_SOURCE            /* memmem() */
 #include "common.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 
+#define PAGER_SEARCH_WINDOW (1 << 20)   /* ventana de la búsqueda hacia atrás */
+#define PAGER_PATTERN_MAX   256
+#define PAGER_TAIL_CHECK    64          /* bytes antes de scanned que se comparan al reusar el índice */
+
+/* Índice de inicios de línea del último archivo paginado */
+typedef struct {
+    dev_t  dev;
+    ino_t  ino;
+    struct timespec mtime;
+    off_t  size;            /* tamaño al validar el índice */
+    size_t *off;            /* off[i] = inicio de la línea i */
+    size_t n, cap;
+    size_t scanned;         /* bytes ya recorridos */
+    int    complete;        /* se llegó al fin del archivo */
+    int    append_only;     /* bitácora: sólo se le anexan bytes */
+    char   tail[PAGER_TAIL_CHECK];   /* los bytes que terminan en scanned */
+    size_t tail_len;
+} LineIndex;
+
+static LineIndex g_idx;
+
+/* Archivo abierto y mapeado */
+typedef struct {
+    int         fd;
+    const char *data;
+    size_t      len;
+} PagerMap;
+
+static int index_push(LineIndex *ix, size_t o){
+    if(ix->n == ix->cap){
+        size_t cap = ix->cap ? ix->cap * 2 : 4096;
+        size_t *tmp = realloc(ix->off, cap * sizeof(*tmp));
+        if(!tmp) return -1;
+        ix->off = tmp;
+        ix->cap = cap;
+    }
+    ix->off[ix->n++] = o;
+    return 0;
+}
+
+/* Guarda los bytes que terminan en scanned para reconocer después el mismo contenido */
+static void index_note_tail(LineIndex *ix, const char *data){
+    ix->tail_len = ix->scanned < PAGER_TAIL_CHECK ? ix->scanned : PAGER_TAIL_CHECK;
+    memcpy(ix->tail, data + ix->scanned - ix->tail_len, ix->tail_len);
+}
+
+/*
+ * Reutiliza el índice si es el mismo archivo sin cambios; si es una bitácora que sólo creció
+ * (mismos bytes antes de scanned), lo deja seguir desde ahí. En cualquier otro caso lo reinicia:
+ * un archivo reescrito que además creció tendría desplazamientos de líneas que ya no existen.
+ */
+static void index_validate(LineIndex *ix, const struct stat *st, const char *data, size_t len){
+    int same = ix->n > 0 && st->st_dev == ix->dev && st->st_ino == ix->ino;
+    if(same && st->st_size == ix->size &&
+       st->st_mtim.tv_sec == ix->mtime.tv_sec && st->st_mtim.tv_nsec == ix->mtime.tv_nsec)
+        return;
+    if(same && ix->append_only && st->st_size > ix->size && ix->scanned <= len &&
+       memcmp(data + ix->scanned - ix->tail_len, ix->tail, ix->tail_len) == 0){
+        ix->complete = 0;            /* se anexaron líneas: seguir desde scanned */
+    } else {
+        ix->n = 0;
+        ix->scanned = 0;
+        ix->tail_len = 0;
+        ix->complete = 0;
+        index_push(ix, 0);
+    }
+    ix->dev = st->st_dev;
+    ix->ino = st->st_ino;
+    ix->mtime = st->st_mtim;
+    ix->size = st->st_size;
+}
+
+/* Líneas conocidas (la última entrada es el fin del archivo si termina en '\n') */
+static size_t index_lines(const LineIndex *ix){
+    if(ix->complete && ix->n > 0 && ix->off[ix->n - 1] >= ix->scanned) return ix->n - 1;
+    return ix->n;
+}
+
+/* Recorre el mapeo hasta conocer la línea want o el byte upto (SIZE_MAX = hasta el final) */
+static void index_extend(LineIndex *ix, const char *data, size_t len, size_t want, size_t upto){
+    if(ix->complete) return;
+    while(ix->n <= want || ix->scanned <= upto){
+        if(ix->scanned >= len){ ix->complete = 1; break; }
+        const char *p = memchr(data + ix->scanned, '\n', len - ix->scanned);
+        if(!p){ ix->scanned = len; ix->complete = 1; break; }
+        ix->scanned = (size_t)(p - data) + 1;
+        if(index_push(ix, ix->scanned) != 0){ ix->complete = 1; break; }
+    }
+    index_note_tail(ix, data);
+}
+
+/* Línea que contiene el byte o (el índice debe cubrirlo) */
+static size_t index_line_of(const LineIndex *ix, size_t o){
+    size_t lo = 0, hi = ix->n;
+    while(hi - lo > 1){
+        size_t mid = lo + (hi - lo) / 2;
+        if(ix->off[mid] <= o) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+/* Fin de la línea i sin el '\n' */
+static size_t line_end(const LineIndex *ix, const char *data, size_t len, size_t i){
+    size_t e = (i + 1 < ix->n) ? ix->off[i+1] : len;
+    if(e > ix->off[i] && data[e-1] == '\n') e--;
+    return e;
+}
+
+/* Última aparición de pat que empieza antes de before, o SIZE_MAX */
+static size_t search_backward(const char *data, size_t len, size_t before, const char *pat, size_t pl){
+    while(before > 0){
+        size_t from = before > PAGER_SEARCH_WINDOW ? before - PAGER_SEARCH_WINDOW : 0;
+        size_t found = SIZE_MAX;
+        /* la ventana incluye pl-1 bytes extra para no perder coincidencias en el borde */
+        size_t span = before - from + pl - 1;
+        if(from + span > len) span = len - from;
+        const char *p = data + from;
+        while((p = memmem(p, span - (size_t)(p - (data + from)), pat, pl)) != NULL){
+            if((size_t)(p - data) >= before) break;
+            found = (size_t)(p - data);
+            p++;
+        }
+        if(found != SIZE_MAX) return found;
+        before = from;
+    }
+    return SIZE_MAX;
+}
+
+/* Pinta la línea i en la fila row desde la columna hscroll; resalta pat */
+static void draw_line(const LineIndex *ix, const PagerMap *m, size_t i, int row,
+                      size_t hscroll, int cols, const char *pat){
+    size_t s = ix->off[i], e = line_end(ix, m->data, m->len, i);
+    if(s + hscroll >= e) return;
+    const char *vis = m->data + s + hscroll;
+    size_t vl = e - s - hscroll;
+    size_t pl = pat ? strlen(pat) : 0;
+    //asegura que no desborda el ancho de la terminal
+    if(cols > 0 && vl > (size_t)cols) vl = (size_t)cols;
+    mvaddnstr(row, 0, vis, (int)vl);
+    for(const char *h = vis; pl && (h = memmem(h, vl - (size_t)(h - vis), pat, pl)) != NULL; h += pl)
+        mvchgat(row, (int)(h - vis), (int)pl, A_REVERSE, 0, NULL);
+}
+
+/* Pinta las líneas [top, top+count); regresa cuántas pintó */
+static int draw_page(const LineIndex *ix, const PagerMap *m, size_t top, int count,
+                     size_t hscroll, int cols, const char *pat){
+    size_t total = index_lines(ix);
+    int printed = 0;
+    for(size_t i = top; printed < count && i < total; i++, printed++)
+        draw_line(ix, m, i, 1+printed, hscroll, cols, pat);
+    return printed;
+}
+
+static int map_open(PagerMap *m, const char *path, struct stat *st){
+    m->fd = open(path, O_RDONLY | O_CLOEXEC);
+    m->data = "";
+    m->len = 0;
+    if(m->fd < 0) return -1;
+    if(fstat(m->fd, st) != 0){ close(m->fd); m->fd = -1; return -1; }
+    if(st->st_size > 0){
+        void *d = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+        if(d == MAP_FAILED){ close(m->fd); m->fd = -1; return -1; }
+        m->data = d;
+        m->len = (size_t)st->st_size;
+    }
+    return 0;
+}
+
+static void map_close(PagerMap *m){
+    if(m->len > 0) munmap((void*)m->data, m->len);
+    if(m->fd >= 0) close(m->fd);
+    m->fd = -1;
+    m->data = "";
+    m->len = 0;
+}
+
+/* 1 si path está dentro de LOG_DIR: las bitácoras sólo crecen por O_APPEND */
+static int in_log_dir(const char *path){
+    char rp[PATH_MAX], rd[PATH_MAX];
+    if(!realpath(path, rp) || !realpath(g_cfg.log_dir, rd)) return 0;
+    size_t n = strlen(rd);
+    return strncmp(rp, rd, n) == 0 && rp[n] == '/';
+}
+
+/* Extiende el mapeo si el archivo creció; -1 si se truncó (hay que empezar de nuevo) */
+static int map_grow(PagerMap *m, struct stat *st){
+    if(fstat(m->fd, st) != 0) return -1;
+    size_t size = (size_t)st->st_size;
+    if(size < m->len) return -1;
+    if(size == m->len) return 0;
+    void *d = m->len > 0 ? mremap((void*)m->data, m->len, size, MREMAP_MAYMOVE)
+                         : mmap(NULL, size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if(d == MAP_FAILED) return -1;
+    m->data = d;
+    m->len = size;
+    return 0;
+}
+
+/* Lee una línea en la última fila de la pantalla */
+static void prompt(int row, const char *label, char *out, int n){
+    move(row, 0);
+    clrtoeol();
+    mvprintw(row, 0, "%s", label);
+    echo();
+    getnstr(out, n - 1);
+    noecho();
+}
+
+/* Encabezado del modo seguimiento */
+static void follow_header(const char *title, size_t total){
+    move(0, 0);
+    clrtoeol();
+    mvprintw(0, 0, "%s - %zu líneas - SIGUIENDO (cualquier tecla para volver)", title, total);
+}
+
+/*
+ * Modo seguimiento (F): muestra el final del archivo y, en cada aviso de inotify, extiende el
+ * mapeo e índice sólo con lo anexado. Si las líneas nuevas caben se pintan debajo; si no, la
+ * región de líneas se desplaza con scrl() y sólo se pintan las de abajo. Si el archivo rota
+ * (otro inodo con el mismo nombre) o se trunca, se vuelve a abrir. Regresa la línea superior.
+ */
+static size_t pager_follow(PagerMap *m, LineIndex *ix, const char *filepath, const char *title,
+                           size_t lpp, int cols, size_t hscroll, const char *pat,
+                           const volatile sig_atomic_t *running){
+    char dcopy[PATH_MAX], bcopy[PATH_MAX];
+    snprintf(dcopy, sizeof(dcopy), "%s", filepath);
+    snprintf(bcopy, sizeof(bcopy), "%s", filepath);
+    const char *base = basename(bcopy);
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    int fwd = ifd >= 0 ? inotify_add_watch(ifd, filepath, IN_MODIFY) : -1;
+    if(ifd >= 0) inotify_add_watch(ifd, dirname(dcopy), IN_CREATE | IN_MOVED_TO);
+
+    struct stat st;
+    size_t top = 0;
+    int full = 1;                         /* repintar toda la región */
+    setscrreg(1, (int)lpp);
+    for(;;){
+        index_extend(ix, m->data, m->len, SIZE_MAX, SIZE_MAX);
+        size_t total = index_lines(ix);
+        if(full){
+            top = total > lpp ? total - lpp : 0;
+            clear();
+            draw_page(ix, m, top, (int)lpp, hscroll, cols, pat);
+            full = 0;
+        }
+        follow_header(title, total);
+        refresh();
+        if(ifd < 0) break;
+        if(running && !*running) break;       /* SIGINT/SIGTERM */
+
+        struct pollfd pf[2] = { { ifd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+        if(poll(pf, 2, -1) < 0) continue;     /* EINTR de un aviso: seguir */
+        if(pf[1].revents){ getch(); break; }
+
+        char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n = read(ifd, ev, sizeof(ev));
+        int modified = 0, replaced = 0;
+        for(char *p = ev; n > 0 && p < ev + n; ){
+            struct inotify_event *e = (struct inotify_event*)p;
+            if(e->wd == fwd && (e->mask & IN_MODIFY)) modified = 1;
+            else if(e->len && strcmp(e->name, base) == 0) replaced = 1;
+            p += sizeof(*e) + e->len;
+        }
+        if(replaced){
+            struct stat cur;
+            if(stat(filepath, &cur) == 0 && fstat(m->fd, &st) == 0 &&
+               (cur.st_ino != st.st_ino || cur.st_dev != st.st_dev)){
+                /* rotó: seguir con el archivo nuevo */
+                PagerMap nm;
+                if(map_open(&nm, filepath, &st) == 0){
+                    map_close(m);
+                    *m = nm;
+                    inotify_rm_watch(ifd, fwd);
+                    fwd = inotify_add_watch(ifd, filepath, IN_MODIFY);
+                    index_validate(ix, &st, m->data, m->len);
+                    full = 1;
+                    continue;
+                }
+            }
+        }
+        if(!modified) continue;
+
+        /* la última línea puede haber estado incompleta: también cambia */
+        size_t old_total = total;
+        int partial = m->len > 0 && m->data[m->len - 1] != '\n';
+        if(map_grow(m, &st) != 0){
+            struct stat cur;
+            PagerMap nm;
+            if(stat(filepath, &cur) == 0 && map_open(&nm, filepath, &st) == 0){
+                map_close(m);
+                *m = nm;
+            }
+            index_validate(ix, &st, m->data, m->len);
+            full = 1;
+            continue;
+        }
+        index_validate(ix, &st, m->data, m->len);
+        index_extend(ix, m->data, m->len, SIZE_MAX, SIZE_MAX);
+        total = index_lines(ix);
+        size_t first = (partial && old_total > 0) ? old_total - 1 : old_total;
+        if(total <= first) continue;
+        if(total > top + lpp){
+            size_t shift = total - (top + lpp);
+            if(shift >= lpp){ full = 1; continue; }
+            scrollok(stdscr, TRUE);
+            scrl((int)shift);
+            scrollok(stdscr, FALSE);
+            top += shift;
+        }
+        for(size_t i = first > top ? first : top; i < total; i++){
+            int row = 1 + (int)(i - top);
+            move(row, 0);
+            clrtoeol();
+            draw_line(ix, m, i, row, hscroll, cols, pat);
+        }
+    }
+    setscrreg(0, LINES - 1);
+    if(ifd >= 0) close(ifd);
+    return top;
+}
 
 /**
  * Muestra el contenido de filepath, paginando en pantalla.
+ * Teclas: espacio/s avanza, b retrocede, g inicio, G fin, p salta a una página,
+ *         / busca, n/N siguiente/anterior coincidencia, ←/→ desplazamiento horizontal,
+ *         F sigue el archivo en vivo, q sale.
  * @param filepath Ruta al archivo de texto a mostrar.
  * @param title    Título para mostrar en el encabezado de cada página.
+ * @param running  Si no es NULL, el seguimiento (F) termina cuando una señal lo deja en 0.
  * @return 0 en éxito, -1 si falla al abrir el archivo.
  */
 
-int curses_pager(const char *filepath, const char *title){
-   //abre el archivo en modo lectura
-    FILE *f = fopen(filepath, "r");
-    if(!f){
+int curses_pager(const char *filepath, const char *title, const volatile sig_atomic_t *running){
+    //abre y mapea el archivo
+    PagerMap map;
+    struct stat st;
+    if(map_open(&map, filepath, &st) != 0){
         log_error("No se pudo abrir %s: %s", filepath, strerror(errno));
         return -1;
     }
-    // Limpiar pantalla y obtener dimensiones
+    PagerMap *m = &map;
+    LineIndex *ix = &g_idx;
+    ix->append_only = in_log_dir(filepath);
+    index_validate(ix, &st, map.data, map.len);
 
+    // Limpiar pantalla y obtener dimensiones
     clear();
     int rows, cols; getmaxyx(stdscr, rows, cols);
-    int lines_per_page = rows - 2;
-    char line[1024];
-    int line_no = 0;
-    int page = 1;
+    size_t lines_per_page = rows > 3 ? (size_t)(rows - 2) : 1;
+    size_t top = 0, hscroll = 0;
+    char pat[PAGER_PATTERN_MAX] = "";
+    size_t hit = SIZE_MAX;               /* desplazamiento de la coincidencia actual */
+    const char *status = NULL;
     int ch;
     // Bucle principal de paginación
 
     while(true){
         clear();
+        // sólo se indexa lo necesario para esta página y la siguiente
+        index_extend(ix, m->data, m->len, top + 2 * lines_per_page, 0);
+        size_t page = top / lines_per_page + 1;
         // Imprimir encabezado con título y número de página
-
-        mvprintw(0,0,"%s - Página %d (q para salir, espacio/s para avanzar, b para atrás)", title, page);
-        int printed = 0;
-       // long pos = ftell(f);
-        // Leer y mostrar hasta lines_per_page líneas
-        while(printed < lines_per_page && fgets(line, sizeof(line), f)){
-            line_no++;
-	//asegura que no desborda el ancho de la terminal
-            line[cols-1]='\0';
-            mvprintw(1+printed, 0, "%s", line);
-            printed++;
-        }
+        if(ix->complete)
+            mvprintw(0,0,"%s - Página %zu/%zu (q salir, espacio/b, g/G, p página, / n N buscar, ←→, F seguir)",
+                     title, page, (index_lines(ix) + lines_per_page - 1) / lines_per_page);
+        else
+            mvprintw(0,0,"%s - Página %zu (q salir, espacio/b, g/G, p página, / n N buscar, ←→, F seguir)",
+                     title, page);
+        int printed = draw_page(ix, m, top, (int)lines_per_page, hscroll, cols, pat[0] ? pat : NULL);
+        if(status) mvprintw(rows-1, 0, "%s", status);
+        status = NULL;
         refresh();
         // Esperar pulsación de tecla
 
         ch = getch();
         if(ch=='q' || ch=='Q' || ch==27) break;
-        if(ch=='b' || ch=='B'){
-            // retroceder una página
-            // estrategia: rebobinar al inicio y avanzar (simplifica)
-            rewind(f); line_no=0;
-            int target = (page-2)*lines_per_page;
-            if(target<0) target=0;
-            int cnt=0;
-            while(cnt<target && fgets(line, sizeof(line), f)) cnt++;
-            page = (page>1)? page-1 : 1;
+        if(ch=='b' || ch=='B' || ch==KEY_PPAGE){
+            // retroceder una página: el desplazamiento ya está en el índice
+            top = top >= lines_per_page ? top - lines_per_page : 0;
+        } else if(ch=='g' || ch==KEY_HOME){
+            top = 0;
+            hscroll = 0;
+        } else if(ch=='G' || ch==KEY_END){
+            index_extend(ix, m->data, m->len, SIZE_MAX, SIZE_MAX);
+            size_t total = index_lines(ix);
+            top = total ? (total - 1) / lines_per_page * lines_per_page : 0;
+        } else if(ch=='p' || ch=='P'){
+            char num[16] = "";
+            prompt(rows-1, "Ir a página: ", num, sizeof(num));
+            long want = strtol(num, NULL, 10);
+            if(want >= 1){
+                size_t t = (size_t)(want - 1) * lines_per_page;
+                index_extend(ix, m->data, m->len, t, 0);
+                size_t total = index_lines(ix);
+                if(t >= total) t = total ? (total - 1) / lines_per_page * lines_per_page : 0;
+                top = t;
+            }
+        } else if(ch=='F'){
+            top = pager_follow(m, ix, filepath, title, lines_per_page, cols, hscroll, pat[0] ? pat : NULL,
+                               running);
+            hit = SIZE_MAX;
+        } else if(ch==KEY_RIGHT || ch=='l'){
+            hscroll += (size_t)(cols > 1 ? cols / 2 : 1);
+        } else if(ch==KEY_LEFT || ch=='h'){
+            size_t step = (size_t)(cols > 1 ? cols / 2 : 1);
+            hscroll = hscroll > step ? hscroll - step : 0;
+        } else if(ch=='/' || ch=='n' || ch=='N'){
+            if(ch=='/'){
+                char tmp[PAGER_PATTERN_MAX] = "";
+                prompt(rows-1, "/", tmp, sizeof(tmp));
+                if(tmp[0]){ strcpy(pat, tmp); hit = SIZE_MAX; }
+            }
+            if(!pat[0]) continue;
+            size_t pl = strlen(pat);
+            size_t found;
+            if(ch=='N'){
+                size_t before = hit != SIZE_MAX ? hit : ix->off[top < index_lines(ix) ? top : 0];
+                found = search_backward(m->data, m->len, before, pat, pl);
+            } else {
+                /* desde la coincidencia actual o, si no hay, desde la línea superior */
+                size_t from = hit != SIZE_MAX ? hit + 1 : (top < ix->n ? ix->off[top] : 0);
+                const char *p = from < m->len ? memmem(m->data + from, m->len - from, pat, pl) : NULL;
+                found = p ? (size_t)(p - m->data) : SIZE_MAX;
+            }
+            if(found == SIZE_MAX){
+                status = "Patrón no encontrado";
+                continue;
+            }
+            hit = found;
+            index_extend(ix, m->data, m->len, 0, hit);
+            size_t line = index_line_of(ix, hit);
+            // la coincidencia queda en la primera línea visible y dentro de la pantalla
+            top = line;
+            size_t col = hit - ix->off[line];
+            if(col < hscroll || col + pl > hscroll + (size_t)cols)
+                hscroll = col > (size_t)cols / 4 ? col - (size_t)cols / 4 : 0;
         } else {
-            if(printed < lines_per_page){
+            if((size_t)printed < lines_per_page){
                 // fin de archivo
                 break;
             }
-            page++;
+            top += lines_per_page;
         }
     }
-    fclose(f);
+    map_close(&map);
     return 0;
 }
@@ -0,0 +1,243 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *   - Enrique Hernández Mauricio — 2223030397
+ *   - Garrido Velázquez Iván — 2203025425
+ *   - Loaeza Sánchez Wendy Maritza — 2193042056
+ *   - Robles Pérez Luis Fernando — 2203031441
+ *
+ * Descripción:
+ *   Tuberías y redirecciones sin /bin/sh. pipeline_parse() convierte una línea como
+ *   "grep x < a.txt 2>&1 | sort >> b.txt" en etapas (argv + redirecciones); pipeline_run() abre
+ *   los archivos en el padre, une las etapas con pipe2(O_CLOEXEC) y las lanza con spawn_argv(),
+ *   así que no hay un sh de por medio y run_external() conoce cada archivo redirigido para
+ *   tomar su lock. Sólo se entiende un subconjunto: palabras con comillas simples o dobles
+ *   (sin $ ni ` dentro) y barra invertida, '|', [n]<, [n]>, [n]>> y [n]>&m. Cualquier otra
+ *   sintaxis (;, &, &&, $, comodines, subshells, VAR=x...), o una etapa que es un interno de sh
+ *   (set, type, export...), se deja a /bin/sh -c.
+ */
+
+#define _GNU_SOURCE            /* pipe2() */
+#include "common.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/* Caracteres fuera de comillas que obligan a usar /bin/sh */
+#define PIPE_SHELL_ONLY ";&()$`*?[]{}~#\n"
+
+/* Internos de sh sin programa en PATH (set, type, export...): una etapa con uno va a /bin/sh */
+static bool sh_only(const char *name){
+    static const char *const names[] = {
+        ".", ":", "alias", "bg", "break", "cd", "command", "continue", "eval", "exec", "exit",
+        "export", "fg", "getopts", "hash", "jobs", "local", "read", "readonly", "return", "set",
+        "shift", "source", "times", "trap", "type", "ulimit", "umask", "unalias", "unset", "wait",
+    };
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if(strcmp(name, names[i]) == 0) return true;
+    return false;
+}
+
+/* Agrega c a la palabra en curso; 0 si ya no cabe */
+static int put(Pipeline *pl, size_t *used, char c){
+    if(*used + 1 >= sizeof(pl->buf)) return 0;
+    pl->buf[(*used)++] = c;
+    return 1;
+}
+
+/*
+ * Lee una palabra desde *pp hasta un blanco, '|', '<', '>' o el fin, quitando comillas.
+ * @return 1 leída (*word en pl->buf; *plain = sin comillas ni escapes; *eq = '=' sin comillas),
+ *         0 si usa sintaxis que no se entiende aquí o no cabe.
+ */
+static int read_word(Pipeline *pl, const char **pp, size_t *used, char **word, bool *plain, bool *eq){
+    const char *p = *pp;
+    *word = pl->buf + *used;
+    *plain = true;
+    *eq = false;
+    while(*p && !strchr(" \t|<>", *p)){
+        if(*p == '\''){
+            const char *end = strchr(p + 1, '\'');
+            if(!end) return 0;
+            for(p++; p < end; p++) if(!put(pl, used, *p)) return 0;
+            p++;
+            *plain = false;
+        } else if(*p == '"'){
+            for(p++; *p && *p != '"'; p++){
+                if(*p == '$' || *p == '`' || *p == '\\') return 0;
+                if(!put(pl, used, *p)) return 0;
+            }
+            if(*p != '"') return 0;
+            p++;
+            *plain = false;
+        } else if(*p == '\\'){
+            if(!p[1]) return 0;
+            if(!put(pl, used, p[1])) return 0;
+            p += 2;
+            *plain = false;
+        } else {
+            if(strchr(PIPE_SHELL_ONLY, *p)) return 0;
+            if(*p == '=') *eq = true;
+            if(!put(pl, used, *p++)) return 0;
+        }
+    }
+    if(!put(pl, used, '\0')) return 0;
+    *pp = p;
+    return 1;
+}
+
+/**
+ * Interpreta cmd como tubería de comandos simples con redirecciones.
+ * @return 0 si quedó en pl, 1 si hace falta /bin/sh (sintaxis no soportada o con errores:
+ *         sh la ejecuta o la reporta como siempre).
+ */
+int pipeline_parse(const char *cmd, Pipeline *pl){
+    size_t used = 0;
+    int nwords = 0;
+    pl->nstages = 1;
+    PipeStage *st = &pl->st[0];
+    memset(st, 0, sizeof(*st));
+    st->argv = pl->words;
+
+    const char *p = cmd;
+    for(;;){
+        while(*p == ' ' || *p == '\t') p++;
+        if(!*p || *p == '|'){
+            if(st->argc == 0) return 1;                 /* etapa vacía: "| x", "x |", "x || y" */
+            if(sh_only(st->argv[0])) return 1;
+            if(nwords + 1 > PIPE_WORDS_MAX) return 1;
+            pl->words[nwords++] = NULL;
+            if(!*p) return 0;
+            if(p[1] == '|' || pl->nstages == PIPE_STAGES_MAX) return 1;
+            p++;
+            st = &pl->st[pl->nstages++];
+            memset(st, 0, sizeof(*st));
+            st->argv = pl->words + nwords;
+            continue;
+        }
+
+        int fd = -1;
+        char *w = NULL;
+        bool plain = true, eq = false;
+        if(*p != '<' && *p != '>'){
+            if(!read_word(pl, &p, &used, &w, &plain, &eq)) return 1;
+            /* "2>archivo": una palabra de sólo dígitos pegada a < o > es el descriptor */
+            if(plain && (*p == '<' || *p == '>') && w[0] && strspn(w, "0123456789") == strlen(w)){
+                fd = atoi(w);
+                used = (size_t)(w - pl->buf);
+            } else {
+                if(st->argc == 0 && eq) return 1;     /* VAR=x cmd */
+                if(nwords + 2 > PIPE_WORDS_MAX) return 1;
+                pl->words[nwords++] = w;
+                st->argc++;
+                continue;
+            }
+        }
+
+        /* redirección */
+        if(st->nredir == PIPE_REDIRS_MAX) return 1;
+        Redirect *r = &st->redir[st->nredir];
+        if(*p == '<'){
+            if(p[1] == '<' || p[1] == '&' || p[1] == '>') return 1;   /* heredoc, <&, <> */
+            r->kind = REDIR_IN; r->fd = fd < 0 ? 0 : fd; p++;
+        } else if(p[1] == '>'){
+            r->kind = REDIR_APPEND; r->fd = fd < 0 ? 1 : fd; p += 2;
+        } else if(p[1] == '&'){
+            p += 2;
+            size_t n = strspn(p, "0123456789");
+            if(n == 0 || (p[n] && !strchr(" \t|", p[n]))) return 1;   /* >&archivo, >&- */
+            r->kind = REDIR_DUP; r->fd = fd < 0 ? 1 : fd; r->dup_from = atoi(p);
+            r->path = NULL;
+            p += n;
+            st->nredir++;
+            continue;
+        } else {
+            if(p[1] == '|') return 1;
+            r->kind = REDIR_OUT; r->fd = fd < 0 ? 1 : fd; p++;
+        }
+        while(*p == ' ' || *p == '\t') p++;
+        if(!*p || strchr("|<>", *p)) return 1;          /* falta el archivo */
+        if(!read_word(pl, &p, &used, &w, &plain, &eq) || !w[0]) return 1;
+        r->path = w;
+        st->nredir++;
+    }
+}
+
+/* Abre el archivo de una redirección (en el padre, para reportar el error como sh) */
+static int open_redirect(const Redirect *r){
+    int flags = r->kind == REDIR_IN     ? O_RDONLY :
+                r->kind == REDIR_APPEND ? O_WRONLY | O_CREAT | O_APPEND :
+                                          O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(r->path, flags | O_CLOEXEC, 0666);
+    if(fd < 0) fprintf(stderr, "uamashell: %s: %s\n", r->path, strerror(errno));
+    return fd;
+}
+
+/**
+ * Ejecuta pl: cada etapa lee de la anterior y escribe en la siguiente por pipe2(O_CLOEXEC),
+ * luego se aplican sus redirecciones en orden (así "2>&1 |" manda ambas salidas al pipe).
+ * Una etapa cuyo archivo no abre o cuyo programa no existe no se lanza (código 1 o 127/126),
+ * pero el resto sí, como en sh.
+ * @return estado estilo waitpid() de la última etapa.
+ */
+int pipeline_run(const Pipeline *pl){
+    pid_t pids[PIPE_STAGES_MAX];
+    int codes[PIPE_STAGES_MAX];
+    int in_fd = -1;
+    for(int i = 0; i < pl->nstages; i++){ pids[i] = -1; codes[i] = 1; }   /* 1: no se llegó a lanzar */
+
+    for(int i = 0; i < pl->nstages; i++){
+        const PipeStage *st = &pl->st[i];
+        int pfd[2] = { -1, -1 }, opened[PIPE_REDIRS_MAX], nopened = 0;
+        posix_spawn_file_actions_t fa;
+        codes[i] = 0;
+        posix_spawn_file_actions_init(&fa);
+
+        if(in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+        if(i < pl->nstages - 1){
+            if(pipe2(pfd, O_CLOEXEC) != 0){
+                fprintf(stderr, "uamashell: pipe: %s\n", strerror(errno));
+                codes[i] = 1;
+            } else {
+                posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+            }
+        }
+        for(int k = 0; k < st->nredir && codes[i] == 0; k++){
+            const Redirect *r = &st->redir[k];
+            if(r->kind == REDIR_DUP){
+                if(r->dup_from != r->fd) posix_spawn_file_actions_adddup2(&fa, r->dup_from, r->fd);
+                continue;
+            }
+            int fd = open_redirect(r);
+            if(fd < 0){ codes[i] = 1; break; }
+            opened[nopened++] = fd;
+            posix_spawn_file_actions_adddup2(&fa, fd, r->fd);
+        }
+
+        if(codes[i] == 0){
+            int e = spawn_argv(&pids[i], st->argv, &fa);
+            if(e != 0){
+                fprintf(stderr, "uamashell: %s: %s\n", st->argv[0], strerror(e));
+                codes[i] = (e == ENOENT) ? 127 : 126;
+                pids[i] = -1;
+            }
+        }
+        posix_spawn_file_actions_destroy(&fa);
+
+        /* el padre no se queda con extremos que mantendrían abierta la tubería */
+        for(int k = 0; k < nopened; k++) close(opened[k]);
+        if(in_fd >= 0) close(in_fd);
+        if(pfd[1] >= 0) close(pfd[1]);
+        in_fd = pfd[0];
+        if(i < pl->nstages - 1 && pfd[0] < 0) break;   /* sin pipe no hay siguiente etapa */
+    }
+    if(in_fd >= 0) close(in_fd);
+
+    int status = 0;
+    for(int i = 0; i < pl->nstages; i++){
+        int st = codes[i] << 8;
+        if(pids[i] > 0) while(waitpid(pids[i], &st, 0) < 0 && errno == EINTR) ;
+        status = st;
+    }
+    return status;
+}
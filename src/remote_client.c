@@ -3,12 +3,14 @@
  * Módulo: remote_client.c — Cliente para ejecución remota (Versión III)
  * Protocolo textual simple:
  *   Cliente -> Servidor:
- *       HELLO user=<u> pid=<p> tty=<t> ip=<i>\n
+ *       HELLO user=<u> pid=<p> tty=<t> ip=<i> proto=<v>\n
  *       CMD <n>\n<bytes...>
  *       QUIT\n
  *   Servidor -> Cliente:
- *       OK\n | ERR NOT_ALLOWED\n
- *       OUT <m>\n<bytes...>\nSTATUS <code>\n
+ *       OK proto=<v>\n | OK\n | ERR NOT_ALLOWED\n
+ *       OUT <m>\n<bytes...>   (proto 2: cero o más bloques, según el comando va escribiendo;
+ *                              "OK" sin proto: exactamente uno)
+ *       \nSTATUS <code>\n
  */
 
 #include "common.h"
@@ -122,15 +124,17 @@ int remote_connect(const char *ip, int port){
     else strcpy(lip, "0.0.0.0");
 
     char hello[256];
-    snprintf(hello, sizeof(hello), "HELLO user=%s pid=%d tty=%s ip=%s\n",
-             user, (int)getpid(), tty, lip);
+    snprintf(hello, sizeof(hello), "HELLO user=%s pid=%d tty=%s ip=%s proto=%d\n",
+             user, (int)getpid(), tty, lip, REMOTE_PROTO);
 
     if(write_all(fd, hello, strlen(hello)) < 0){ close(fd); return -1; }
 
     char line[256];
     int rl = read_line(fd, line, sizeof(line));
     if(rl <= 0){ close(fd); return -1; }
-    if(strcmp(line, "OK") != 0){ close(fd); errno = EACCES; return -1; }
+    /* un servidor anterior contesta "OK" a secas: manda un solo OUT, que el ciclo
+       de remote_send_line también lee */
+    if(strcmp(line, "OK") != 0 && strncmp(line, "OK proto=", 9) != 0){ close(fd); errno = EACCES; return -1; }
 
     /* listo */
     g_remote_fd = fd;
@@ -150,34 +154,29 @@ int remote_send_line(const char *line, FILE *out)
     if(write_all(g_remote_fd, hdr, (size_t)hm) < 0) return -1;
     if(n && write_all(g_remote_fd, line, n) < 0) return -1;
 
-    /* 2) leer "OUT <m>\n" */
+    /* 2) bloques "OUT <m>\n<bytes>" hasta "STATUS <code>\n".
+       Nota: el servidor manda un salto de línea antes de STATUS. */
     char l1[64];
-    if(read_line(g_remote_fd, l1, sizeof(l1)) <= 0) return -1;
-
-    size_t mlen = 0;
-    if(sscanf(l1, "OUT %zu", &mlen) != 1){ errno = EPROTO; return -1; }
-
-    /* 3) leer <m> bytes de salida y pasarlos a 'out' */
-    if(mlen > 0){
-        char *buf = (char*)malloc(mlen + 1);
-        if(!buf){ errno = ENOMEM; return -1; }
-        if(read_exact(g_remote_fd, buf, mlen) <= 0){ free(buf); return -1; }
-        buf[mlen] = '\0';
-        if(out) fwrite(buf, 1, mlen, out);
-        free(buf);
-    }
-
-    /* 4) leer "STATUS <code>\n".
-       Nota: algunos servidores envían un salto de línea entre OUT y STATUS. */
-    char l2[64];
-    if(read_line(g_remote_fd, l2, sizeof(l2)) <= 0) return -1;
-    if(l2[0] == '\0'){                  /* línea en blanco opcional */
-        if(read_line(g_remote_fd, l2, sizeof(l2)) <= 0) return -1;
+    for(;;){
+        if(read_line(g_remote_fd, l1, sizeof(l1)) <= 0) return -1;
+        if(l1[0] == '\0') continue;      /* línea en blanco opcional */
+
+        int status = 0;
+        if(sscanf(l1, "STATUS %d", &status) == 1) return status;
+
+        size_t mlen = 0;
+        if(sscanf(l1, "OUT %zu", &mlen) != 1){ errno = EPROTO; return -1; }
+
+        /* 3) leer <m> bytes de salida y pasarlos a 'out' */
+        if(mlen > 0){
+            char *buf = (char*)malloc(mlen + 1);
+            if(!buf){ errno = ENOMEM; return -1; }
+            if(read_exact(g_remote_fd, buf, mlen) <= 0){ free(buf); return -1; }
+            buf[mlen] = '\0';
+            if(out) fwrite(buf, 1, mlen, out);
+            free(buf);
+        }
     }
-
-    int status = 0;
-    if(sscanf(l2, "STATUS %d", &status) != 1){ errno = EPROTO; return -1; }
-    return status;
 }
 
 void remote_disconnect(void){
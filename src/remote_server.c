@@ -11,18 +11,24 @@
 *  - Robles Pérez Luis Fernando – 2203031441 
 	
 *Grito de batalla: "¡Kernel Force, control total, sistema listo para el rival!"*/
+#define _GNU_SOURCE            /* pipe2() */
 #include "common.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #ifndef MAX_IP_STR
 #define MAX_IP_STR 64
@@ -41,28 +47,203 @@ static void on_sigint(int s){
 
 /* --- helpers parse/IO --- */
 
-static int ip_in_allowed(const char *ip)
-{
-    /* REMOTE_ALLOWED: CSV de IPs exactas (simplificado) */
-    if(!g_cfg.remote_allowed[0]) return 0; /* nadie permitido */
-    char work[1024]; strncpy(work, g_cfg.remote_allowed, sizeof(work)-1); work[sizeof(work)-1]='\0';
-    char *tok = strtok(work, ",");
-    while(tok){
-        while(*tok==' '||*tok=='\t') ++tok;
-        const char *end = tok + strlen(tok);
-        while(end>tok && (end[-1]==' '||end[-1]=='\t'||end[-1]=='\n'||end[-1]=='\r')) --end;
-        char saved = *end; *((char*)end) = '\0';
-        if(strcmp(tok, ip)==0){ *((char*)end)=saved; return 1; }
-        *((char*)end)=saved;
-        tok = strtok(NULL, ",");
+/*
+ * Lista de acceso compilada a partir de REMOTE_ALLOWED (CSV de IPs o rangos CIDR).
+ * Todas las direcciones se guardan como 16 bytes: IPv4 va como ::ffff:a.b.c.d, así
+ * una sola estructura sirve para ambas familias (y para clientes IPv4 en un socket IPv6).
+ *   - IPs exactas: conjunto hash de direcciones abierto (sondeo lineal).
+ *   - Rangos: trie binario por bits; un nodo marcado cubre todo su subárbol.
+ * Se recompila sólo cuando cambia la generación de la config.
+ */
+typedef struct { uint8_t a[16]; } IpAddr;
+
+typedef struct {
+    uint32_t child[2];        /* índice en nodes; 0 = sin hijo (la raíz es 0) */
+    uint8_t  term;            /* el prefijo hasta este nodo está permitido */
+} TrieNode;
+
+typedef struct {
+    IpAddr   *set;            /* capacidad set_mask+1, potencia de 2 */
+    uint8_t  *used;
+    size_t    set_mask, set_count;
+    TrieNode *nodes;          /* nodes[0] = raíz */
+    size_t    nnodes, nodes_cap;
+    unsigned long generation; /* generación de config compilada (0 = nunca) */
+} AllowList;
+
+static AllowList g_allow;
+
+static uint64_t ip_hash(const IpAddr *ip){
+    uint64_t h = 1469598103934665603ULL;       /* FNV-1a */
+    for(int i=0;i<16;i++){ h ^= ip->a[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static int set_contains(const AllowList *al, const IpAddr *ip){
+    if(!al->set) return 0;
+    for(size_t i = ip_hash(ip) & al->set_mask; al->used[i]; i = (i+1) & al->set_mask)
+        if(memcmp(al->set[i].a, ip->a, 16)==0) return 1;
+    return 0;
+}
+
+static void set_insert(AllowList *al, const IpAddr *ip){
+    if(set_contains(al, ip)) return;
+    size_t i = ip_hash(ip) & al->set_mask;
+    while(al->used[i]) i = (i+1) & al->set_mask;
+    al->set[i] = *ip; al->used[i] = 1; al->set_count++;
+}
+
+static int trie_insert(AllowList *al, const IpAddr *ip, int bits){
+    uint32_t n = 0;
+    for(int b=0; b<bits; b++){
+        if(al->nodes[n].term) return 0;        /* ya cubierto por un prefijo más corto */
+        int bit = (ip->a[b>>3] >> (7-(b&7))) & 1;
+        if(!al->nodes[n].child[bit]){
+            if(al->nnodes == al->nodes_cap){
+                size_t cap = al->nodes_cap ? al->nodes_cap*2 : 64;
+                TrieNode *tmp = realloc(al->nodes, cap*sizeof(*tmp));
+                if(!tmp) return -1;
+                al->nodes = tmp; al->nodes_cap = cap;
+            }
+            memset(&al->nodes[al->nnodes], 0, sizeof(TrieNode));
+            al->nodes[n].child[bit] = (uint32_t)al->nnodes++;
+        }
+        n = al->nodes[n].child[bit];
     }
+    al->nodes[n].term = 1;
+    al->nodes[n].child[0] = al->nodes[n].child[1] = 0;   /* lo de abajo ya no hace falta */
     return 0;
 }
 
+static int trie_match(const AllowList *al, const IpAddr *ip){
+    if(!al->nnodes) return 0;
+    uint32_t n = 0;
+    for(int b=0; b<128; b++){
+        if(al->nodes[n].term) return 1;
+        n = al->nodes[n].child[(ip->a[b>>3] >> (7-(b&7))) & 1];
+        if(!n) return 0;
+    }
+    return al->nodes[n].term;
+}
+
+/* "a.b.c.d", "a.b.c.d/n", "x::y" o "x::y/n" -> dirección normalizada y bits de prefijo */
+static int parse_allow_entry(const char *tok, IpAddr *ip, int *bits){
+    char host[INET6_ADDRSTRLEN];
+    const char *slash = strchr(tok, '/');
+    size_t hl = slash ? (size_t)(slash-tok) : strlen(tok);
+    if(hl==0 || hl>=sizeof(host)) return -1;
+    memcpy(host, tok, hl); host[hl]='\0';
+
+    int maxbits, off;
+    memset(ip, 0, sizeof(*ip));
+    if(inet_pton(AF_INET, host, ip->a+12)==1){
+        ip->a[10] = ip->a[11] = 0xff; maxbits = 32; off = 96;
+    } else if(inet_pton(AF_INET6, host, ip->a)==1){
+        maxbits = 128; off = 0;
+    } else return -1;
+
+    int n = maxbits;
+    if(slash){
+        char *end; long v = strtol(slash+1, &end, 10);
+        if(end==slash+1 || *end || v<0 || v>maxbits) return -1;
+        n = (int)v;
+    }
+    *bits = off + n;
+    for(int b=*bits; b<128; b++) ip->a[b>>3] &= (uint8_t)~(0x80 >> (b&7));  /* limpiar bits de host */
+    return 0;
+}
+
+static void allow_free(AllowList *al){
+    free(al->set); free(al->used); free(al->nodes);
+    memset(al, 0, sizeof(*al));
+}
+
+/* Compila el CSV en al (vacía); regresa cuántos rangos entraron al trie, -1 sin memoria */
+static long allow_build(AllowList *al, const char *s){
+    size_t entries = 1;
+    for(const char *p=s; *p; p++) if(*p==',') entries++;
+    size_t cap = 16;
+    while(cap < entries*2) cap <<= 1;          /* carga <= 1/2 */
+    al->set = calloc(cap, sizeof(IpAddr));
+    al->used = calloc(cap, 1);
+    al->nodes = calloc(64, sizeof(TrieNode));
+    if(!al->set || !al->used || !al->nodes){
+        allow_free(al);
+        return -1;
+    }
+    al->set_mask = cap-1; al->nodes_cap = 64; al->nnodes = 1;
+
+    size_t ranges = 0;
+    while(*s){
+        while(*s==' '||*s=='\t'||*s==',') s++;
+        const char *e = s;
+        while(*e && *e!=',') e++;
+        const char *t = e;
+        while(t>s && (t[-1]==' '||t[-1]=='\t'||t[-1]=='\n'||t[-1]=='\r')) t--;
+        if(t>s){
+            char tok[128]; IpAddr ip; int bits;
+            size_t tl = (size_t)(t-s) < sizeof(tok)-1 ? (size_t)(t-s) : sizeof(tok)-1;
+            memcpy(tok, s, tl); tok[tl]='\0';
+            if(parse_allow_entry(tok, &ip, &bits)!=0)
+                log_error("REMOTO: entrada inválida en REMOTE_ALLOWED ignorada: '%s'", tok);
+            else if(bits==128)
+                set_insert(al, &ip);
+            else if(trie_insert(al, &ip, bits)==0)
+                ranges++;
+        }
+        s = e;
+    }
+    return (long)ranges;
+}
+
+/* Recompila si la config cambió de generación; una lista vacía no admite a nadie */
+static void allow_compile(AllowList *al){
+    unsigned long gen = config_generation();
+    if(al->generation == gen && al->generation != 0) return;
+    allow_free(al);
+    long ranges = allow_build(al, g_cfg.remote_allowed);
+    al->generation = gen;
+    if(ranges < 0){
+        log_error("REMOTO: sin memoria para compilar REMOTE_ALLOWED");
+        return;
+    }
+    log_command("REMOTO: lista de acceso compilada (gen %lu): %zu IPs, %ld rangos",
+                gen, al->set_count, ranges);
+}
+
+/**
+ * ¿Admite la lista csv (formato de REMOTE_ALLOWED) a la IP ip en texto? Compila una lista
+ * aparte, sin tocar la del servidor. IPv4 se compara como ::ffff:a.b.c.d, igual que en accept().
+ * @return 1 admitida, 0 no admitida, -1 si ip no es una dirección válida o falta memoria.
+ */
+int remote_allow_check(const char *csv, const char *ip){
+    IpAddr addr; int bits;
+    if(!ip || strchr(ip, '/') || parse_allow_entry(ip, &addr, &bits) != 0) return -1;
+    AllowList al;
+    memset(&al, 0, sizeof(al));
+    if(allow_build(&al, csv ? csv : "") < 0) return -1;
+    int ok = set_contains(&al, &addr) || trie_match(&al, &addr);
+    allow_free(&al);
+    return ok;
+}
+
+/* Búsqueda directa sobre la dirección binaria del cliente, sin pasar por texto */
+static int allow_match(const AllowList *al, const struct sockaddr_storage *ss){
+    IpAddr ip;
+    memset(&ip, 0, sizeof(ip));
+    if(ss->ss_family==AF_INET){
+        ip.a[10] = ip.a[11] = 0xff;
+        memcpy(ip.a+12, &((const struct sockaddr_in*)ss)->sin_addr, 4);
+    } else if(ss->ss_family==AF_INET6){
+        memcpy(ip.a, &((const struct sockaddr_in6*)ss)->sin6_addr, 16);
+    } else return 0;
+    return set_contains(al, &ip) || trie_match(al, &ip);
+}
+
 static ssize_t write_all(int fd, const void *buf, size_t n){
     const char *p = (const char*)buf; size_t left = n;
     while(left){
-        ssize_t w = send(fd, p, left, 0);
+        ssize_t w = send(fd, p, left, MSG_NOSIGNAL);   /* cliente caído: error, no SIGPIPE */
         if(w<0){ if(errno==EINTR) continue; return -1; }
         p += w; left -= (size_t)w;
     }
@@ -93,6 +274,18 @@ static int read_line(int fd, char *out, size_t max){
 }
 
 
+/* Espera a que fd tenga datos; mientras tanto vacía las bitácoras cuando vence LOG_FLUSH_MS */
+static int wait_readable(int fd){
+    for(;;){
+        struct pollfd pf = { fd, POLLIN, 0 };
+        int r = poll(&pf, 1, log_flush_due_ms());
+        if(r > 0) return 0;
+        if(r == 0){ log_flush(); continue; }
+        if(errno != EINTR) return -1;
+        if(srv_fd < 0) return -1;          /* SIGINT/SIGTERM: cerrando el servidor */
+    }
+}
+
 static int read_exact(int fd, void *buf, size_t n){
     char *p = (char*)buf;
     size_t got = 0;
@@ -110,16 +303,63 @@ static int read_exact(int fd, void *buf, size_t n){
     return 1;
 }
 
-extern int shell_execute_line(const char *line, FILE *out);
+/*
+ * Relevo de la salida de un comando a la sesión: mientras corre (internos en este proceso,
+ * externos como hijos), un hilo lee la tubería, así que nunca se llena por más salida que
+ * tenga el comando. Con un cliente de protocolo 2 cada bloque sale en cuanto llega como
+ * "OUT <m>\n<bytes>"; con uno anterior se junta en memoria y se manda un único OUT al final,
+ * que es lo único que ese cliente entiende. Si el cliente se cae se sigue leyendo (y
+ * descartando) para que el comando no se quede bloqueado.
+ */
+typedef struct {
+    int rfd;                  /* extremo de lectura de la tubería */
+    int cfd;                  /* socket de la sesión */
+    bool stream;              /* protocolo 2: varios OUT por comando */
+    char *acc;                /* protocolo 1: salida acumulada */
+    size_t len, cap;
+} OutRelay;
+
+static bool send_out(int cfd, const char *p, size_t n){
+    char hdr[64]; int hm = snprintf(hdr, sizeof(hdr), "OUT %zu\n", n);
+    return write_all(cfd, hdr, (size_t)hm) >= 0 && (n == 0 || write_all(cfd, p, n) >= 0);
+}
+
+static void *out_relay(void *arg){
+    OutRelay *r = arg;
+    static char blk[PLAIN_OUT_BUF];
+    bool ok = true;
+    ssize_t n;
+    while((n = read(r->rfd, blk, sizeof blk)) != 0){
+        if(n < 0){ if(errno == EINTR) continue; break; }
+        if(!ok) continue;
+        if(r->stream){ ok = send_out(r->cfd, blk, (size_t)n); continue; }
+        if(r->len + (size_t)n > r->cap){
+            size_t cap = r->cap ? r->cap : PLAIN_OUT_BUF;
+            while(cap < r->len + (size_t)n) cap *= 2;
+            char *p = realloc(r->acc, cap);
+            if(!p){ log_error("REMOTO: sin memoria para %zu bytes de salida", cap); ok = false; continue; }
+            r->acc = p; r->cap = cap;
+        }
+        memcpy(r->acc + r->len, blk, (size_t)n);
+        r->len += (size_t)n;
+    }
+    return NULL;
+}
+
+/* Versión de protocolo que pide el HELLO ("proto=<n>"); sin ella, 1 */
+static int hello_proto(const char *hello){
+    const char *p = strstr(hello, " proto=");
+    return p ? atoi(p + 7) : 1;
+}
 
-static void handle_client(int cfd, const char *peer_ip)
+static void handle_client(int cfd, const struct sockaddr_storage *peer, const char *peer_ip)
 {
     char line[256];
 
     /* HELLO */
     if(read_line(cfd, line, sizeof(line))<=0){ close(cfd); return; }
     if(strncmp(line, "HELLO ", 6)!=0){ close(cfd); return; }
-    if(!ip_in_allowed(peer_ip)){
+    if(!allow_match(&g_allow, peer)){
         log_error("REMOTO: intento NO AUTORIZADO desde ip=%s ; hello=%s", peer_ip, line);
         printf("[server] NO AUTORIZADO: %s\n", peer_ip); fflush(stdout);
 
@@ -130,11 +370,23 @@ static void handle_client(int cfd, const char *peer_ip)
         printf("[server] Conexion de %s\n", peer_ip); fflush(stdout);
     }
 
+    /* contexto propio de la sesión: las líneas y locks llevan al usuario remoto */
+    UserContext sess;
+    if(user_context_from_hello(line, peer_ip, &sess) == 0) log_set_context(&sess);
+
     log_command("REMOTO: conexion aceptada desde ip=%s ; %s", peer_ip, line);
-    write_all(cfd, "OK\n", 3);
+    bool stream = hello_proto(line) >= REMOTE_PROTO;
+    if(stream){
+        char ok[32]; int om = snprintf(ok, sizeof(ok), "OK proto=%d\n", REMOTE_PROTO);
+        write_all(cfd, ok, (size_t)om);
+    } else write_all(cfd, "OK\n", 3);
+
+    /* directorio propio de la sesión: un "cd" remoto no mueve al servidor ni a otras sesiones */
+    int srv_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int sess_dir = srv_dir >= 0 ? fcntl(srv_dir, F_DUPFD_CLOEXEC, 0) : -1;
 
     for(;;){
-        if(read_line(cfd, line, sizeof(line))<=0) break;
+        if(wait_readable(cfd) != 0 || read_line(cfd, line, sizeof(line))<=0) break;
         if(strcmp(line, "QUIT")==0){
             log_command("REMOTO: desconexion desde ip=%s", peer_ip);
             printf("[server] Desconexion (socket cerrado) de %s\n", peer_ip);
@@ -154,32 +406,43 @@ static void handle_client(int cfd, const char *peer_ip)
 
 
 
-        /* Ejecutar y capturar salida usando un pipe */
-        int pfd[2]; if(pipe(pfd)<0){ free(payload); break; }
+        /* Ejecutar; la salida va a la sesión por bloques mientras el comando corre */
+        int pfd[2]; if(pipe2(pfd, O_CLOEXEC)<0){ free(payload); break; }
+        OutRelay relay = { .rfd = pfd[0], .cfd = cfd, .stream = stream };
+        pthread_t relay_th;
+        if(pthread_create(&relay_th, NULL, out_relay, &relay) != 0){
+            close(pfd[0]); close(pfd[1]); free(payload); break;
+        }
         FILE *out = fdopen(pfd[1], "w");
-        int status = shell_execute_line(payload, out);
-        fclose(out);
-
-        /* leer salida */
-        char buf[4096]; ssize_t r; size_t accsz=0; char *acc=NULL;
-        while( (r = read(pfd[0], buf, sizeof(buf))) > 0 ){
-            char *tmp = realloc(acc, accsz + (size_t)r);
-            if(!tmp){ free(acc); acc=NULL; accsz=0; break; }
-            acc = tmp; memcpy(acc+accsz, buf, (size_t)r); accsz += (size_t)r;
+        if(!out) close(pfd[1]);
+        int status = 1;
+        if(out && (sess_dir < 0 || fchdir(sess_dir) == 0)){
+            status = shell_execute_line(payload, out);
+            if(sess_dir >= 0){
+                close(sess_dir);
+                sess_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if(srv_dir >= 0 && fchdir(srv_dir) != 0)
+                    log_error("REMOTO: no se pudo volver al directorio del servidor: %s", strerror(errno));
+            }
         }
+        if(out) fclose(out);     /* fin de la tubería: el hilo termina al vaciarla */
+        pthread_join(relay_th, NULL);
         close(pfd[0]);
+        if(!stream){
+            send_out(cfd, relay.acc, relay.len);
+            free(relay.acc);
+        }
 
-        /* OUT + STATUS */
-        char hdr[64]; int hm = snprintf(hdr, sizeof(hdr), "OUT %zu\n", accsz);
-        write_all(cfd, hdr, (size_t)hm);
-        if(accsz) write_all(cfd, acc, accsz);
+        /* STATUS cierra la respuesta */
         char st[64]; int sm = snprintf(st, sizeof(st), "\nSTATUS %d\n", status);
         write_all(cfd, st, (size_t)sm);
 
-        free(acc);
         free(payload);
     }
 
+    if(sess_dir >= 0) close(sess_dir);
+    if(srv_dir >= 0) close(srv_dir);
+    log_set_context(NULL);
     close(cfd);
 }
 
@@ -189,6 +452,9 @@ int run_server(void)
     struct sigaction sa = {0}; sa.sa_handler = on_sigint;
     sigaction(SIGINT, &sa, NULL); sigaction(SIGTERM, &sa, NULL);
 
+    /* config publicada por las instancias (el servidor no ocupa lugar de instancia) */
+    if(ipc_init() != 0) log_error("REMOTO: sin memoria compartida; la config se revisa por archivo");
+
     /* bind */
     char portstr[16];
     snprintf(portstr, sizeof(portstr), "%d", g_cfg.remote_port>0 ? g_cfg.remote_port : DEFAULT_REMOTE_PORT);
@@ -216,8 +482,10 @@ int run_server(void)
     fflush(stdout);
 
     log_command("REMOTO: servidor escuchando en puerto %s ; allowed='%s'", portstr, g_cfg.remote_allowed);
+    allow_compile(&g_allow);
 
     while(srv_fd>=0){
+        if(wait_readable(srv_fd) != 0) break;
         struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
         int cfd = accept(srv_fd, (struct sockaddr*)&ss, &slen);
         if(cfd<0){ if(errno==EINTR) continue; log_error("REMOTO: accept fallo: %s", strerror(errno)); break; }
@@ -230,10 +498,16 @@ int run_server(void)
             struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ss;
             inet_ntop(AF_INET6, &sin6->sin6_addr, ipstr, sizeof(ipstr));
         }
-        handle_client(cfd, ipstr);
+        /* recoger cambios de config (p. ej. REMOTE_ALLOWED) sin reiniciar el servidor */
+        config_refresh(false);
+        allow_compile(&g_allow);
+        handle_client(cfd, &ss, ipstr);
+        log_flush();   /* cliente atendido: vaciar antes de volver a esperar en accept() */
     }
 
     if(srv_fd>=0){ close(srv_fd); srv_fd=-1; }
+    allow_free(&g_allow);
+    log_shutdown();
     return 0;
 }
 
@@ -0,0 +1,117 @@
+/*
+ * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
+ * Equipo: Kernel Force
+ * Autores:
+ *   - Enrique Hernández Mauricio — 2223030397
+ *   - Garrido Velázquez Iván — 2203025425
+ *   - Loaeza Sánchez Wendy Maritza — 2193042056
+ *   - Robles Pérez Luis Fernando — 2203031441
+ *
+ * Descripción:
+ *   Lanza comandos externos con posix_spawn (en glibc, clone(CLONE_VM | CLONE_VFORK): no se
+ *   copian las tablas de páginas del shell). Una línea sin metacaracteres se parte en palabras y
+ *   se ejecuta directo con posix_spawnp; sólo las que usan sintaxis de shell (tuberías,
+ *   redirecciones, comillas, variables, comodines...) pasan por /bin/sh -c. Si la ejecución
+ *   directa falla (p. ej. un interno de sh como export), se reintenta con /bin/sh -c, que da
+ *   el mismo resultado y mensaje de error que antes.
+ */
+
+#include "common.h"
+
+extern char **environ;
+
+/* Caracteres que sólo /bin/sh sabe interpretar */
+#define SHELL_META "|&;<>()$`\\\"'*?[]#~{}\n"
+
+/**
+ * ¿Necesita cmd a /bin/sh? Sí si trae algún metacarácter o si empieza con una asignación
+ * (VAR=x cmd); un '=' en los argumentos (--color=auto) no cuenta.
+ */
+bool spawn_needs_shell(const char *cmd){
+    if(cmd[strcspn(cmd, SHELL_META)] != '\0') return true;
+    cmd += strspn(cmd, " \t");
+    size_t first = strcspn(cmd, " \t");
+    return memchr(cmd, '=', first) != NULL;
+}
+
+/**
+ * Parte cmd en palabras separadas por espacios o tabuladores, copiándolas en buf.
+ * @return número de palabras (argv[n] = NULL), -1 si no caben en buf o en argv.
+ */
+int spawn_split(const char *cmd, char *buf, size_t bufsz, char **argv, int maxargs){
+    int n = 0;
+    size_t used = 0;
+    while(*cmd){
+        while(*cmd == ' ' || *cmd == '\t') cmd++;
+        if(!*cmd) break;
+        size_t len = strcspn(cmd, " \t");
+        if(n + 1 >= maxargs || used + len + 1 > bufsz) return -1;
+        memcpy(buf + used, cmd, len);
+        buf[used + len] = '\0';
+        argv[n++] = buf + used;
+        used += len + 1;
+        cmd += len;
+    }
+    argv[n] = NULL;
+    return n;
+}
+
+/*
+ * Atributos comunes: el hijo arranca sin señales bloqueadas y con SIGINT, SIGQUIT, SIGTERM,
+ * SIGPIPE y el aviso de notificaciones en su acción por defecto. SIGTSTP/SIGTTIN/SIGTTOU siguen
+ * ignoradas, como las heredaba el hijo de fork().
+ */
+static posix_spawnattr_t g_attr;
+static bool g_attr_ready;
+
+static const posix_spawnattr_t *spawn_attr(void){
+    if(g_attr_ready) return &g_attr;
+    if(posix_spawnattr_init(&g_attr) != 0) return NULL;
+    sigset_t none, dfl;
+    sigemptyset(&none);
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGINT);
+    sigaddset(&dfl, SIGQUIT);
+    sigaddset(&dfl, SIGTERM);
+    sigaddset(&dfl, SIGPIPE);
+    sigaddset(&dfl, NOTIF_SIGNAL);
+    posix_spawnattr_setsigmask(&g_attr, &none);
+    posix_spawnattr_setsigdefault(&g_attr, &dfl);
+    posix_spawnattr_setflags(&g_attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    g_attr_ready = true;
+    return &g_attr;
+}
+
+/**
+ * Ejecuta argv[0] (buscado en PATH) con los atributos comunes y las acciones fa (puede ser NULL).
+ * @return 0 con *pid del hijo, o el código de error de posix_spawnp (también en errno).
+ */
+int spawn_argv(pid_t *pid, char *const argv[], const posix_spawn_file_actions_t *fa){
+    int r = posix_spawnp(pid, argv[0], fa, spawn_attr(), argv, environ);
+    if(r != 0) errno = r;
+    return r;
+}
+
+/** Como spawn_argv pero con /bin/sh -c cmd */
+int spawn_shell(pid_t *pid, const char *cmd, const posix_spawn_file_actions_t *fa){
+    char *argv[] = { "sh", "-c", (char*)cmd, NULL };
+    int r = posix_spawn(pid, "/bin/sh", fa, spawn_attr(), argv, environ);
+    if(r != 0) errno = r;
+    return r;
+}
+
+/**
+ * Lanza una línea de comando: directo si es simple, si no (o si falla el exec) con /bin/sh -c.
+ * @return pid del hijo, -1 si ni siquiera se pudo lanzar /bin/sh (errno).
+ */
+pid_t spawn_command(const char *cmd){
+    pid_t pid;
+    if(!spawn_needs_shell(cmd)){
+        char buf[SPAWN_LINE_MAX];
+        char *argv[SPAWN_ARGS_MAX];
+        if(spawn_split(cmd, buf, sizeof(buf), argv, SPAWN_ARGS_MAX) > 0 &&
+           spawn_argv(&pid, argv, NULL) == 0)
+            return pid;
+    }
+    return spawn_shell(&pid, cmd, NULL) == 0 ? pid : -1;
+}
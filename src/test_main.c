@@ -1,4 +1,3 @@
-
 /*
  * Proyecto: uamashell - Simulador de una herramienta de administración de UNIX
  * Equipo: Kernel Force
@@ -9,36 +8,577 @@
  *   - Robles Pérez Luis Fernando — 2203031441
  *
  * Descripción:
- *   Pruebas unitarias de funciones clave.
+ *   Pruebas unitarias de funciones clave (make test).
+ *   Corre en un directorio temporal; instance.c se compila para estas pruebas con su propio
+ *   FTOK_PATH (ver Makefile), así que no toca el segmento de los shells en uso.
  */
 
 // src/test_main.c
 #include "common.h"    // donde está Config y DEFAULT_CONF
+#include "mpsc_ring.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
-int main(void) {
-    // Punto A: inicio de main()
+static int g_checks = 0, g_failed = 0;
+
+#define CHECK(cond) do { \
+        g_checks++; \
+        if (!(cond)) { g_failed++; fprintf(stderr, "FALLA %s:%d: %s\n", __FILE__, __LINE__, #cond); } \
+    } while (0)
+
+/* remote_server.o la necesita; la real vive en uamashell.c junto a main() */
+int shell_execute_line(const char *line, FILE *out) {
+    (void)line; (void)out;
+    return 0;
+}
 
-    fprintf(stderr, "A) Tester: entro a main()\n");
+static void write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); exit(1); }
+    fputs(text, f);
+    fclose(f);
+}
+
+/* ---------------- mpsc_ring.h ---------------- */
+
+typedef struct {
+    MpscCell cell;
+    uint32_t producer;
+    uint32_t n;
+} TestCell;
 
-    Config cfg;
-    if (load_config(DEFAULT_CONF, &cfg) < 0) {
-        fprintf(stderr, "ERROR: load_config falló\n");
-        return 1;
+#define RING_PRODUCERS 4
+#define RING_PER_PRODUCER 200000
+
+static MpscRing g_tring;
+static TestCell g_tcells[256];
+
+static void *ring_producer(void *arg) {
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    for (uint32_t i = 0; i < RING_PER_PRODUCER; ) {
+        uint64_t pos;
+        TestCell *c = (TestCell*)mpsc_ring_reserve(&g_tring, g_tcells, &pos);
+        if (!c) { sched_yield(); continue; }      /* lleno: esperar al consumidor */
+        c->producer = id;
+        c->n = i++;
+        mpsc_ring_commit(&c->cell, pos);
     }
-    fprintf(stderr, "B) Tester: config cargada: program_name=\"%s\", max_instances=%d, log_dir=\"%s\"\n",
-            cfg.program_name, cfg.max_instances, cfg.log_dir);
+    return NULL;
+}
 
-    char *plain = getenv("UAMASHELL_PLAIN");
-    fprintf(stderr, "C) Tester: getenv(\"UAMASHELL_PLAIN\") = %s\n", plain ? plain : "(null)");
+static void test_mpsc_ring(void) {
+    /* un hilo: lleno, orden FIFO y vuelta completa del anillo */
+    static TestCell cells[8];
+    MpscRing r;
+    mpsc_ring_init(&r, cells, 8, sizeof(TestCell));
+    for (int round = 0; round < 3; round++) {
+        for (uint32_t i = 0; i < 8; i++) {
+            uint64_t pos;
+            TestCell *c = (TestCell*)mpsc_ring_reserve(&r, cells, &pos);
+            CHECK(c != NULL);
+            if (!c) return;
+            c->n = i;
+            if (i != 3) mpsc_ring_commit(&c->cell, pos);
+            else CHECK(mpsc_ring_commit_cas(&c->cell, pos));
+        }
+        uint64_t pos;
+        CHECK(mpsc_ring_reserve(&r, cells, &pos) == NULL);
+        CHECK(mpsc_ring_pending(&r) == 8);
+        for (uint32_t i = 0; i < 8; i++) {
+            TestCell *c = (TestCell*)mpsc_ring_peek(&r, cells, i);
+            CHECK(c != NULL && c->n == i);
+        }
+        mpsc_ring_release(&r, cells, 8);
+        CHECK(mpsc_ring_pending(&r) == 0 && mpsc_ring_peek(&r, cells, 0) == NULL);
+    }
+
+    /* celda reservada y nunca publicada: el consumidor la abandona y el commit por CAS falla */
+    uint64_t pos;
+    TestCell *c = (TestCell*)mpsc_ring_reserve(&r, cells, &pos);
+    CHECK(c != NULL && mpsc_ring_peek(&r, cells, 0) == NULL);
+    CHECK(mpsc_ring_abandon_head(&r, cells) == 1);
+    CHECK(c && !mpsc_ring_commit_cas(&c->cell, pos));
+    CHECK(mpsc_ring_pending(&r) == 0);
 
-    if (plain && strcmp(plain, "1") == 0) {
-        fprintf(stderr, "D) Tester: entro al modo PLAIN\n");
-    } else {
-        fprintf(stderr, "D) Tester: NO entro al modo PLAIN\n");
+    /* varios productores: no se pierde ni se repite nada y cada uno conserva su orden */
+    mpsc_ring_init(&g_tring, g_tcells, 256, sizeof(TestCell));
+    pthread_t th[RING_PRODUCERS];
+    for (uintptr_t i = 0; i < RING_PRODUCERS; i++)
+        pthread_create(&th[i], NULL, ring_producer, (void*)i);
+    uint32_t next[RING_PRODUCERS] = {0};
+    uint64_t total = 0, out_of_order = 0;
+    while (total < (uint64_t)RING_PRODUCERS * RING_PER_PRODUCER) {
+        uint64_t n = 0;
+        TestCell *t;
+        while (n < 64 && (t = (TestCell*)mpsc_ring_peek(&g_tring, g_tcells, n)) != NULL) {
+            if (t->producer >= RING_PRODUCERS || t->n != next[t->producer]) out_of_order++;
+            else next[t->producer]++;
+            n++;
+        }
+        if (n) mpsc_ring_release(&g_tring, g_tcells, n);
+        else sched_yield();
+        total += n;
     }
+    for (int i = 0; i < RING_PRODUCERS; i++) pthread_join(th[i], NULL);
+    CHECK(out_of_order == 0);
+    for (int i = 0; i < RING_PRODUCERS; i++) CHECK(next[i] == RING_PER_PRODUCER);
+    CHECK(mpsc_ring_pending(&g_tring) == 0);
+}
 
-    return 0;
+/* ---------------- bitacora.c: segmentos rotados ---------------- */
+
+static void touch(const char *path) {
+    write_file(path, "");
+}
+
+static void test_segments(void) {
+    ensure_dirs("seg_t");
+    touch("seg_t/cmd.log");
+    touch("seg_t/cmd.log.20261017-100000.gz");
+    touch("seg_t/cmd.log.20261017-100000-01");
+    touch("seg_t/cmd.log.20261017-100000-01.gz");   /* compresión en curso: gana el plano */
+    touch("seg_t/cmd.log.20261016-235959.gz");
+    touch("seg_t/cmd.log.20261017-090000");
+    /* no son segmentos de cmd.log */
+    touch("seg_t/cmd.log.2026101-100000");
+    touch("seg_t/cmd.log.20261017x100000");
+    touch("seg_t/cmd.log.20261017-100000.gz.tmp");
+    touch("seg_t/cmd.log.20261017-100000-1");
+    touch("seg_t/err.log.20261017-100000");
+    touch("seg_t/cmd.logx.20261017-100000");
+
+    const char *want[] = {
+        "seg_t/cmd.log.20261016-235959.gz",
+        "seg_t/cmd.log.20261017-090000",
+        "seg_t/cmd.log.20261017-100000.gz",
+        "seg_t/cmd.log.20261017-100000-01",
+        "seg_t/cmd.log",
+    };
+    char **paths;
+    int n = log_list_segments("seg_t/cmd.log", &paths);
+    CHECK(n == 5);
+    for (int i = 0; i < n && i < 5; i++) {
+        CHECK(strcmp(paths[i], want[i]) == 0);
+        if (strcmp(paths[i], want[i]) != 0) fprintf(stderr, "  [%d] %s\n", i, paths[i]);
+    }
+    log_free_segments(paths, n);
+
+    /* sin archivo vivo: sólo los rotados */
+    CHECK(unlink("seg_t/cmd.log") == 0);
+    n = log_list_segments("seg_t/cmd.log", &paths);
+    CHECK(n == 4 && strcmp(paths[n - 1], want[3]) == 0);
+    log_free_segments(paths, n);
+
+    CHECK(log_list_segments("no_existe/cmd.log", &paths) == -1);
+}
+
+/* ---------------- bitacora.c: consultas por rango ---------------- */
+
+/* Corre la consulta sobre q_t/cmd.log; deja en got las letras de los registros (texto tras "::") */
+static long run_query(const char *args, char *got, size_t n) {
+    LogQuery q;
+    char *buf = NULL;
+    size_t len = 0;
+    got[0] = '\0';
+    if (log_query_parse(args, &q) != 0) return -2;
+    FILE *m = open_memstream(&buf, &len);
+    if (!m) return -2;
+    long r = log_query("q_t/cmd.log", &q, m);
+    fclose(m);
+    size_t k = 0;
+    for (const char *p = buf; p && (p = strstr(p, ":: ")) != NULL && k + 1 < n; p += 3)
+        got[k++] = p[3];
+    got[k] = '\0';
+    free(buf);
+    return r;
+}
+
+static void test_log_query(void) {
+    ensure_dirs("q_t");
+    /* segmento rotado a las 09:59:59 y el vivo, donde el buffer de pid 2 se vació tarde */
+    write_file("q_t/cmd.log.20261017-095959",
+               "[2026-10-17 09:59:50] CMD pid=3 user=u tty=t ip=i :: z\n");
+    write_file("q_t/cmd.log",
+               "[2026-10-17 10:00:00] CMD pid=1 user=u tty=t ip=i :: a\n"
+               "[2026-10-17 10:00:05] CMD pid=1 user=u tty=t ip=i :: b\n"
+               "[2026-10-17 10:00:03] CMD pid=2 user=u tty=t ip=i :: c\n"
+               "[2026-10-17 10:00:04] CMD pid=2 user=u tty=t ip=i :: d\n"
+               "[2026-10-17 10:00:09] CMD pid=1 user=u tty=t ip=i :: e\n"
+               "[2026-10-17 10:00:06] CMD pid=2 user=u tty=t ip=i :: f\n"
+               "[2026-10-17 10:00:10] CMD pid=1 user=u tty=t ip=i :: g\n");
+
+    int flush = g_cfg.log_flush_ms;
+    g_cfg.log_flush_ms = 1000;
+    char got[32];
+    /* sólo rango: 1 por segmento con algo que mostrar */
+    CHECK(run_query("", got, sizeof got) == 2 && strcmp(got, "zabcdefg") == 0);
+    /* rango: los registros fuera de orden dentro del margen entran, los de fuera no */
+    CHECK(run_query("--desde 2026-10-17 10:00:04 --hasta 2026-10-17 10:00:06", got, sizeof got) == 1);
+    CHECK(strcmp(got, "bdf") == 0);
+    CHECK(run_query("--desde 2026-10-17 10:00:04 --hasta 2026-10-17 10:00:06 pid=2", got, sizeof got) == 2);
+    CHECK(strcmp(got, "df") == 0);
+    CHECK(run_query("--hasta 2026-10-17 10:00:04", got, sizeof got) == 2 && strcmp(got, "zacd") == 0);
+    CHECK(run_query("--desde 2026-10-17 10:00:07", got, sizeof got) == 1 && strcmp(got, "eg") == 0);
+    CHECK(run_query("--desde 2026-10-17 09:59:00 --hasta 2026-10-17 09:59:55", got, sizeof got) == 1);
+    CHECK(strcmp(got, "z") == 0);
+    CHECK(run_query("--desde 2026-10-18", got, sizeof got) == 0 && got[0] == '\0');
+    CHECK(run_query("--desde 2026-10-17 10:00:00 g", got, sizeof got) == 1 && strcmp(got, "g") == 0);
+    g_cfg.log_flush_ms = flush;
+}
+
+/* ---------------- bitacora.c: bitácora binaria ---------------- */
+
+typedef struct { int n; int pids[16]; } BinSeen;
+
+static void bin_visit(const BinLogEntry *e, void *arg) {
+    BinSeen *s = arg;
+    if (s->n < 16) s->pids[s->n] = e->rec->pid;
+    s->n++;
+}
+
+static long bin_query(const char *args, BinSeen *s) {
+    LogQuery q;
+    memset(s, 0, sizeof(*s));
+    if (log_query_parse(args, &q) != 0) return -2;
+    return binlog_scan("bin_t", 0, &q, bin_visit, s);
+}
+
+static void test_binlog(void) {
+    /* cuatro registros; el de pid 3 se vació tarde y quedó después de uno 5 min más nuevo */
+    struct tm tm = { .tm_year = 126, .tm_mon = 9, .tm_mday = 17, .tm_hour = 10, .tm_isdst = -1 };
+    time_t t0 = mktime(&tm);
+    const int pids[4] = { 1, 2, 3, 4 };
+    const int secs[4] = { 0, 500, 200, 900 };
+    ensure_dirs("bin_t");
+    FILE *b = fopen("bin_t/" BINLOG_NAME, "w"), *x = fopen("bin_t/" BINLOG_NAME ".idx", "w");
+    CHECK(b && x);
+    if (!b || !x) return;
+    for (int i = 0; i < 4; i++) {
+        BinLogRecord r = { .magic = BINLOG_REC_MAGIC, .kind = 0, .pid = pids[i], .status = 0,
+                           .ts_us = ((int64_t)t0 + secs[i]) * 1000000 };
+        BinLogIndexEntry ie = { .bucket_start = ((int64_t)t0 + secs[i]) / BINLOG_BUCKET_SEC * BINLOG_BUCKET_SEC,
+                                .offset = (uint64_t)i * sizeof(BinLogRecord) };
+        fwrite(&r, sizeof r, 1, b);
+        fwrite(&ie, sizeof ie, 1, x);
+    }
+    fclose(b); fclose(x);
+    fclose(fopen("bin_t/" BINLOG_NAME ".str", "w"));
+
+    BinSeen s;
+    CHECK(bin_query("--bin", &s) == 4);
+    CHECK(bin_query("--bin --desde 2026-10-17 10:02:30", &s) == 3);     /* el índice salta el primero */
+    CHECK(s.pids[0] == 2 && s.pids[1] == 3 && s.pids[2] == 4);
+    CHECK(bin_query("--bin --desde 2030-01-01", &s) == 0);              /* ninguna cubeta llega */
+    CHECK(bin_query("--bin --hasta 2020-01-01", &s) == 0);
+
+    /* --hasta con LOG_FLUSH_MS grande: el registro tardío sigue apareciendo */
+    int flush = g_cfg.log_flush_ms;
+    g_cfg.log_flush_ms = 600000;
+    CHECK(bin_query("--bin --hasta 2026-10-17 10:04:10", &s) == 2);
+    CHECK(s.pids[0] == 1 && s.pids[1] == 3);
+    g_cfg.log_flush_ms = flush;
+
+    /* archivo truncado a la mitad de un registro: no se lee de más */
+    CHECK(truncate("bin_t/" BINLOG_NAME, 3 * sizeof(BinLogRecord) + 10) == 0);
+    CHECK(bin_query("--bin", &s) == 3);
+    CHECK(bin_query("--bin --desde 2026-10-17 10:14:00", &s) == 0);
+}
+
+/* ---------------- config.c: esquema ---------------- */
+
+static void test_config(void) {
+    write_file(DEFAULT_CONF,
+               "# prueba\n"
+               "PROGRAM_NAME=prueba\n"
+               "MAX_INSTANCES=4\n"
+               "LOG_DIR=var/log\n"
+               "LOG_RING_SLOTS=2048\n"
+               "CLAVE_DESCONOCIDA=1\n");
+    CHECK(load_config(DEFAULT_CONF, &g_cfg) == 0);
+    CHECK(strcmp(g_cfg.program_name, "prueba") == 0);
+    CHECK(g_cfg.max_instances == 4);
+    CHECK(g_cfg.log_ring_slots == 2048);
+    CHECK(g_cfg.log_flush_ms == DEFAULT_LOG_FLUSH_MS);    /* ausente: valor por defecto */
+    CHECK(g_cfg.log_dir[0] == '/');                       /* relativo: anclado al directorio de arranque */
+    CHECK(strcmp(g_cfg.log_dir + strlen(g_cfg.log_dir) - 8, "/var/log") == 0);
+
+    CHECK(config_check("MAX_INSTANCES", "0") != 0);
+    CHECK(config_check("MAX_INSTANCES", "12") == 0);
+    CHECK(config_check("MAX_INSTANCES", "12x") != 0);
+    CHECK(config_check("LOG_RING_SLOTS", "65536") == 0);
+    CHECK(config_check("LOG_RING_SLOTS", "1048576") != 0);  /* ~2 GiB de celdas */
+    CHECK(config_check("LOG_MODE", "async") == 0);
+    CHECK(config_check("LOG_MODE", "rapido") != 0);
 }
 
+/* ---------------- config.c: setconf ---------------- */
+
+static void test_setconf(void) {
+    write_file(DEFAULT_CONF, "# comentario MAX_INSTANCES=9\nMAX_INSTANCES=4\nLOG_DIR=var/log\n");
+    chmod(DEFAULT_CONF, 0640);
+    CHECK(set_config_key(DEFAULT_CONF, "MAX_INSTANCES", "6") == 0);
+    CHECK(set_config_key(DEFAULT_CONF, "NUEVA", "x") == 0);
+    struct stat st;
+    CHECK(stat(DEFAULT_CONF, &st) == 0 && (st.st_mode & 07777) == 0640);   /* conserva el modo */
+    Config c;
+    CHECK(load_config(DEFAULT_CONF, &c) == 0 && c.max_instances == 6);
+
+    char line[128];
+    int lines = 0, comment_ok = 0, nueva = 0;
+    FILE *f = fopen(DEFAULT_CONF, "r");
+    while (f && fgets(line, sizeof line, f)) {
+        lines++;
+        if (strcmp(line, "# comentario MAX_INSTANCES=9\n") == 0) comment_ok = 1;
+        if (strcmp(line, "NUEVA=x\n") == 0) nueva = 1;
+    }
+    if (f) fclose(f);
+    CHECK(lines == 4 && comment_ok && nueva);
+    CHECK(access(DEFAULT_CONF ".lock", F_OK) == 0);                      /* el lock se queda */
+
+    /* un conf que no existía se crea legible, no con el 0600 de mkstemp */
+    CHECK(set_config_key("etc/otro.conf", "A", "1") == 0);
+    CHECK(stat("etc/otro.conf", &st) == 0 && (st.st_mode & 07777) == 0664);
+}
+
+/* ---------------- instance.c: seqlock de la config publicada ---------------- */
+
+static void test_config_seqlock(void) {
+    CHECK(ipc_init() == 0);
+    /* otro proceso publica sin parar configs con dos campos iguales; nunca deben verse distintos */
+    pid_t w = fork();
+    if (w == 0) {
+        Config c = g_cfg;
+        for (int i = 1; ; i++) {
+            c.max_instances = i;
+            c.log_flush_ms = i;
+            snprintf(c.program_name, sizeof c.program_name, "gen-%d", i);
+            config_publish(&c);
+        }
+        _exit(0);
+    }
+    uint64_t reads = 0, torn = 0, last_gen = 0, backwards = 0;
+    struct timespec t0, now;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {                               /* medio segundo de lecturas */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - t0.tv_sec) * 1000L + (now.tv_nsec - t0.tv_nsec) / 1000000L >= 500) break;
+        Config c;
+        uint64_t gen;
+        if (config_snapshot(&c, &gen) != 1) { sched_yield(); continue; }   /* nada nuevo todavía */
+        char expect[64];
+        snprintf(expect, sizeof expect, "gen-%d", c.max_instances);
+        if (c.max_instances != c.log_flush_ms || strcmp(c.program_name, expect) != 0) torn++;
+        if (gen < last_gen) backwards++;
+        last_gen = gen;
+        reads++;
+    }
+    kill(w, SIGKILL);
+    waitpid(w, NULL, 0);
+    CHECK(reads > 0);
+    CHECK(torn == 0);
+    CHECK(backwards == 0);
+    fprintf(stderr, "  seqlock: %llu lecturas consistentes\n", (unsigned long long)reads);
+}
+
+/* ---------------- remote_server.c: REMOTE_ALLOWED ---------------- */
+
+static void test_allow(void) {
+    const char *csv = "10.0.0.1, 192.168.0.0/16 ,2001:db8::/32, ::1, nada, 10.1.2.3/40,192.168.1.77/24";
+    CHECK(remote_allow_check(csv, "10.0.0.1") == 1);
+    CHECK(remote_allow_check(csv, "10.0.0.2") == 0);
+    CHECK(remote_allow_check(csv, "::ffff:10.0.0.1") == 1);      /* IPv4 en socket IPv6 */
+    CHECK(remote_allow_check(csv, "192.168.5.7") == 1);
+    CHECK(remote_allow_check(csv, "192.169.0.1") == 0);
+    CHECK(remote_allow_check(csv, "2001:db8:1::5") == 1);
+    CHECK(remote_allow_check(csv, "2001:db9::1") == 0);
+    CHECK(remote_allow_check(csv, "::1") == 1);
+    CHECK(remote_allow_check(csv, "::2") == 0);
+    CHECK(remote_allow_check(csv, "10.1.2.3") == 0);             /* /40: entrada inválida, ignorada */
+    CHECK(remote_allow_check(csv, "nada") == -1);
+    CHECK(remote_allow_check(csv, "10.0.0.0/8") == -1);
+    CHECK(remote_allow_check("", "10.0.0.1") == 0);               /* lista vacía: nadie */
+
+    /* un prefijo corto cubre a uno largo, en cualquier orden */
+    CHECK(remote_allow_check("10.0.0.0/8,10.1.0.0/16", "10.2.3.4") == 1);
+    CHECK(remote_allow_check("10.1.0.0/16,10.0.0.0/8", "10.2.3.4") == 1);
+    CHECK(remote_allow_check("10.1.0.0/16,10.0.0.0/8", "10.1.9.9") == 1);
+    CHECK(remote_allow_check("10.1.0.0/16,10.0.0.0/8", "11.0.0.1") == 0);
+    CHECK(remote_allow_check("0.0.0.0/0", "203.0.113.9") == 1);   /* todo IPv4, nada de IPv6 */
+    CHECK(remote_allow_check("0.0.0.0/0", "::1") == 0);
+    CHECK(remote_allow_check("::/0", "203.0.113.9") == 1);
+
+    /* muchas IPs exactas: el conjunto hash las encuentra todas */
+    char many[1024] = "";
+    for (int i = 1; i <= 60; i++) {
+        size_t l = strlen(many);
+        snprintf(many + l, sizeof many - l, "%s10.9.0.%d", i > 1 ? "," : "", i);
+    }
+    int found = 0;
+    char ip[32];
+    for (int i = 1; i <= 60; i++) {
+        snprintf(ip, sizeof ip, "10.9.0.%d", i);
+        found += remote_allow_check(many, ip) == 1;
+    }
+    CHECK(found == 60);
+    CHECK(remote_allow_check(many, "10.9.0.61") == 0);
+}
+
+/* ---------------- instance.c: tabla de instancias ---------------- */
+
+#define SLOT_CHILDREN 6
+
+static bool snapshot_has(pid_t pid, int *count) {
+    pid_t pids[64];
+    InstanceStats st[64];
+    int n = instance_stats_snapshot(pids, st, 64);
+    if (count) *count = n;
+    for (int i = 0; i < n; i++) if (pids[i] == pid) return true;
+    return false;
+}
+
+static void test_instances(void) {
+    CHECK(set_config_key(DEFAULT_CONF, "MAX_INSTANCES", "6") == 0);
+    CHECK(load_config(DEFAULT_CONF, &g_cfg) == 0);
+    ipc_force_cleanup();                     /* restos de una corrida anterior */
+    CHECK(ipc_init() == 0);
+    config_publish(&g_cfg);
+
+    /* cada hijo entra, avisa y espera a que se cierre "go" para salir */
+    int res[2], go[2];
+    if (pipe(res) != 0 || pipe(go) != 0) { perror("pipe"); exit(1); }
+    pid_t kids[SLOT_CHILDREN];
+    for (int i = 0; i < SLOT_CHILDREN; i++) {
+        kids[i] = fork();
+        if (kids[i] == 0) {
+            close(res[0]); close(go[1]);
+            char rc = (char)instance_try_enter();
+            if (write(res[1], &rc, 1) != 1) _exit(2);
+            char b;
+            while (read(go[0], &b, 1) > 0) ;
+            instance_leave();
+            _exit(0);
+        }
+    }
+    close(res[1]); close(go[0]);
+    int entered = 0;
+    for (int i = 0; i < SLOT_CHILDREN; i++) {
+        char rc = 1;
+        if (read(res[0], &rc, 1) == 1 && rc == 0) entered++;
+    }
+    close(res[0]);
+    CHECK(entered == SLOT_CHILDREN);
+    int n = 0;
+    for (int i = 0; i < SLOT_CHILDREN; i++) CHECK(snapshot_has(kids[i], &n));
+    CHECK(n == SLOT_CHILDREN);
+
+    /* lleno: no hay lugar, hasta que una instancia muere sin instance_leave() */
+    CHECK(instance_try_enter() == 1);
+    kill(kids[0], SIGKILL);
+    waitpid(kids[0], NULL, 0);
+    CHECK(instance_try_enter() == 0);
+    CHECK(snapshot_has(getpid(), &n) && !snapshot_has(kids[0], NULL));
+    CHECK(n == SLOT_CHILDREN);
+
+    /* los demás salen: sólo queda esta instancia */
+    close(go[1]);
+    for (int i = 1; i < SLOT_CHILDREN; i++) waitpid(kids[i], NULL, 0);
+    CHECK(snapshot_has(getpid(), &n) && n == 1);
+}
+
+/* ---------------- spawn.c ---------------- */
+
+static void test_spawn_split(void) {
+    char buf[SPAWN_LINE_MAX], *argv[SPAWN_ARGS_MAX];
+    CHECK(spawn_split("  ls\t-l  /tmp ", buf, sizeof buf, argv, SPAWN_ARGS_MAX) == 3);
+    CHECK(strcmp(argv[0], "ls") == 0 && strcmp(argv[1], "-l") == 0 && strcmp(argv[2], "/tmp") == 0);
+    CHECK(argv[3] == NULL);
+    CHECK(spawn_split("", buf, sizeof buf, argv, SPAWN_ARGS_MAX) == 0 && argv[0] == NULL);
+    CHECK(spawn_split("a b c", buf, sizeof buf, argv, 3) == -1);   /* no caben con el NULL */
+    CHECK(spawn_split("abcdef", buf, 4, argv, SPAWN_ARGS_MAX) == -1);
+
+    CHECK(!spawn_needs_shell("ls -l --color=auto"));
+    CHECK(spawn_needs_shell("ls *.c"));
+    CHECK(spawn_needs_shell("echo $HOME"));
+    CHECK(spawn_needs_shell("VAR=1 env"));
+}
+
+/* ---------------- pipeline.c ---------------- */
+
+static void test_pipeline_parse(void) {
+    static Pipeline pl;
+    CHECK(pipeline_parse("cat f.txt | grep -v 'a b' > salida 2>&1", &pl) == 0);
+    CHECK(pl.nstages == 2);
+    CHECK(pl.st[0].argc == 2 && strcmp(pl.st[0].argv[0], "cat") == 0 && pl.st[0].argv[2] == NULL);
+    CHECK(pl.st[1].argc == 3 && strcmp(pl.st[1].argv[2], "a b") == 0);
+    CHECK(pl.st[1].nredir == 2);
+    CHECK(pl.st[1].redir[0].kind == REDIR_OUT && pl.st[1].redir[0].fd == 1 &&
+          strcmp(pl.st[1].redir[0].path, "salida") == 0);
+    CHECK(pl.st[1].redir[1].kind == REDIR_DUP && pl.st[1].redir[1].fd == 2 &&
+          pl.st[1].redir[1].dup_from == 1);
+
+    CHECK(pipeline_parse("sort < entrada >> bitacora", &pl) == 0);
+    CHECK(pl.nstages == 1 && pl.st[0].nredir == 2);
+    CHECK(pl.st[0].redir[0].kind == REDIR_IN && pl.st[0].redir[0].fd == 0);
+    CHECK(pl.st[0].redir[1].kind == REDIR_APPEND && pl.st[0].redir[1].fd == 1);
+
+    CHECK(pipeline_parse("ls 2>errores", &pl) == 0 && pl.st[0].argc == 1 &&
+          pl.st[0].redir[0].fd == 2);
+    CHECK(pipeline_parse("echo \"2\">f", &pl) == 0 && pl.st[0].argc == 2 &&  /* "2" entre comillas es palabra */
+          pl.st[0].redir[0].fd == 1);
+
+    /* lo que sólo sh sabe hacer */
+    CHECK(pipeline_parse("ls | ", &pl) == 1);
+    CHECK(pipeline_parse("a || b", &pl) == 1);
+    CHECK(pipeline_parse("cat << FIN", &pl) == 1);
+    CHECK(pipeline_parse("echo > ", &pl) == 1);
+    CHECK(pipeline_parse("echo $HOME | wc", &pl) == 1);
+    CHECK(pipeline_parse("VAR=1 env | wc", &pl) == 1);
+    CHECK(pipeline_parse("set | grep HOME", &pl) == 1);      /* builtins de sh */
+    CHECK(pipeline_parse("type ls > f", &pl) == 1);
+    CHECK(pipeline_parse("echo 'sin cerrar", &pl) == 1);
+}
+
+int main(void) {
+    char dir[] = "/tmp/uamashell_test.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) { perror("mkdtemp"); return 1; }
+    ensure_dirs("etc");
+    ensure_dirs("var");
+    ensure_dirs("var/log");
+    /* config base; cada prueba cambia lo que necesita */
+    write_file(DEFAULT_CONF, "LOG_DIR=var/log\nLOCK_DIR=var/lock\n");
+    if (load_config(DEFAULT_CONF, &g_cfg) != 0) { fprintf(stderr, "load_config falló\n"); return 1; }
+
+    fprintf(stderr, "mpsc_ring...\n");
+    test_mpsc_ring();
+    fprintf(stderr, "segmentos...\n");
+    test_segments();
+    fprintf(stderr, "log_query...\n");
+    test_log_query();
+    fprintf(stderr, "binlog_scan...\n");
+    test_binlog();
+    fprintf(stderr, "config...\n");
+    test_config();
+    fprintf(stderr, "setconf...\n");
+    test_setconf();
+    fprintf(stderr, "config publicada...\n");
+    test_config_seqlock();
+    fprintf(stderr, "REMOTE_ALLOWED...\n");
+    test_allow();
+    fprintf(stderr, "instancias...\n");
+    test_instances();
+    fprintf(stderr, "spawn_split...\n");
+    test_spawn_split();
+    fprintf(stderr, "pipeline_parse...\n");
+    test_pipeline_parse();
+
+    instance_leave();
+    ipc_force_cleanup();
+    char cmd[PATH_MAX];
+    snprintf(cmd, sizeof cmd, "rm -rf '%s'", dir);
+    if (system(cmd) != 0) fprintf(stderr, "aviso: no se pudo borrar %s\n", dir);
+
+    fprintf(stderr, "%d comprobaciones, %d fallidas\n", g_checks, g_failed);
+    return g_failed ? 1 : 0;
+}
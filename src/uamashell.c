@@ -26,12 +26,36 @@
 #include <errno.h>
 #include <limits.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <ncurses.h>
 extern Config g_cfg; //configuracion global
 static volatile sig_atomic_t g_running = 1; //bandera de ejecucion
+static int g_notif_fd = -1;                  //despertador de notificaciones (notif_wakeup_fd)
 
-static void cmd_notificaciones(void);
-static void cmd_dueno(const char *arg);
+/* Comando en curso, para los contadores de la instancia (estadisticas) */
+static struct timespec g_cmd_t0;
+static int g_cmd_kind = -1;                  //-1 ninguno, 0 interno, 1 externo
+
+static void cmd_begin(void) {
+    clock_gettime(CLOCK_MONOTONIC, &g_cmd_t0);
+    g_cmd_kind = 0;                          /* run_external lo cambia a externo */
+}
+
+static void cmd_end(void) {
+    if (g_cmd_kind < 0) return;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t us = (uint64_t)((t1.tv_sec - g_cmd_t0.tv_sec) * 1000000L +
+                             (t1.tv_nsec - g_cmd_t0.tv_nsec) / 1000L);
+    InstanceStats *st = instance_stats();
+    stat_add(&st->cmds, 1);
+    stat_add(g_cmd_kind ? &st->externals : &st->builtins, 1);
+    stat_add(&st->lat_total_us, us);
+    stat_max(&st->lat_max_us, us);
+    g_cmd_kind = -1;
+}
+
+static bool g_exec_remote;                   //la línea en curso viene de una sesión remota
 
 
 
@@ -45,7 +69,7 @@ static void sanitize(const char *in, char *out, size_t n);
 static char *extract_target(const char *cmd);
 static int  acquire_file_lock(const char *target_path, const char *cmd, LockInfo *info);
 static void release_file_lock(LockInfo *info);
-static void run_external(const char *cmd);
+static int  run_external(const char *cmd);
 
 
 /* Manejador SIGINT/SIGTERM */
@@ -56,45 +80,67 @@ static void on_signal(int sig) {
 }
 
 /* Ayuda en modo texto */
-static void help_plain(void) {
-    puts("Comandos internos:");
-    puts("  ayuda               - Muestra esta ayuda");
-    puts("  terminar            - Termina la ejecución");
-    puts("  bitacora_comandos   - Muestra bitácora de comandos");
-    puts("  bitacora_error      - Muestra bitácora de errores");
-    puts("  showconf            - Muestra configuración");
-    puts("  setconf k=v         - Modifica configuración");
-    puts("  cd <ruta>           - Cambia de directorio");
-    puts("  notificaciones       - Muestra avisos pendientes por conflictos");
-    puts("  dueno <archivo>      - Muestra quién tiene el lock de <archivo>");
-    puts("  IP <direccion>      - Conecta a servidor remoto");
-    puts("  desconectar         - Termina la sesión remota");
-    puts("Cualquier otro texto → /bin/sh -c …");
+static void help_plain(FILE *out) {
+    fputs("Comandos internos:" "\n", out);
+    fputs("  ayuda               - Muestra esta ayuda" "\n", out);
+    fputs("  terminar            - Termina la ejecución" "\n", out);
+    fputs("  bitacora_comandos [filtros] - Muestra bitácora de comandos" "\n", out);
+    fputs("  bitacora_error [filtros]    - Muestra bitácora de errores" "\n", out);
+    fputs("      filtros: --desde FECHA [HORA] --hasta FECHA [HORA] pid=N user=U ip=IP texto" "\n", out);
+    fputs("      -f sigue la bitácora en vivo (Enter para terminar); --bin lee la binaria" "\n", out);
+    fputs("  showconf            - Muestra configuración" "\n", out);
+    fputs("  setconf k=v         - Modifica configuración" "\n", out);
+    fputs("  cd <ruta>           - Cambia de directorio" "\n", out);
+    fputs("  notificaciones       - Muestra avisos pendientes por conflictos" "\n", out);
+    fputs("  estadisticas         - Contadores de todas las instancias activas" "\n", out);
+    fputs("  dueno <archivo>      - Muestra quién tiene el lock de <archivo>" "\n", out);
+    fputs("  IP <direccion>      - Conecta a servidor remoto" "\n", out);
+    fputs("  desconectar         - Termina la sesión remota" "\n", out);
+    fputs("Cualquier otro texto → se ejecuta directo (o con /bin/sh -c si usa ;, &&, $, comodines…)" "\n", out);
+    fputs("En una sesión remota no aplican terminar, setconf, notificaciones, IP, desconectar ni bitacora_* -f;" "\n", out);
+    fputs("cd sólo cambia el directorio de esa sesión." "\n", out);
 }
 
-/* Mostrar bitácoras */
-static void show_log_plain(bool err) {
+/* Mostrar bitácoras (args: filtros opcionales, ver log_query_parse) */
+static void show_log_plain(bool err, const char *args, FILE *out) {
     char cmdp[PATH_MAX], errp[PATH_MAX];
     resolve_paths(cmdp,sizeof cmdp,errp,sizeof errp);
     const char *f = err ? errp : cmdp;
-    FILE *fp = fopen(f,"r");
-    if (!fp) { printf("No se pudo abrir %s\n", f); return; }
-    char ln[1024];
-    while (fgets(ln,sizeof ln,fp)) fputs(ln,stdout);
-    fclose(fp);
-}
+    log_flush();   /* que se vean también las líneas aún en el buffer propio */
 
-/* Ejecutar comando */
-static void exec_plain(const char *cmd) {
-    log_command("exec: %s", cmd);
-    FILE *p = popen(cmd,"r");
-    if (!p) { log_error("popen: %s", strerror(errno)); return; }
-    char ln[1024];
-    while (fgets(ln,sizeof ln,p)) fputs(ln,stdout);
-    int st = pclose(p);
-    if (st==-1) log_error("pclose: %s", strerror(errno));
-    else if (WIFEXITED(st) && WEXITSTATUS(st))
-        log_error("Comando terminó %d: %s", WEXITSTATUS(st), cmd);
+    LogQuery q;
+    if (log_query_parse(args, &q) != 0) {
+        fprintf(out, "Uso: %s [-f] [--bin] [--desde FECHA [HORA]] [--hasta FECHA [HORA]] [pid=N] [user=U] [ip=IP] [texto]\n",
+                err ? "bitacora_error" : "bitacora_comandos");
+        return;
+    }
+    if (q.follow && g_exec_remote) {
+        fputs("El seguimiento (-f) sólo está disponible en la terminal local.\n", out);
+        return;
+    }
+    if (q.follow) {
+        /* el seguimiento también queda en la bitácora de comandos */
+        const char *name = err ? "bitacora_error" : "bitacora_comandos";
+        log_command("%s -f: inicia seguimiento de %s", name, f);
+        log_flush();
+        printf("(siguiendo %s; Enter para terminar)\n", f);
+        fflush(stdout);
+        long n = log_follow(f, &q, STDIN_FILENO, stdout, &g_running);
+        if (n < 0) printf("No se pudo seguir %s: %s\n", f, strerror(errno));
+        else log_command("%s -f: termina seguimiento (%ld registros)", name, n);
+        return;
+    }
+    if (q.binary) {
+        if (binlog_query(g_cfg.log_dir, err ? 1 : 0, &q, out) < 0)
+            fprintf(out, "No hay bitácora binaria en %s (LOG_BINARY=1)\n", g_cfg.log_dir);
+        return;
+    }
+    if (!q.desde[0] && !q.hasta[0] && q.nfields == 0 && !q.text[0]) {
+        /* recorre también los segmentos rotados (y comprimidos) en orden */
+        if (log_dump(f, out) != 0) fprintf(out, "No se pudo abrir %s\n", f);
+        return;
+    }
+    if (log_query(f, &q, out) < 0) fprintf(out, "No se pudo abrir %s\n", f);
 }
 
 /* Bucle texto puro*/
@@ -104,6 +150,7 @@ static void loop_plain(void) {
     char buf[1024];
     ssize_t n;
     fprintf(stderr, "→ [loop_plain] conf_path='%s'\n", g_cfg.conf_path);
+    notif_drain_for(getpid(), stderr);  /* las que llegaron antes de registrarse */
     while (g_running) {
         
         static int first = 1;
@@ -121,10 +168,27 @@ static void loop_plain(void) {
         printf("\n[%s] %s\n> ", g_cfg.program_name, cwd);
         fflush(stdout);
 
-        /* 1) leer carácter a carácter hasta \n */
+        /* en espera de entrada: vaciar las bitácoras pendientes */
+        log_flush();
+
+        /* 1) leer carácter a carácter hasta \n; las notificaciones se muestran al llegar */
         int pos = 0;
         for (;;) {
-	notif_drain_for(getpid());
+            struct pollfd pf[2] = { { STDIN_FILENO, POLLIN, 0 }, { g_notif_fd, POLLIN, 0 } };
+            int ready = poll(pf, g_notif_fd >= 0 ? 2 : 1, log_flush_due_ms());
+            if (ready < 0) {
+                if (errno == EINTR && g_running) continue;
+                goto salir;
+            }
+            if (ready == 0) {               /* venció LOG_FLUSH_MS de una línea pendiente */
+                log_flush();
+                continue;
+            }
+            if (pf[1].revents & POLLIN) {
+                notif_wakeup_ack(g_notif_fd);
+                notif_drain_for(getpid(), stderr);
+            }
+            if (!(pf[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
 
             unsigned char c;
             n = read(STDIN_FILENO, &c, 1);
@@ -134,110 +198,9 @@ static void loop_plain(void) {
         }
         buf[pos] = '\0';
 
-        /* 2) comandos internos */
-        if (strcmp(buf, "terminar") == 0) {
-            break;
-        }
-        else if (strcmp(buf, "ayuda") == 0) {
-            help_plain();
-            continue;
-        }
-        else if (strcmp(buf, "showconf") == 0) {
-	   printf("PROGRAM_NAME=%s\n"
-           "MAX_INSTANCES=%d\n"
-           "LOG_DIR=%s\n"
-           "LOCK_DIR=%s\n",
-            g_cfg.program_name,
-            g_cfg.max_instances,
-            g_cfg.log_dir,
-            g_cfg.lock_dir[0] ? g_cfg.lock_dir : "(no configurado)");
-            continue;
-        }
-        else if (strcmp(buf, "bitacora_comandos") == 0) {
-            show_log_plain(false);
-            continue;
-        }
-        else if (strcmp(buf, "bitacora_error") == 0) {
-            show_log_plain(true);
-            continue;
-        }
-        else if (strncmp(buf, "cd ", 3) == 0) {
-            char *d = buf + 3;
-            trim(d);
-            if (chdir(d) < 0)
-                log_error("cd %s: %s", d, strerror(errno));
-            else
-                log_command("cd %s", d);
-            continue;
-        }
-        else if (strncmp(buf, "setconf ", 8) == 0) {
-            char *kv = buf + 8;
-            char *eq = strrchr(kv, '=');
-            if (!eq) {
-                puts("Uso: setconf clave=valor");
-                continue;
-            }
-            *eq = '\0';
-            char *k = kv;
-            char *v = eq + 1;
-            trim(k); trim(v);
-	    fprintf(stderr,"DEBUG setconf: archivo=%s, clave=%s, valor=%s\n",
-            g_cfg.conf_path, k, v);
-            if (set_config_key(g_cfg.conf_path, k, v) != 0) {
-                perror("set_config_key");
-		puts("No se pudo modificar config");
-            } else {
-                load_config(g_cfg.conf_path, &g_cfg);
-                log_command("setconf %s=%s", k, v);
-            }
-            continue;
-        } else if (strcmp(buf, "notificaciones") == 0) {
-    	cmd_notificaciones();
-    	continue;
-	} else if (strncmp(buf, "dueno ", 6) == 0) {
-    	cmd_dueno(buf + 6);
-    	continue;
-	} else if (strcmp(buf, "dueno") == 0) {
-        cmd_dueno(NULL);         // sin argumento -> imprime "Uso: ..."
-        continue;
-	}else if (strncmp(buf, "IP ", 3) == 0) {
-    		char ip[128] = {0};
-    		sscanf(buf+3, "%127s", ip);
-    		if (ip[0] == '\0') {
-       		 	printf("Uso: IP <direccion>\n");
-    		} else if (remote_is_active()) {
-        	printf("Ya hay una sesión remota activa con %s. Usa 'desconectar' primero.\n", remote_current_ip());
-    		}else {
-        		int port = g_cfg.remote_port > 0 ? g_cfg.remote_port : DEFAULT_REMOTE_PORT;
-        		if (remote_connect(ip, port) == 0) {
-           	 		log_command("Remoto: conectado a %s:%d", ip, port);
-            			printf("Conectado a %s:%d\n", ip, port);
-        		} else {
-            			log_error("Remoto: fallo de conexion a %s:%d (%s)", ip, port, strerror(errno));
-            			printf("Conexion fallida: %s\n", strerror(errno));
-        		}
-    		}
-    		continue;	
-	} else if (strcmp(buf, "desconectar") == 0) {
-    		if (!remote_is_active()) {
-       			 printf("No hay sesion remota activa.\n");
-    		} else {
-        		 log_command("Remoto: desconectando de %s", remote_current_ip());
-        		 remote_disconnect();
-        		  printf("Sesion remota cerrada. De vuelta a local.\n");
-    		}
-    		continue;
-	}else if (buf[0] == '\0') {
-   	 /* línea vacía: solo repinta prompt */
-    	continue;
-	} else {
-    	/* ← cualquier otro texto: comando externo */
-    	run_external(buf);
-    	continue;
-	}
-
-        /* 3) ningún interno: lo envío al shell */
-        exec_plain(buf);
+        /* otra instancia pudo cambiar la config (setconf): comparar la generación publicada */
+        config_refresh(false);
+        process_one_line(buf, stdout);     /* "terminar" baja g_running */
     }
 
 salir:
@@ -271,82 +234,146 @@ static char *extract_target(const char *cmd) {
     return out;
 }
 
-static void run_external(const char *cmd) {
-    LockInfo lock;
-    memset(&lock, 0, sizeof(lock));
-    lock.fd = -1;
-    lock.path[0] = '\0';
-
-    char *target = extract_target(cmd);
-
-    if (target) {
-        int l = acquire_file_lock(target, cmd, &lock);
-        if (l < 0) {
-            /* Ya está bloqueado: lee los datos del dueño desde el lockfile y notifica */
-            int rfd = open(lock.path, O_RDONLY);
-            char buf[512] = {0};
-            if (rfd >= 0) {
-                read(rfd, buf, sizeof(buf) - 1);
-                close(rfd);
-            }
+/* Otra instancia tiene el lock de target: avisar aquí, notificar al dueño y registrarlo */
+static void report_lock_conflict(const char *target, const LockInfo *lock, const char *cmd) {
+    stat_add(&instance_stats()->lock_conflicts, 1);
+    /* Ya está bloqueado: lee los datos del dueño desde el lockfile y notifica */
+    int rfd = open(lock->path, O_RDONLY);
+    char buf[512] = {0};
+    if (rfd >= 0) {
+        read(rfd, buf, sizeof(buf) - 1);
+        close(rfd);
+    }
+
+    /* Aviso en la instancia que choca */
+    fprintf(stderr, "⚠️ Archivo en uso. Detalles del dueño:\n%s\n", buf);
+
+    /* Extraer PID dueño */
+    pid_t owner = 0;
+    sscanf(buf, "pid=%d", &owner);
 
-            /* Aviso en la instancia que choca */
-            fprintf(stderr, "⚠️ Archivo en uso. Detalles del dueño:\n%s\n", buf);
+    /* Mensaje para el dueño con datos del segundo */
+    char me_user[64], me_tty[64], me_ip[64];
+    get_user_context(me_user, sizeof(me_user), me_tty, sizeof(me_tty), me_ip, sizeof(me_ip));
 
-            /* Extraer PID dueño */
-            pid_t owner = 0;
-            sscanf(buf, "pid=%d", &owner);
+    /* Limitar lo que mostramos como “target” para evitar warnings de truncation */
+    char tshort[128];
+    sanitize(target ? target : "(n/a)", tshort, sizeof(tshort));
 
-            /* Mensaje para el dueño con datos del segundo */
-            char me_user[64], me_tty[64], me_ip[64];
-            get_user_context(me_user, sizeof(me_user), me_tty, sizeof(me_tty), me_ip, sizeof(me_ip));
+    char msg_owner[512];
+    int off = snprintf(msg_owner, sizeof(msg_owner),
+                       "Conflicto sobre '%s': ", tshort);
+    if (off < 0 || off >= (int)sizeof(msg_owner)) off = (int)sizeof(msg_owner) - 1;
 
+    /* Bounded %s para que el compilador conozca el máximo posible */
+    snprintf(msg_owner + off, sizeof(msg_owner) - off,
+             "competidor pid=%d user=%.32s tty=%.32s ip=%.64s cmd=%.128s",
+             getpid(), me_user, me_tty, me_ip, cmd ? cmd : "(n/a)");
 
-	    /* Limitar lo que mostramos como “target” para evitar warnings de truncation */
-	    char tshort[128];
-	    sanitize(target ? target : "(n/a)", tshort, sizeof(tshort));
+    /* Notificar al dueño (si lo conocemos) y registrar en bitácora de errores */
+    if (owner > 0) {
+        notif_push(owner, msg_owner);
+    }
+    log_error("Acceso concurrente a %s :: dueño{%s} :: competidor{pid=%d user=%s tty=%s ip=%s cmd=%s}",
+              target, buf, getpid(), me_user, me_tty, me_ip, cmd ? cmd : "(n/a)");
+}
 
-	    char msg_owner[512];
-	    int off = snprintf(msg_owner, sizeof(msg_owner),
-                   "Conflicto sobre '%s': ", tshort);
-	    if (off < 0 || off >= (int)sizeof(msg_owner)) off = (int)sizeof(msg_owner) - 1;
-	
-	    /* Bounded %s para que el compilador conozca el máximo posible */
-	    snprintf(msg_owner + off, sizeof(msg_owner) - off,
-        	 "competidor pid=%d user=%.32s tty=%.32s ip=%.64s cmd=%.128s",
-	         getpid(), me_user, me_tty, me_ip, cmd ? cmd : "(n/a)");
+/* Archivos que toca un comando: hasta LOCK_TARGETS_MAX, sin repetir */
+#define LOCK_TARGETS_MAX 32
+typedef struct {
+    const char *path[LOCK_TARGETS_MAX];
+    int n;
+} LockTargets;
+
+/* Dispositivos (/dev/null, una tty...), tuberías y sockets los comparte todo el sistema: no se
+ * bloquean. Sí un archivo regular, un directorio o una ruta que aún no existe (> la crea). */
+static int add_target(LockTargets *t, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) return 0;
+    for (int i = 0; i < t->n; i++)
+        if (strcmp(t->path[i], path) == 0) return 0;
+    if (t->n == LOCK_TARGETS_MAX) return -1;
+    t->path[t->n++] = path;
+    return 0;
+}
 
+/* De una tubería: por etapa, el primer argumento que exista (como extract_target) y cada
+ * archivo redirigido, exista o no (> lo crea) */
+static int pipeline_targets(const Pipeline *pl, LockTargets *t) {
+    for (int i = 0; i < pl->nstages; i++) {
+        const PipeStage *st = &pl->st[i];
+        if (st->argc > 1 && access(st->argv[1], F_OK) == 0 && add_target(t, st->argv[1]) < 0)
+            return -1;
+        for (int k = 0; k < st->nredir; k++)
+            if (st->redir[k].kind != REDIR_DUP && add_target(t, st->redir[k].path) < 0)
+                return -1;
+    }
+    return 0;
+}
 
-            /* Notificar al dueño (si lo conocemos) y registrar en bitácora de errores */
-            if (owner > 0) {
-                notif_push(owner, msg_owner);
-            }
-            log_error("Acceso concurrente a %s :: dueño{%s} :: competidor{pid=%d user=%s tty=%s ip=%s cmd=%s}",
-                      target, buf, getpid(), me_user, me_tty, me_ip, cmd ? cmd : "(n/a)");
+/* Ejecuta un comando externo; devuelve su código de salida (1 si no se pudo tomar algún lock) */
+static int run_external(const char *cmd) {
+    if (g_cmd_kind == 0) g_cmd_kind = 1;
+    static Pipeline pl;
+    static LockInfo locks[LOCK_TARGETS_MAX];
+    LockTargets targets = { .n = 0 };
+    char *target = NULL;
+
+    /* tuberías y redirecciones las ejecutamos nosotros (y vemos sus archivos); el resto, como
+     * comando simple o con /bin/sh -c */
+    bool native = pipeline_parse(cmd, &pl) == 0 && (pl.nstages > 1 || pl.st[0].nredir > 0);
+    if (native) {
+        if (pipeline_targets(&pl, &targets) < 0) {
+            fprintf(stderr, "Demasiados archivos en la línea (máximo %d).\n", LOCK_TARGETS_MAX);
+            return 1;
+        }
+    } else if ((target = extract_target(cmd)) != NULL) {
+        add_target(&targets, target);
+    }
 
+    /* todos los locks o ninguno */
+    int nlocked = 0;
+    for (; nlocked < targets.n; nlocked++) {
+        LockInfo *lock = &locks[nlocked];
+        memset(lock, 0, sizeof(*lock));
+        lock->fd = -1;
+        if (acquire_file_lock(targets.path[nlocked], cmd, lock) < 0) {
+            report_lock_conflict(targets.path[nlocked], lock, cmd);
+            while (nlocked > 0) release_file_lock(&locks[--nlocked]);
             free(target);
-            return; /* No ejecutamos el comando si el archivo está en uso */
+            return 1; /* No ejecutamos el comando si algún archivo está en uso */
         }
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("/bin/sh", "sh", "-c", cmd, NULL);
-        _exit(127);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fflush(stdout);     /* lo pendiente sale antes que la salida del hijo */
+    int status = 127 << 8;
+    if (native) {
+        status = pipeline_run(&pl);
+    } else {
+        /* directo con posix_spawnp si no hay sintaxis de shell; si no, /bin/sh -c */
+        pid_t pid = spawn_command(cmd);
+        if (pid < 0)
+            log_error("No se pudo lanzar '%s': %s", cmd, strerror(errno));
+        else
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) ;
     }
-
-    int status = 0;
-    waitpid(pid, &status, 0);
-
-    if (status != 0) {
-        log_error("Comando terminó con código %d: %s", WEXITSTATUS(status), cmd);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long dur_ms = (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+
+    /* una etapa muerta por señal se reporta como sh: 128 + número de señal */
+    int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) {
+        log_error("Comando terminó por la señal %d (%s): %s", WTERMSIG(status), strsignal(WTERMSIG(status)), cmd);
+    } else if (status != 0) {
+        log_error("Comando terminó con código %d: %s", code, cmd);
     }
-    log_command("Comando terminó con código %d: %s", WEXITSTATUS(status), cmd);
+    log_exec(cmd, code, dur_ms, "Comando terminó con código %d: %s", code, cmd);
 
-    if (lock.fd >= 0) {
-        release_file_lock(&lock);
-    }
+    while (nlocked > 0) release_file_lock(&locks[--nlocked]);
     free(target);
+    return code;
 }
 
 
@@ -382,12 +409,11 @@ static int acquire_file_lock(const char *target_path, const char *cmd, LockInfo
     }
 
     /* Guardar contexto del dueño dentro del lockfile */
-    char user[64], tty[64], ip[64];
-    get_user_context(user, sizeof(user), tty, sizeof(tty), ip, sizeof(ip));
+    const UserContext *uc = log_context();
     ftruncate(fd, 0);
     dprintf(fd,
             "pid=%d\nuser=%s\ntty=%s\nip=%s\ncmd=%s\nfile=%s\n",
-            getpid(), user, tty, ip, cmd ? cmd : "(n/a)", target_path);
+            getpid(), uc->user, uc->tty, uc->ip, cmd ? cmd : "(n/a)", target_path);
 
     info->fd = fd;
     return fd;
@@ -408,32 +434,196 @@ static void release_file_lock(LockInfo *info) {
     }
 }
 
+/*
+ * --- Comandos internos ---
+ * Todos reciben la línea partida en palabras (argc/argv), el texto tras el nombre (rest, para
+ * los que aceptan espacios: cd, setconf, dueno, bitacora_*) y dónde escribir (out: stdout en la
+ * terminal, la tubería de la sesión en el servidor remoto). Devuelven el código de salida.
+ */
+typedef int (*BuiltinFn)(int argc, char **argv, const char *rest, FILE *out);
+
+#define BI_LOCAL 1      /* sólo en la terminal propia, no en una sesión remota */
+
+static int bi_terminar(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest; (void)out;
+    g_running = 0;
+    return 0;
+}
+
+static int bi_ayuda(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest;
+    help_plain(out);
+    return 0;
+}
+
+static int bi_showconf(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest;
+    static const char *mode_names[] = { "buffered", "durable", "async", "shared" };
+    LogStats ls;
+    log_stats(&ls);
+    fprintf(out, "PROGRAM_NAME=%s\n"
+            "MAX_INSTANCES=%d\n"
+            "LOG_DIR=%s\n"
+            "LOCK_DIR=%s\n"
+            "LOG_MODE=%s\n"
+            "LOG_FLUSH_MS=%d\n"
+            "LOG_RING_SLOTS=%d\n"
+            "LOG_BINARY=%d\n"
+            "ADMISSION_WAIT_SEC=%d\n"
+            "IPC_SLOTS=%d\n",
+            g_cfg.program_name,
+            g_cfg.max_instances,
+            g_cfg.log_dir,
+            g_cfg.lock_dir[0] ? g_cfg.lock_dir : "(no configurado)",
+            mode_names[g_cfg.log_mode],
+            g_cfg.log_flush_ms,
+            g_cfg.log_ring_slots,
+            g_cfg.log_binary,
+            g_cfg.admission_wait_sec,
+            g_cfg.ipc_slots);
+    uint64_t pub_gen = g_shared ? g_shared->config.generation : 0;
+    fprintf(out, "(config: generación local %lu, publicada %llu)\n",
+            config_generation(), (unsigned long long)pub_gen);
+    if (g_shared)
+        fprintf(out, "(IPC: formato v%u, casillas=%u (IPC_SLOTS=%d), broadcast=%u, %llu KiB)\n",
+                g_shared->hdr.version, g_shared->hdr.nslots, g_cfg.ipc_slots,
+                g_shared->hdr.nbcast, (unsigned long long)(g_shared->hdr.size / 1024));
+    if (ls.mode == LOG_MODE_SHARED && ls.ring_slots)
+        fprintf(out, "(bitácora compartida: anillo=%llu pendientes=%llu directos=%llu sin_escribir=%llu flusher=%d)\n",
+                (unsigned long long)ls.ring_slots, (unsigned long long)ls.pending,
+                (unsigned long long)ls.overflow, (unsigned long long)ls.unwritten, (int)ls.flusher_pid);
+    else if (ls.ring_slots)
+        fprintf(out, "(bitácora async: anillo=%llu pendientes=%llu descartados=%llu sin_escribir=%llu)\n",
+                (unsigned long long)ls.ring_slots, (unsigned long long)ls.pending,
+                (unsigned long long)ls.dropped, (unsigned long long)ls.unwritten);
+    return 0;
+}
+
+static int bi_bitacora_comandos(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv;
+    show_log_plain(false, rest, out);
+    return 0;
+}
+
+static int bi_bitacora_error(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv;
+    show_log_plain(true, rest, out);
+    return 0;
+}
+
+static int bi_cd(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv;
+    if (!*rest) {
+        fputs("Uso: cd <ruta>\n", out);
+        return 1;
+    }
+    if (chdir(rest) < 0) {
+        log_error("cd %s: %s", rest, strerror(errno));
+        return 1;
+    }
+    log_command("cd %s", rest);
+    return 0;
+}
+
+static int bi_setconf(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv;
+    char kv[SPAWN_LINE_MAX];
+    snprintf(kv, sizeof kv, "%s", rest);
+    char *eq = strrchr(kv, '=');
+    if (!eq) {
+        fputs("Uso: setconf clave=valor\n", out);
+        return 1;
+    }
+    *eq = '\0';
+    char *k = kv;
+    char *v = eq + 1;
+    trim(k); trim(v);
+    if (config_check(k, v) != 0) {
+        fprintf(out, "Valor inválido para %s: %s\n", k, v);
+        return 1;
+    }
+    if (set_config_key(g_cfg.conf_path, k, v) != 0) {
+        perror("set_config_key");
+        fputs("No se pudo modificar config\n", out);
+        return 1;
+    }
+    config_refresh(true);   /* relee, publica y reabre si cambió LOG_DIR o LOG_MODE */
+    log_command("setconf %s=%s", k, v);
+    return 0;
+}
+
 /* Muestra y vacía notificaciones para esta instancia */
-static void cmd_notificaciones(void) {
-    printf("(notificaciones)\n");
+static int bi_notificaciones(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest;
+    fprintf(out, "(notificaciones)\n");
     /* Reutiliza el drenado que ya tienes */
-    notif_drain_for(getpid());
+    notif_drain_for(getpid(), out);
+    return 0;
+}
+
+/* Contadores de todas las instancias vivas, leídos sin detenerlas */
+static int bi_estadisticas(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest;
+    int cap = instance_slots();
+    if (cap <= 0) {
+        fputs("Sin memoria compartida: no hay estadísticas de instancias.\n", out);
+        return 1;
+    }
+    pid_t *pids = malloc((size_t)cap * sizeof(*pids));
+    InstanceStats *st = aligned_alloc(alignof(InstanceStats), (size_t)cap * sizeof(*st));
+    int n = (pids && st) ? instance_stats_snapshot(pids, st, cap) : -1;
+    if (n < 0) {
+        fputs("Sin memoria para las estadísticas de instancias.\n", out);
+        free(pids); free(st);
+        return 1;
+    }
+    uint64_t tot[9] = {0};
+    fprintf(out, "%8s %7s %7s %7s %10s %10s %6s %6s %6s %10s\n", "pid", "cmds", "intern", "extern",
+            "lat_prom", "lat_max", "confl", "env", "recib", "bitacora");
+    for (int i = 0; i < n; i++) {
+        uint64_t v[9] = {
+            atomic_load(&st[i].cmds), atomic_load(&st[i].builtins), atomic_load(&st[i].externals),
+            atomic_load(&st[i].lat_total_us), atomic_load(&st[i].lat_max_us),
+            atomic_load(&st[i].lock_conflicts), atomic_load(&st[i].notif_sent),
+            atomic_load(&st[i].notif_recv), atomic_load(&st[i].log_bytes) };
+        fprintf(out, "%8d %7llu %7llu %7llu %8.1fms %8.1fms %6llu %6llu %6llu %10llu%s\n", (int)pids[i],
+                (unsigned long long)v[0], (unsigned long long)v[1], (unsigned long long)v[2],
+                v[0] ? (double)v[3] / (double)v[0] / 1000.0 : 0.0, (double)v[4] / 1000.0,
+                (unsigned long long)v[5], (unsigned long long)v[6], (unsigned long long)v[7],
+                (unsigned long long)v[8], pids[i] == getpid() ? "  (esta)" : "");
+        for (int k = 0; k < 9; k++) tot[k] = (k == 4) ? (v[4] > tot[4] ? v[4] : tot[4]) : tot[k] + v[k];
+    }
+    fprintf(out, "%8s %7llu %7llu %7llu %8.1fms %8.1fms %6llu %6llu %6llu %10llu\n", "total",
+            (unsigned long long)tot[0], (unsigned long long)tot[1], (unsigned long long)tot[2],
+            tot[0] ? (double)tot[3] / (double)tot[0] / 1000.0 : 0.0, (double)tot[4] / 1000.0,
+            (unsigned long long)tot[5], (unsigned long long)tot[6], (unsigned long long)tot[7],
+            (unsigned long long)tot[8]);
+    fprintf(out, "(%d instancias; el comando en curso se cuenta al terminar)\n", n);
+    free(pids); free(st);
+    return 0;
 }
 
 /* Muestra el dueño (si lo hay) del lock de un archivo */
-static void cmd_dueno(const char *arg) {
-    if (!arg || !*arg) {
-        puts("Uso: dueno <archivo>");
-        return;
+static int bi_dueno(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv;
+    const char *arg = rest;
+    if (!*arg) {
+        fputs("Uso: dueno <archivo>\n", out);
+        return 1;
     }
 
     char name[PATH_MAX];
     char path[PATH_MAX];
     sanitize(arg, name, sizeof(name));
     if (snprintf(path, sizeof(path), "%s/%s.lock", g_cfg.lock_dir, name) >= (int)sizeof(path)) {
-        puts("Ruta de lock demasiado larga.");
-        return;
+        fputs("Ruta de lock demasiado larga.\n", out);
+        return 1;
     }
 
     int fd = open(path, O_RDONLY);
     if (fd < 0) {
-        printf("Archivo libre (no hay lock): %s\n", arg);
-        return;
+        fprintf(out, "Archivo libre (no hay lock): %s\n", arg);
+        return 0;
     }
 
     char buf[512] = {0};
@@ -441,37 +631,153 @@ static void cmd_dueno(const char *arg) {
     close(fd);
 
     if (n <= 0) {
-        printf("Lock encontrado pero vacío: %s\n", path);
-        return;
+        fprintf(out, "Lock encontrado pero vacío: %s\n", path);
+        return 0;
     }
 
     /* Esperamos líneas con pid=, user=, tty=, ip=, cmd= que nosotros mismos escribimos al crear el lock */
-    printf("Dueño de '%s':\n%s\n", arg, buf);
+    fprintf(out, "Dueño de '%s':\n%s\n", arg, buf);
+    return 0;
 }
 
-/*
- * Ejecuta una línea exactamente con el mismo motor que se usa en el loop
- * interactivo (internos, locks, externos) pero escribiendo en 'out'.
- *
- * Adapta el cuerpo para llamar a tus funciones reales de dispatch;
- * un esquema típico:
- *  - if (strcmp(cmd, "ayuda")==0) { print_help(out); return 0; }
- *  - else if (...) ...
- *  - else { status = run_external(cmd, out); }
+static int bi_ip(int argc, char **argv, const char *rest, FILE *out) {
+    (void)rest;
+    if (argc < 2) {
+        fputs("Uso: IP <direccion>\n", out);
+        return 1;
+    }
+    const char *ip = argv[1];
+    if (remote_is_active()) {
+        fprintf(out, "Ya hay una sesión remota activa con %s. Usa 'desconectar' primero.\n", remote_current_ip());
+        return 1;
+    }
+    int port = g_cfg.remote_port > 0 ? g_cfg.remote_port : DEFAULT_REMOTE_PORT;
+    if (remote_connect(ip, port) != 0) {
+        log_error("Remoto: fallo de conexion a %s:%d (%s)", ip, port, strerror(errno));
+        fprintf(out, "Conexion fallida: %s\n", strerror(errno));
+        return 1;
+    }
+    log_command("Remoto: conectado a %s:%d", ip, port);
+    fprintf(out, "Conectado a %s:%d\n", ip, port);
+    return 0;
+}
+
+static int bi_desconectar(int argc, char **argv, const char *rest, FILE *out) {
+    (void)argc; (void)argv; (void)rest;
+    if (!remote_is_active()) {
+        fputs("No hay sesion remota activa.\n", out);
+        return 1;
+    }
+    log_command("Remoto: desconectando de %s", remote_current_ip());
+    remote_disconnect();
+    fputs("Sesion remota cerrada. De vuelta a local.\n", out);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    BuiltinFn   fn;
+    int         flags;
+} Builtin;
+
+static const Builtin g_builtins[] = {
+    { "terminar",          bi_terminar,          BI_LOCAL },
+    { "ayuda",             bi_ayuda,             0 },
+    { "showconf",          bi_showconf,          0 },
+    { "bitacora_comandos", bi_bitacora_comandos, 0 },
+    { "bitacora_error",    bi_bitacora_error,    0 },
+    { "cd",                bi_cd,                0 },
+    { "setconf",           bi_setconf,           BI_LOCAL },
+    { "notificaciones",    bi_notificaciones,    BI_LOCAL },
+    { "estadisticas",      bi_estadisticas,      0 },
+    { "dueno",             bi_dueno,             0 },
+    { "IP",                bi_ip,                BI_LOCAL },
+    { "desconectar",       bi_desconectar,       BI_LOCAL },
+};
+#define BUILTIN_COUNT ((int)(sizeof g_builtins / sizeof g_builtins[0]))
+
+/* Tabla hash abierta (sondeo lineal) de nombre -> índice+1; a lo más media llena */
+#define BUILTIN_HASH_SLOTS 32
+_Static_assert(BUILTIN_COUNT * 2 <= BUILTIN_HASH_SLOTS, "BUILTIN_HASH_SLOTS es chico para g_builtins");
+static int8_t g_builtin_hash[BUILTIN_HASH_SLOTS];
+
+static uint32_t builtin_hash(const char *s) {
+    uint32_t h = 2166136261u;                  /* FNV-1a */
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+/* Busca el interno name; la tabla se arma en la primera llamada */
+static const Builtin *builtin_find(const char *name) {
+    static bool ready;
+    if (!ready) {
+        for (int b = 0; b < BUILTIN_COUNT; b++) {
+            uint32_t i = builtin_hash(g_builtins[b].name) & (BUILTIN_HASH_SLOTS - 1);
+            while (g_builtin_hash[i]) i = (i + 1) & (BUILTIN_HASH_SLOTS - 1);
+            g_builtin_hash[i] = (int8_t)(b + 1);
+        }
+        ready = true;
+    }
+    for (uint32_t i = builtin_hash(name) & (BUILTIN_HASH_SLOTS - 1); g_builtin_hash[i];
+         i = (i + 1) & (BUILTIN_HASH_SLOTS - 1)) {
+        const Builtin *b = &g_builtins[g_builtin_hash[i] - 1];
+        if (strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+/**
+ * Ejecuta una línea: un interno en este mismo proceso o, si no lo es, un comando externo
+ * (locks, tuberías y redirecciones como siempre). Lo usan el bucle de texto y el servidor remoto.
+ * La salida de los internos va a out; la de los externos también (fd 1 apunta a out mientras corren).
+ * @return código de salida del comando (0 para una línea vacía).
  */
+int process_one_line(const char *line, FILE *out) {
+    char buf[SPAWN_LINE_MAX];
+    snprintf(buf, sizeof buf, "%s", line ? line : "");
+    trim(buf);
+    if (!buf[0]) return 0;      /* línea vacía: solo repinta prompt */
+
+    cmd_begin();
+    char words[SPAWN_LINE_MAX];
+    char *argv[SPAWN_ARGS_MAX];
+    int argc = spawn_split(buf, words, sizeof words, argv, SPAWN_ARGS_MAX);
+    const Builtin *b = argc > 0 ? builtin_find(argv[0]) : NULL;
+    int status;
+    if (b && (b->flags & BI_LOCAL) && g_exec_remote) {
+        fprintf(out, "'%s' no está disponible en una sesión remota.\n", b->name);
+        status = 1;
+    } else if (b) {
+        const char *rest = buf + strlen(argv[0]);
+        rest += strspn(rest, " \t");
+        status = b->fn(argc, argv, rest, out);
+    } else {
+        /* comando externo: su salida (y la de sus hijos) va por el fd de out */
+        fflush(out);
+        int saved = -1;
+        if (out != stdout) {
+            fflush(stdout);
+            saved = dup(STDOUT_FILENO);
+            dup2(fileno(out), STDOUT_FILENO);
+        }
+        status = run_external(buf);
+        if (saved >= 0) {
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+        }
+    }
+    cmd_end();
+    return status;
+}
+
+/* Una línea de una sesión remota (remote_server.c): mismo motor, con la salida en 'out' */
 int shell_execute_line(const char *line, FILE *out)
 {
-    int saved = dup(STDOUT_FILENO);
-    fflush(stdout);
-    dup2(fileno(out), STDOUT_FILENO);
-
-    /* usa tu propio pipeline */
-    extern int process_one_line(const char *); 
-    int status = process_one_line(line ? line : "");
-
-    fflush(stdout);
-    dup2(saved, STDOUT_FILENO);
-    close(saved);
+    g_exec_remote = true;
+    int status = process_one_line(line, out);
+    g_exec_remote = false;
+    fflush(out);
     return status;
 }
 
@@ -491,7 +797,8 @@ int main(int argc, char **argv) {
     fflush(stderr);
 
     /* 3) desactivar buffering para evitar pantallas vacías */
-    setbuf(stdout, NULL);
+    /* salida con buffer grande: un volcado largo son pocas write(), no una por línea */
+    setvbuf(stdout, NULL, _IOFBF, PLAIN_OUT_BUF);
     setbuf(stderr, NULL);
 
     /* 4) ignorar SIGHUP/SIGTSTP accidentales */
@@ -512,15 +819,38 @@ int main(int argc, char **argv) {
     }
 
     ensure_dirs(g_cfg.lock_dir);
+    log_init();
 
 /* --- Versión III: modo servidor remoto --- */
-    if (load_config(DEFAULT_CONF, &g_cfg) != 0) {
-    }
-
     if (argc > 1 && strcmp(argv[1], "--server") == 0) {
     	 return run_server();
     }
 
+    /* avisos de otras instancias: listos antes de registrarse, que es cuando pueden llegar */
+    g_notif_fd = notif_wakeup_fd();
+
+    /* admisión: a lo más MAX_INSTANCES instancias (el valor publicado más reciente) */
+    int adm = instance_try_enter();
+    if (adm == 1 && g_cfg.admission_wait_sec > 0) {
+        /* cola FIFO: esperar turno en vez de reintentar */
+        adm = instance_wait_enter(g_cfg.admission_wait_sec);
+        if (adm == 1)
+            fprintf(stderr, "No se liberó lugar en %d s (ADMISSION_WAIT_SEC).\n",
+                    g_cfg.admission_wait_sec);
+    }
+    if (adm == 1) {
+        /* el segmento puede tener menos casillas que MAX_INSTANCES (IPC_SLOTS al crearlo) */
+        int slots = instance_slots();
+        const char *why = (slots > 0 && slots < g_cfg.max_instances) ? "IPC_SLOTS" : "MAX_INSTANCES";
+        int limit = (slots > 0 && slots < g_cfg.max_instances) ? slots : g_cfg.max_instances;
+        fprintf(stderr, "Ya hay %d instancias activas (%s); intenta más tarde.\n", limit, why);
+        log_error("Instancia rechazada: se alcanzó %s=%d", why, limit);
+        log_shutdown();
+        return 1;
+    } else if (adm < 0) {
+        fprintf(stderr, "Aviso: sin IPC, no se limita el número de instancias.\n");
+    }
+
 
 
 
@@ -544,6 +874,7 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "D) entro al modo PLAIN\n");
         loop_plain();    /* tu bucle de texto puro */
 
+        log_shutdown();
         instance_leave();
         return 0;
     }
@@ -551,6 +882,7 @@ int main(int argc, char **argv) {
     /* Intento ncurses */
     if (!initscr()) {
         loop_plain();
+        log_shutdown();
         instance_leave();
         return 0;
     }
@@ -562,11 +894,11 @@ int main(int argc, char **argv) {
     refresh();
     
     while (g_running) {
-	fprintf(stderr, "→ loop_plain: conf_path='%s'\n", g_cfg.conf_path);
         int ch=getch();
         if (ch=='t'||ch=='T') break;
     }
     endwin();
+    log_shutdown();
     instance_leave();
     return 0;
 }